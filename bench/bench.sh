@@ -0,0 +1,78 @@
+#!/bin/sh
+# Runs dpatchz once per engine on the same diff and reports wall time.
+# Outputs of every engine are compared against the first one.
+#
+# usage: bench.sh [-n runs] [-d] [-x "extra dpatchz args"] dpatchz diff_file old_dir work_dir [engine...]
+#   -d  drop the page cache before each run (needs root), for cold cache numbers
+#
+# A synthetic case can be made with mksynth (cmake -DDPATCHZ_BUILD_BENCH=ON), e.g.
+#   mksynth -p assets -s 1G /tmp/synth && bench.sh build/dpatchz /tmp/synth/patch.krpdiff /tmp/synth/old /tmp/work
+
+set -e
+
+RUNS=3
+DROP=0
+EXTRA=""
+while getopts "n:dx:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        d) DROP=1 ;;
+        x) EXTRA=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 4 ]; then
+    sed -n '2,10p' "$0"
+    exit 1
+fi
+
+DPATCHZ=$1
+DIFF=$2
+OLD=$3
+WORK=$4
+shift 4
+ENGINES=${*:-copy mmap}
+
+mkdir -p "$WORK"
+REFERENCE=""
+
+for engine in $ENGINES; do
+    best=""
+    total=0
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        rm -rf "$WORK/$engine"
+        sync
+        if [ "$DROP" = 1 ]; then
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+
+        start=$(date +%s%N)
+        # shellcheck disable=SC2086
+        "$DPATCHZ" -e "$engine" $EXTRA "$DIFF" "$OLD" "$WORK/$engine" > /dev/null
+        sync
+        end=$(date +%s%N)
+
+        ms=$(( (end - start) / 1000000 ))
+        total=$((total + ms))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+        i=$((i + 1))
+    done
+
+    if [ -z "$REFERENCE" ]; then
+        REFERENCE=$engine
+    elif ! diff -rq "$WORK/$REFERENCE" "$WORK/$engine" > /dev/null; then
+        echo "$engine: output differs from $REFERENCE" >&2
+        exit 1
+    fi
+
+    printf "%-10s best %6d ms   avg %6d ms   (%d runs)\n" "$engine" "$best" $((total / RUNS)) "$RUNS"
+done
+
+for engine in $ENGINES; do
+    rm -rf "${WORK:?}/$engine"
+done
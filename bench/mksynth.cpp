@@ -0,0 +1,477 @@
+/*
+ * Generates a synthetic old tree and a HDIFF19 directory diff against it, shaped like
+ * the diffs dpatchz deals with, so engines can be compared without downloading builds.
+ *
+ *   assets: lots of small files, covers of a few dozen bytes interleaved with
+ *           equally small new data runs
+ *   pak:    a few huge files that mostly keep their content in place, with small
+ *           changed regions and the occasional shifted block
+ *
+ * It can also make the test cases CI runs: --expect writes the tree the diff should give,
+ * --same adds same file pairs (some moved), --removed old files covers read that the new
+ * version doesn't have, and --from starts from the new tree of an earlier run, for diffs
+ * that apply one after the other.
+ */
+#include "../thirdparty/argparse.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include <format>
+
+u64 cache_size = 4096;
+
+namespace {
+
+struct Rng {
+    u64 s;
+
+    u64 next() {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return s;
+    }
+
+    u64 range(u64 lo, u64 hi) {
+        return lo + next() % (hi - lo + 1);
+    }
+};
+
+// Inverse of Parser::read_varint
+void put_varint(std::vector<u8>& out, u64 v, u8 tag_bits = 0, bool sign = false) {
+    const u8 first_bits = 7 - tag_bits;
+    std::vector<u8> rest;
+    while(v >= (1ull << first_bits)) {
+        rest.push_back(v & 0x7f);
+        v >>= 7;
+    }
+
+    u8 first = v;
+    if(!rest.empty())
+        first |= 1 << first_bits;
+    if(sign)
+        first |= 0x80;
+    out.push_back(first);
+
+    for(size_t i = rest.size(); i-- > 0;)
+        out.push_back(rest[i] | (i > 0 ? 0x80 : 0));
+}
+
+struct SynthFile {
+    std::string name;
+    u64 size;
+};
+
+class Generator {
+private:
+    Rng rng;
+    std::filesystem::path out;
+
+    std::vector<SynthFile> old_files;
+    std::vector<u64> old_offsets;
+    std::vector<SynthFile> new_files;
+    std::vector<std::string> dirs;
+    // (old name, new name, size)
+    std::vector<std::tuple<std::string, std::string, u64>> same_files;
+
+    bool from;
+    bool expect;
+    std::ofstream expect_file;
+
+    std::vector<u8> cover_buf;
+    u64 cover_count = 0;
+    u64 last_old_end = 0;
+    u64 last_new_end = 0;
+    u64 new_pos = 0;
+
+    ZSTD_CCtx* cctx;
+    std::ofstream new_data;
+    u64 new_data_size = 0;
+    u64 new_data_compressed = 0;
+    std::vector<u8> scratch;
+
+    void compress(const u8* data, size_t size, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer in = { data, size, 0 };
+        std::vector<u8> buf(ZSTD_CStreamOutSize());
+        bool done = false;
+        while(!done) {
+            ZSTD_outBuffer o = { buf.data(), buf.size(), 0 };
+            size_t remaining = ZSTD_compressStream2(cctx, &o, &in, mode);
+            if(ZSTD_isError(remaining))
+                throw std::runtime_error(ZSTD_getErrorName(remaining));
+            new_data.write(reinterpret_cast<char*>(buf.data()), o.pos);
+            new_data_compressed += o.pos;
+            done = mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size;
+        }
+    }
+
+    void write_random(const std::string& name, u64 size) {
+        std::ofstream f(out / "old" / name, std::ios::binary);
+        std::vector<u8> buf;
+        while(size > 0) {
+            u64 chunk = std::min<u64>(size, 1 << 20);
+            buf.resize(chunk);
+            for(auto& b : buf)
+                b = rng.next();
+            f.write(reinterpret_cast<char*>(buf.data()), chunk);
+            size -= chunk;
+        }
+    }
+
+public:
+    void add_new_data(u64 length) {
+        while(length > 0) {
+            u64 chunk = std::min<u64>(length, 1 << 20);
+            scratch.resize(chunk);
+            for(auto& b : scratch)
+                b = rng.next();
+            compress(scratch.data(), chunk, ZSTD_e_continue);
+            if(expect)
+                expect_file.write(reinterpret_cast<char*>(scratch.data()), chunk);
+            new_data_size += chunk;
+            new_pos += chunk;
+            length -= chunk;
+        }
+    }
+
+    void add_cover(size_t old_file, u64 offset, u64 length) {
+        u64 old_pos = old_offsets[old_file] + offset;
+        i64 delta = static_cast<i64>(old_pos) - static_cast<i64>(last_old_end);
+        put_varint(cover_buf, delta < 0 ? -delta : delta, 1, delta < 0);
+        put_varint(cover_buf, new_pos - last_new_end);
+        put_varint(cover_buf, length);
+        cover_count++;
+
+        if(expect) {
+            std::ifstream f(out / "old" / old_files[old_file].name, std::ios::binary);
+            f.seekg(offset);
+            for(u64 left = length; left > 0;) {
+                u64 chunk = std::min<u64>(left, 1 << 20);
+                scratch.resize(chunk);
+                f.read(reinterpret_cast<char*>(scratch.data()), chunk);
+                expect_file.write(reinterpret_cast<char*>(scratch.data()), chunk);
+                left -= chunk;
+            }
+        }
+
+        new_pos += length;
+        last_old_end = old_pos + length;
+        last_new_end = new_pos;
+    }
+
+    // `from_` is an existing tree to use as the old one, the files the profile asks for that are
+    // already there keep their content
+    Generator(u64 seed, std::filesystem::path out_, const std::filesystem::path& from_, bool expect_)
+        : rng{seed * 0x9E3779B97F4A7C15ull + 1}, out(out_), from(!from_.empty()), expect(expect_) {
+        cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 1);
+        std::filesystem::create_directories(out / "old");
+        if(from)
+            std::filesystem::copy(from_, out / "old", std::filesystem::copy_options::recursive);
+        if(expect)
+            std::filesystem::create_directories(out / "new");
+        new_data.open(out / "newdata.zst.tmp", std::ios::binary);
+    }
+
+    ~Generator() {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    Rng& random() { return rng; }
+    const std::vector<SynthFile>& old() const { return old_files; }
+
+    void add_dir(const std::string& name) {
+        dirs.push_back(name);
+        std::filesystem::create_directories(out / "old" / name);
+        if(expect)
+            std::filesystem::create_directories(out / "new" / name);
+    }
+
+    void add_old_file(const std::string& name, u64 size) {
+        std::error_code ec;
+        u64 existing = std::filesystem::file_size(out / "old" / name, ec);
+        old_offsets.push_back(old_offsets.empty() ? 0 : old_offsets.back() + old_files.back().size);
+        old_files.push_back({ name, from && !ec ? existing : size });
+        if(from && !ec)
+            return;
+
+        write_random(name, size);
+    }
+
+    void begin_new_file(const std::string& name) {
+        new_files.push_back({ name, new_pos });
+        if(expect)
+            expect_file.open(out / "new" / name, std::ios::binary | std::ios::trunc);
+    }
+
+    void end_new_file() {
+        new_files.back().size = new_pos - new_files.back().size;
+        if(expect)
+            expect_file.close();
+    }
+
+    // `count` small files under same/ the new version has byte for byte, every fourth one
+    // under another name. With --from they are the same/ files of the tree instead
+    void add_same_files(u64 count) {
+        std::vector<std::string> names;
+        if(from && std::filesystem::is_directory(out / "old/same")) {
+            for(const auto& entry : std::filesystem::directory_iterator(out / "old/same"))
+                names.push_back("same/" + entry.path().filename().string());
+            std::sort(names.begin(), names.end());
+        }
+        else if(count > 0) {
+            std::filesystem::create_directories(out / "old/same");
+            for(u64 i = 0; i < count; i++) {
+                names.push_back(std::format("same/s{}.bin", i));
+                write_random(names.back(), rng.range(1, 4096));
+            }
+        }
+        if(names.empty())
+            return;
+
+        add_dir("same/");
+        for(size_t i = 0; i < names.size(); i++) {
+            std::string new_name = i % 4 == 0 ? "same/r" + names[i].substr(5) : names[i];
+            same_files.emplace_back(names[i], new_name, std::filesystem::file_size(out / "old" / names[i]));
+            if(expect)
+                std::filesystem::copy_file(out / "old" / names[i], out / "new" / new_name);
+        }
+    }
+
+    void finish() {
+        compress(nullptr, 0, ZSTD_e_end);
+        new_data.close();
+
+        // Root first and directories after the files. The same files sit between the first
+        // reference and the others, so with enough of them the offsets don't fit in a byte
+        std::vector<u8> head;
+        std::vector<std::string> old_paths = { "" }, new_paths = { "" };
+        std::vector<u64> old_refs, new_refs;
+        // (new path index, old path index)
+        std::vector<std::pair<u64, u64>> same_pairs(same_files.size());
+        for(size_t i = 0; i < old_files.size(); i++) {
+            old_refs.push_back(old_paths.size());
+            old_paths.push_back(old_files[i].name);
+            for(size_t j = 0; i == 0 && j < same_files.size(); j++) {
+                same_pairs[j].second = old_paths.size();
+                old_paths.push_back(std::get<0>(same_files[j]));
+            }
+        }
+        for(size_t i = 0; i < new_files.size(); i++) {
+            new_refs.push_back(new_paths.size());
+            new_paths.push_back(new_files[i].name);
+            for(size_t j = 0; i == 0 && j < same_files.size(); j++) {
+                same_pairs[j].first = new_paths.size();
+                new_paths.push_back(std::get<1>(same_files[j]));
+            }
+        }
+        old_paths.insert(old_paths.end(), dirs.begin(), dirs.end());
+        new_paths.insert(new_paths.end(), dirs.begin(), dirs.end());
+
+        u64 old_path_sum = 0, new_path_sum = 0;
+        for(const auto& p : old_paths) {
+            head.insert(head.end(), p.begin(), p.end());
+            head.push_back(0);
+            old_path_sum += p.size() + 1;
+        }
+        for(const auto& p : new_paths) {
+            head.insert(head.end(), p.begin(), p.end());
+            head.push_back(0);
+            new_path_sum += p.size() + 1;
+        }
+
+        u64 old_total = 0, new_total = 0, same_total = 0;
+        for(size_t i = 0; i < old_refs.size(); i++)
+            put_varint(head, old_refs[i] - (i == 0 ? 0 : old_refs[i - 1] + 1));
+        for(size_t i = 0; i < new_refs.size(); i++)
+            put_varint(head, new_refs[i] - (i == 0 ? 0 : new_refs[i - 1] + 1));
+        for(const auto& f : old_files) {
+            put_varint(head, f.size);
+            old_total += f.size;
+        }
+        for(const auto& f : new_files) {
+            put_varint(head, f.size);
+            new_total += f.size;
+        }
+        for(size_t i = 0; i < same_pairs.size(); i++) {
+            auto [new_index, old_index] = same_pairs[i];
+            i64 old_delta = static_cast<i64>(old_index) - (i == 0 ? 0 : static_cast<i64>(same_pairs[i - 1].second) + 1);
+            put_varint(head, new_index - (i == 0 ? 0 : same_pairs[i - 1].first + 1));
+            put_varint(head, old_delta < 0 ? -old_delta : old_delta, 1, old_delta < 0);
+            same_total += std::get<2>(same_files[i]);
+        }
+        for(size_t i = 0; i < new_files.size(); i++)
+            put_varint(head, 0);
+
+        std::vector<u8> d;
+        const char dir_magic[] = "HDIFF19&zstd&fadler64\0\1\1";
+        d.insert(d.end(), dir_magic, dir_magic + 24);
+        for(u64 v : std::initializer_list<u64>{ old_paths.size(), old_path_sum, new_paths.size(), new_path_sum,
+                                                 old_files.size(), old_total, new_files.size(), new_total,
+                                                 same_pairs.size(), same_total, 0, 0, 0, 0, head.size(), 0, 2 })
+            put_varint(d, v);
+        d.resize(d.size() + 8);
+        d.insert(d.end(), head.begin(), head.end());
+
+        const char diff_magic[] = "HDIFF13&zstd\0";
+        d.insert(d.end(), diff_magic, diff_magic + 13);
+        for(u64 v : std::initializer_list<u64>{ new_total, old_total, cover_count, cover_buf.size(), 0,
+                                                 0, 0, 0, 0, new_data_size, new_data_compressed })
+            put_varint(d, v);
+        d.insert(d.end(), cover_buf.begin(), cover_buf.end());
+
+        std::ofstream f(out / "patch.krpdiff", std::ios::binary);
+        f.write(reinterpret_cast<char*>(d.data()), d.size());
+        std::ifstream nd(out / "newdata.zst.tmp", std::ios::binary);
+        f << nd.rdbuf();
+        nd.close();
+        std::filesystem::remove(out / "newdata.zst.tmp");
+    }
+};
+
+void assets_profile(Generator& g, u64 total, u64 files) {
+    Rng& r = g.random();
+    u64 per_file = std::max<u64>(total / files, 1);
+
+    for(u64 d = 0; d < (files + 63) / 64; d++)
+        g.add_dir(std::format("assets/d{}/", d));
+    for(u64 i = 0; i < files; i++)
+        g.add_old_file(std::format("assets/d{}/a{}.uasset", i / 64, i), r.range(per_file / 2, per_file * 3 / 2) + 1);
+
+    const auto& old = g.old();
+    for(u64 i = 0; i < files; i++) {
+        g.begin_new_file(std::format("assets/d{}/a{}.uasset", i / 64, i));
+        u64 target = r.range(per_file / 2, per_file * 3 / 2) + 1;
+        u64 written = 0;
+        while(written < target) {
+            u64 kind = r.range(0, 99);
+            if(kind < 45) {
+                size_t f = r.range(0, old.size() - 1);
+                u64 len = kind < 42 ? r.range(8, 96) : r.range(4096, 256 << 10);
+                len = std::min({ len, old[f].size, target - written });
+                g.add_cover(f, r.range(0, old[f].size - len), len);
+                written += len;
+            }
+            else {
+                u64 len = std::min(r.range(4, 64), target - written);
+                g.add_new_data(len);
+                written += len;
+            }
+        }
+        g.end_new_file();
+    }
+}
+
+void pak_profile(Generator& g, u64 total, u64 files) {
+    Rng& r = g.random();
+    u64 per_file = std::max<u64>(total / files, 1 << 20);
+
+    // After the removed files
+    size_t first = g.old().size();
+    for(u64 i = 0; i < files; i++)
+        g.add_old_file(std::format("pakchunk{}.pak", i), per_file);
+
+    for(u64 i = 0; i < files; i++) {
+        g.begin_new_file(std::format("pakchunk{}.pak", i));
+        u64 written = 0;
+        i64 shift = 0;
+        while(written < per_file) {
+            u64 kind = r.range(0, 99);
+            if(kind < 90) {
+                // Same bytes at (roughly) the same place
+                i64 at = static_cast<i64>(written) + shift;
+                if(at < 0 || static_cast<u64>(at) >= per_file) {
+                    shift = 0;
+                    at = written;
+                }
+                u64 len = std::min({ r.range(1 << 20, 16 << 20), per_file - written, per_file - at });
+                g.add_cover(first + i, at, len);
+                written += len;
+            }
+            else if(kind < 97) {
+                u64 len = std::min(r.range(4 << 10, 64 << 10), per_file - written);
+                g.add_new_data(len);
+                written += len;
+            }
+            else {
+                // Something got inserted or removed, the rest of the file moves
+                shift += static_cast<i64>(r.range(0, 1 << 16)) - (1 << 15);
+            }
+        }
+        g.end_new_file();
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("mksynth");
+
+    program.add_argument("out_dir")
+        .help("Receives old/ and patch.krpdiff, and new/ with --expect");
+    program.add_argument("-p", "--profile")
+        .default_value(std::string("assets"))
+        .choices("assets", "pak");
+    program.add_argument("-s", "--size")
+        .help("Approximate size of the old tree, e.g. 512M or 20G")
+        .default_value(std::string("256M"));
+    program.add_argument("-f", "--files")
+        .help("Number of files. Default: 4096 for assets, 8 for pak")
+        .scan<'u', u64>();
+    program.add_argument("--seed")
+        .default_value(u64(1))
+        .scan<'u', u64>();
+    program.add_argument("--same")
+        .help("Number of same file pairs")
+        .default_value(u64(0))
+        .scan<'u', u64>();
+    program.add_argument("--removed")
+        .help("Number of old files without a new version. Only the assets profile reads them")
+        .default_value(u64(0))
+        .scan<'u', u64>();
+    program.add_argument("--from")
+        .help("Old tree to start from, e.g. the new/ of an earlier run. Its same/ files become the pairs")
+        .default_value(std::string());
+    program.add_argument("--expect")
+        .help("Also write the new tree the diff gives to new/")
+        .flag();
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    auto size = parse_size(program.get<std::string>("--size"));
+    if(!size) {
+        std::cerr << "Invalid size " << program.get<std::string>("--size") << std::endl;
+        return 1;
+    }
+
+    std::string profile = program.get<std::string>("--profile");
+    u64 files = program.present<u64>("--files").value_or(profile == "pak" ? 8 : 4096);
+
+    std::filesystem::path out = program.get<std::string>("out_dir");
+    if(std::filesystem::exists(out) && !std::filesystem::is_empty(out)) {
+        std::cerr << out.string() << " exists and is not empty" << std::endl;
+        return 1;
+    }
+
+    Generator g(program.get<u64>("--seed"), out, program.get<std::string>("--from"), program.get<bool>("--expect"));
+    g.add_same_files(program.get<u64>("--same"));
+    for(u64 i = 0; i < program.get<u64>("--removed"); i++)
+        g.add_old_file(std::format("removed{}.bin", i), g.random().range(1, 256 << 10));
+    if(profile == "pak")
+        pak_profile(g, *size, files);
+    else
+        assets_profile(g, *size, files);
+    g.finish();
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include "batch.hpp"
+#include "json.hpp"
+#include "dwhbll-logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+// The write buffer, the hot cache, the io_uring buffers and the in memory spill of --no-tmp
+u64 Batch::memory_of(const Job& job) {
+    const PatchOptions& options = job.options;
+    u64 size = options.write_buffer + options.hot_cache;
+    if(options.engine == EngineKind::Uring)
+        size += u64(options.queue_depth) << 18;
+    if(job.inplace && options.no_tmp)
+        size += options.spill_memory;
+    return size;
+}
+
+bool Batch::overlaps(const std::filesystem::path& a, const std::filesystem::path& b) {
+    auto [end_a, end_b] = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+    return end_a == a.end() || end_b == b.end();
+}
+
+dev_t Batch::device_of(std::filesystem::path path) {
+    path = std::filesystem::absolute(path);
+    struct stat st;
+    while(stat(path.c_str(), &st) != 0) {
+        if(path == path.parent_path())
+            return 0;
+        path = path.parent_path();
+    }
+    return st.st_dev;
+}
+
+unsigned Batch::device_limit(dev_t device, unsigned per_device) {
+    if(per_device > 0)
+        return per_device;
+    // Partitions have it on the disk they're on, one level up
+    std::string dev = std::format("/sys/dev/block/{}:{}", major(device), minor(device));
+    for(const char* file : { "/queue/rotational", "/../queue/rotational" }) {
+        std::ifstream in(dev + file);
+        int rotational;
+        if(in >> rotational)
+            return rotational ? 1 : UINT_MAX;
+    }
+    // Not a block device: tmpfs, network filesystems...
+    return UINT_MAX;
+}
+
+void Batch::parse_job(const Json& entry, const std::filesystem::path& base, const PatchOptions& options,
+                      Job& job) {
+    auto path_of = [&](std::string_view key) -> std::filesystem::path {
+        std::string value = entry.get_string(key);
+        return value.empty() ? std::filesystem::path() : base / value;
+    };
+
+    if(entry.type != Json::Type::Object)
+        throw std::runtime_error("has to be an object");
+    job.name = entry.get_string("name", job.name);
+    job.diff = path_of("diff");
+    job.old_path = path_of("old");
+    job.new_path = path_of("new");
+    if(job.diff.empty() || job.old_path.empty())
+        throw std::runtime_error("needs at least \"diff\" and \"old\"");
+    // Without a new_path it's patched in place
+    job.inplace = job.new_path.empty();
+
+    job.options = options;
+    if(job.inplace)
+        job.options.link_unchanged = LinkMode::None;
+    else
+        job.options.no_tmp = job.options.delete_removed = false;
+
+    job.options.no_tmp = entry.get_bool("no_tmp", job.options.no_tmp);
+    job.options.delete_removed = entry.get_bool("delete_removed", job.options.delete_removed);
+    job.options.journal = entry.get_bool("journal", job.options.journal);
+    job.options.skip_existing = path_of("skip_existing");
+    job.options.undo_log = path_of("undo_log");
+    std::string link = entry.get_string("link_unchanged");
+    if(link == "reflink")
+        job.options.link_unchanged = LinkMode::Reflink;
+    else if(link == "hardlink")
+        job.options.link_unchanged = LinkMode::Hardlink;
+    else if(!link.empty())
+        throw std::runtime_error("\"link_unchanged\" has to be \"reflink\" or \"hardlink\"");
+
+    if(!job.inplace && (job.options.no_tmp || job.options.delete_removed || !job.options.undo_log.empty()))
+        throw std::runtime_error("\"no_tmp\", \"delete_removed\" and \"undo_log\" need a patch in place");
+    if(job.inplace && job.options.link_unchanged != LinkMode::None)
+        throw std::runtime_error("\"link_unchanged\" needs a \"new\" path");
+}
+
+Batch::Batch(const std::filesystem::path& manifest, const PatchOptions& options) {
+    Json json = Json::parse_file(manifest);
+    const Json* list = &json;
+    if(json.type == Json::Type::Object)
+        list = json.find("jobs");
+    if(!list || list->type != Json::Type::Array)
+        throw std::runtime_error(std::format("{} has to be a list of jobs, or an object with one in \"jobs\"",
+                                             manifest.string()));
+
+    for(size_t i = 0; i < list->array.size(); i++) {
+        Job job;
+        job.name = std::to_string(i + 1);
+        try {
+            parse_job(list->array[i], manifest.parent_path(), options, job);
+        } catch(const std::exception& e) {
+            throw std::runtime_error(std::format("Job {} of {}: {}", job.name, manifest.string(), e.what()));
+        }
+        jobs.push_back(std::move(job));
+    }
+}
+
+int Batch::run(unsigned threads, u64 memory, unsigned per_device) {
+    results.assign(jobs.size(), {});
+
+    // What each job writes and reads, jobs where they overlap can't run at the same time
+    std::vector<std::filesystem::path> writes, reads;
+    for(const Job& job : jobs) {
+        reads.push_back(std::filesystem::weakly_canonical(job.old_path));
+        writes.push_back(job.inplace ? reads.back() : std::filesystem::weakly_canonical(job.new_path));
+    }
+    auto conflict = [&](size_t a, size_t b) {
+        return overlaps(writes[a], writes[b]) || overlaps(writes[a], reads[b]) || overlaps(writes[b], reads[a]);
+    };
+
+    // The disks each job reads and writes, and how many jobs each one takes at once
+    std::vector<std::vector<dev_t>> devices;
+    std::map<dev_t, unsigned> limits, busy;
+    for(size_t i = 0; i < jobs.size(); i++) {
+        devices.push_back({ device_of(reads[i]) });
+        dev_t written = device_of(writes[i]);
+        if(written != devices.back()[0])
+            devices.back().push_back(written);
+        for(dev_t dev : devices.back())
+            limits.try_emplace(dev, device_limit(dev, per_device));
+    }
+    for(const auto& [dev, limit] : limits) {
+        if(limit < threads)
+            dwhbll::console::debug("Batch: at most {} patches at once on device {}:{}", limit, major(dev), minor(dev));
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<bool> started(jobs.size(), false);
+    std::vector<size_t> running;
+    u64 used = 0;
+    size_t done = 0;
+    bool stop = false;
+    // Old tree of the last job that finished, likely still in the page cache
+    std::filesystem::path last_read;
+
+    // The first job that doesn't wait for an earlier one or a running one and fits in
+    // what's left of the budget and of its disks, jobs.size() if there is none right now.
+    // One reading a tree that is being read or was just read goes first
+    auto next = [&]() {
+        size_t first = jobs.size();
+        for(size_t i = 0; i < jobs.size(); i++) {
+            if(started[i])
+                continue;
+            bool blocked = !running.empty() && used + memory_of(jobs[i]) > memory;
+            for(size_t r : running)
+                blocked = blocked || conflict(i, r);
+            for(size_t j = 0; j < i && !blocked; j++)
+                blocked = !started[j] && conflict(i, j);
+            for(dev_t dev : devices[i])
+                blocked = blocked || busy[dev] >= limits[dev];
+            if(blocked)
+                continue;
+
+            bool warm = reads[i] == last_read;
+            for(size_t r : running)
+                warm = warm || reads[i] == reads[r];
+            if(warm)
+                return i;
+            first = std::min(first, i);
+        }
+        return first;
+    };
+
+    auto worker = [&]() {
+        std::unique_lock lock(mutex);
+        while(true) {
+            size_t i = jobs.size();
+            wake.wait(lock, [&]() {
+                if(stop || std::find(started.begin(), started.end(), false) == started.end())
+                    return true;
+                i = next();
+                return i < jobs.size();
+            });
+            if(i == jobs.size())
+                return;
+
+            started[i] = true;
+            running.push_back(i);
+            used += memory_of(jobs[i]);
+            for(dev_t dev : devices[i])
+                busy[dev]++;
+            // Descriptors opened before it writes there would be the files it replaces
+            old_fds.forget(writes[i]);
+            lock.unlock();
+
+            const Job& job = jobs[i];
+            Result result;
+            auto start = std::chrono::steady_clock::now();
+            dwhbll::console::info("Batch: starting {} ({}/{})", job.name, i + 1, jobs.size());
+            try {
+                Patcher::check_paths(job.diff, job.old_path, job.new_path, job.options);
+                DirDiff diff;
+                try {
+                    diff = DirDiff::load(job.diff);
+                } catch(const std::exception& e) {
+                    throw std::runtime_error(std::format("Failed to parse {}: {}", job.diff.string(), e.what()));
+                }
+                Patcher patcher(diff, job.diff, job.old_path, job.new_path, job.options);
+                patcher.old_fds = &old_fds;
+                patcher.patch(job.inplace);
+                result.status = Result::Done;
+            } catch(const PatchError& e) {
+                result.status = e.interrupted() ? Result::Interrupted : Result::Failed;
+                result.error = e.describe();
+            } catch(const std::exception& e) {
+                result.status = Result::Failed;
+                result.error = e.what();
+            }
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if(result.status == Result::Done)
+                dwhbll::console::info("Batch: {} done in {:.1f}s", job.name, result.seconds);
+            else if(result.status == Result::Failed)
+                dwhbll::console::error("Batch: {} failed: {}", job.name, result.error);
+
+            lock.lock();
+            results[i] = std::move(result);
+            running.erase(std::find(running.begin(), running.end(), i));
+            used -= memory_of(jobs[i]);
+            for(dev_t dev : devices[i])
+                busy[dev]--;
+            old_fds.forget(writes[i]);
+            last_read = reads[i];
+            done++;
+            // Whatever is left would stop right away
+            if(results[i].status == Result::Interrupted)
+                stop = true;
+            wake.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(unsigned t = 1; t < std::min<size_t>(threads, jobs.size()); t++)
+        pool.emplace_back(worker);
+    worker();
+    for(std::thread& thread : pool)
+        thread.join();
+
+    size_t failed = 0, interrupted = 0;
+    for(const Result& result : results) {
+        failed += result.status == Result::Failed;
+        interrupted += result.status == Result::Interrupted;
+    }
+    dwhbll::console::info("Batch: {} of {} patches done, {} failed, {} interrupted, {} not started",
+                          done - failed - interrupted, jobs.size(), failed, interrupted, jobs.size() - done);
+    dwhbll::console::debug("Batch: {} old files opened, {} times shared by another patch", old_fds.opened,
+                           old_fds.reused);
+    if(interrupted > 0) {
+        dwhbll::console::info("Interrupted, run the same batch again to resume");
+        return 130;
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+void Batch::write_report(const std::filesystem::path& path) const {
+    static constexpr const char* STATUS[] = { "skipped", "done", "failed", "interrupted" };
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if(!out)
+        throw std::runtime_error(std::format("Failed to create {} ({})", path.string(), strerror(errno)));
+    out << "{\"jobs\": [";
+    for(size_t i = 0; i < jobs.size(); i++) {
+        const Result& result = results[i];
+        out << (i ? ",\n  " : "\n  ") << std::format("{{\"name\": {}, \"status\": \"{}\", \"seconds\": {:.3f}",
+                                                      Json::quote(jobs[i].name), STATUS[result.status],
+                                                      result.seconds);
+        if(!result.error.empty())
+            out << ", \"error\": " << Json::quote(result.error);
+        out << "}";
+    }
+    out << "\n]}\n";
+    if(!out.flush())
+        throw std::runtime_error(std::format("Failed to write {}", path.string()));
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "patching.hpp"
+
+class Json;
+
+/*
+ * dpatchz batch: every patch of a JSON manifest in one process, e.g. all the resource groups
+ * of a version update. Up to `threads` patches run at once, as many as fit in the memory
+ * budget together and as many as each disk they use allows, and a patch that writes where
+ * another one reads or writes waits for it, in manifest order. Patches reading the same old
+ * tree share its descriptors, and one that reads a tree another patch is reading or just
+ * read goes before the others while its data is still in the page cache. A failed patch
+ * doesn't stop the others
+ */
+class Batch {
+public:
+    struct Job {
+        std::string name;
+        std::filesystem::path diff;
+        std::filesystem::path old_path;
+        // Empty with -i
+        std::filesystem::path new_path;
+        bool inplace = false;
+        PatchOptions options;
+    };
+
+    struct Result {
+        enum Status {
+            // Never started, the batch was interrupted first
+            Skipped,
+            Done,
+            Failed,
+            Interrupted,
+        };
+
+        Status status = Skipped;
+        std::string error;
+        double seconds = 0;
+    };
+
+    std::vector<Job> jobs;
+    std::vector<Result> results;
+    OldFdTable old_fds;
+
+    // Reads the jobs of `manifest`, each one gets `options` with what it sets on top. Relative
+    // paths are relative to the manifest. Throws if it isn't a valid manifest
+    Batch(const std::filesystem::path& manifest, const PatchOptions& options);
+
+    // Fills `job` from an entry of a manifest, with `options` and what it sets on top. Relative
+    // paths are relative to `base`. Throws if it isn't a valid job
+    static void parse_job(const Json& entry, const std::filesystem::path& base, const PatchOptions& options,
+                          Job& job);
+    // Roughly what a patch keeps allocated, for the memory budget
+    static u64 memory_of(const Job& job);
+    // True if one of the paths is the other or inside it
+    static bool overlaps(const std::filesystem::path& a, const std::filesystem::path& b);
+    // The device of `path`, or of its closest parent that exists
+    static dev_t device_of(std::filesystem::path path);
+    // How many patches may use `device` at once: `per_device` if set, otherwise 1 for a
+    // spinning disk and no limit for anything else
+    static unsigned device_limit(dev_t device, unsigned per_device);
+
+    // Runs every job, returns 0 if they all succeeded, 130 if they were interrupted, 1 otherwise.
+    // `per_device` is how many may run on one disk at once, 0 to decide from the disk
+    int run(unsigned threads, u64 memory, unsigned per_device = 0);
+    // The results as JSON
+    void write_report(const std::filesystem::path& path) const;
+};
@@ -0,0 +1,422 @@
+#include "chain.hpp"
+#include "engines.hpp"
+#include "dwhbll-logging.hpp"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static constexpr u32 NONE = UINT32_MAX;
+// Size of an old_path file that isn't there anymore
+static constexpr u64 MOVED = UINT64_MAX;
+
+// Appends a segment, as part of the last one when it continues it
+static void add_segment(std::vector<Chain::Segment>& out, const Chain::Segment& segment) {
+    if(segment.length == 0)
+        return;
+    if(!out.empty()) {
+        Chain::Segment& last = out.back();
+        if(last.src == segment.src && last.offset + last.length == segment.offset) {
+            last.length += segment.length;
+            return;
+        }
+    }
+    out.push_back(segment);
+}
+
+void Chain::slice(const Resolved& file, u64 offset, u64 length, std::vector<Segment>& out) {
+    if(length == 0)
+        return;
+    size_t i = std::upper_bound(file.starts.begin(), file.starts.end(), offset) - file.starts.begin() - 1;
+    while(length > 0) {
+        const Segment& segment = file.segments[i];
+        u64 skip = offset - file.starts[i];
+        u64 n = std::min(length, segment.length - skip);
+        add_segment(out, { segment.src, segment.offset + skip, n });
+        offset += n;
+        length -= n;
+        i++;
+    }
+}
+
+u32 Chain::old_id(const std::string& name) {
+    auto it = old_ids.find(name);
+    if(it != old_ids.end())
+        return it->second;
+
+    u64 size;
+    if(auto known = expected.find(name); known != expected.end()) {
+        size = known->second;
+    }
+    else {
+        std::error_code ec;
+        size = std::filesystem::file_size(source / name, ec);
+        // Only ever the source of a same file pair, a resumed -i patch moved it already
+        if(ec == std::errc::no_such_file_or_directory)
+            size = MOVED;
+        else if(ec)
+            throw std::runtime_error(std::format("Failed to stat {} ({})", (source / name).string(), ec.message()));
+    }
+    old_names.push_back(name);
+    old_sizes.push_back(size);
+    return old_ids.emplace(name, old_names.size() - 1).first->second;
+}
+
+const Chain::Resolved& Chain::resolve(size_t level, const std::string& name) {
+    if(auto it = memo[level].find(name); it != memo[level].end())
+        return it->second;
+
+    Resolved file;
+    if(level == 0) {
+        u32 id = old_id(name);
+        add_segment(file.segments, { id, 0, old_sizes[id] });
+    }
+    else {
+        const Step& step = steps[level - 1];
+        const HeadData& head = diffs[level - 1].headData;
+        if(auto index = step.new_index.find(name); index != step.new_index.end()) {
+            u64 pos = step.data_start[index->second];
+            for(const PlanOp& op : step.plan.file(index->second)) {
+                if(op.kind == PlanOp::NEW_DATA) {
+                    add_segment(file.segments, { BLOB + static_cast<u32>(level - 1), pos, op.length });
+                    pos += op.length;
+                }
+                else {
+                    slice(resolve(level - 1, head.oldFiles[op.old_file].name), op.old_offset, op.length,
+                          file.segments);
+                }
+            }
+        }
+        else if(auto pair = step.pair_source.find(name); pair != step.pair_source.end()) {
+            file.segments = resolve(level - 1, pair->second).segments;
+        }
+        else if(step.empty.contains(name)) {
+        }
+        else if(step.old_names.contains(name)) {
+            throw std::runtime_error(std::format("{} is read after {} deleted it", name,
+                                                 diff_files[level - 1].string()));
+        }
+        else {
+            file = resolve(level - 1, name);
+        }
+    }
+
+    file.starts.clear();
+    file.size = 0;
+    for(const Segment& segment : file.segments) {
+        file.starts.push_back(file.size);
+        file.size += segment.length;
+    }
+    return memo[level].emplace(name, std::move(file)).first->second;
+}
+
+std::optional<std::string> Chain::origin(size_t level, std::string name) const {
+    for(size_t i = level; i-- > 0;) {
+        const Step& step = steps[i];
+        if(auto pair = step.pair_source.find(name); pair != step.pair_source.end())
+            name = pair->second;
+        else if(step.new_index.contains(name) || step.empty.contains(name) || step.old_names.contains(name))
+            return std::nullopt;
+    }
+    return name;
+}
+
+bool Chain::exists(size_t level, const std::string& name) const {
+    for(size_t i = level; i-- > 0;) {
+        const Step& step = steps[i];
+        if(step.new_index.contains(name) || step.pair_source.contains(name) || step.empty.contains(name))
+            return true;
+        if(step.old_names.contains(name))
+            return false;
+    }
+    return expected.contains(name) || std::filesystem::is_regular_file(source / name);
+}
+
+Chain Chain::build(const std::vector<std::filesystem::path>& diff_files, const std::filesystem::path& source) {
+    Chain chain;
+    chain.diff_files = diff_files;
+    chain.source = source;
+
+    for(const auto& path : diff_files) {
+        Step step;
+        try {
+            chain.diffs.push_back(DirDiff::load(path));
+            step.plan = Plan::build(chain.diffs.back());
+        } catch(const std::exception& e) {
+            throw std::runtime_error(std::format("Failed to parse {}: {}", path.string(), e.what()));
+        }
+
+        const HeadData& head = chain.diffs.back().headData;
+        u64 pos = 0;
+        for(size_t i = 0; i < head.newFiles.size(); i++) {
+            step.new_index.emplace(head.newFiles[i].name, i);
+            step.data_start.push_back(pos);
+            for(const PlanOp& op : step.plan.file(i)) {
+                if(op.kind == PlanOp::NEW_DATA)
+                    pos += op.length;
+            }
+        }
+        for(const auto& pair : head.sameFiles)
+            step.pair_source.emplace(pair.newName, pair.oldName);
+        step.empty.insert(head.emptyFiles.begin(), head.emptyFiles.end());
+        for(const auto& file : head.oldFiles)
+            step.old_names.insert(file.name);
+        step.old_names.insert(head.otherOldFiles.begin(), head.otherOldFiles.end());
+        chain.steps.push_back(std::move(step));
+    }
+
+    const size_t count = chain.diffs.size();
+    const DirDiff& last = chain.diffs.back();
+    const Step& last_step = chain.steps.back();
+
+    // The old files of every diff that are still files of old_path, in the order they come up.
+    // The sizes of the ones read come from the diffs, so a resumed -i patch that already
+    // replaced some still finds them
+    std::vector<std::string> originals;
+    for(size_t j = 0; j < count; j++) {
+        const HeadData& head = chain.diffs[j].headData;
+        auto add = [&](const std::string& name, std::optional<u64> size) {
+            std::optional<std::string> origin = chain.origin(j, name);
+            if(!origin)
+                return;
+            if(std::find(originals.begin(), originals.end(), *origin) == originals.end())
+                originals.push_back(*origin);
+            if(size)
+                chain.expected.emplace(*origin, *size);
+        };
+        for(const auto& file : head.oldFiles)
+            add(file.name, file.fileSize);
+        for(const auto& name : head.otherOldFiles)
+            add(name, std::nullopt);
+    }
+
+    chain.memo.resize(count + 1);
+    for(size_t j = 0; j < count; j++) {
+        for(const auto& file : chain.diffs[j].headData.oldFiles) {
+            u64 size = chain.resolve(j, file.name).size;
+            if(size != file.fileSize) {
+                throw std::runtime_error(std::format("{} expects {} to be {} bytes, it is {} after {}. The diffs "
+                                                     "have to be given in the order they apply", diff_files[j].string(),
+                                                     file.name, file.fileSize, size, diff_files[j - 1].string()));
+            }
+        }
+    }
+
+    // Whether a file after the whole chain is the old_path file `name` as it was
+    auto unchanged = [&](const std::string& name, const Resolved& file) {
+        auto it = chain.old_ids.find(name);
+        if(it == chain.old_ids.end() || file.size != chain.old_sizes[it->second])
+            return false;
+        return file.size == 0 || (file.segments.size() == 1 && file.segments[0].src == it->second &&
+                                  file.segments[0].offset == 0);
+    };
+    auto survives = [&](const std::string& name) {
+        return chain.exists(count, name) && unchanged(name, chain.resolve(count, name));
+    };
+
+    HeadData head;
+    Plan& plan = chain.plan;
+    plan.file_ops.push_back(0);
+    // Covers for segments, joined to the last op of the same file when they continue it
+    auto add_covers = [&](const std::vector<Segment>& segments, u64& out) {
+        for(const Segment& segment : segments) {
+            if(plan.ops.size() > plan.file_ops.back()) {
+                PlanOp& op = plan.ops.back();
+                if(op.kind == PlanOp::COVER && op.old_file == segment.src &&
+                   op.old_offset + op.length == segment.offset) {
+                    op.length += segment.length;
+                    out += segment.length;
+                    continue;
+                }
+            }
+            plan.ops.push_back({ PlanOp::COVER, segment.src, segment.offset, out, segment.length });
+            out += segment.length;
+        }
+    };
+
+    // The new files of the last diff keep their new data, which is what the patch streams
+    for(size_t i = 0; i < last.headData.newFiles.size(); i++) {
+        u64 out = 0;
+        for(const PlanOp& op : last_step.plan.file(i)) {
+            if(op.kind == PlanOp::NEW_DATA) {
+                plan.ops.push_back({ PlanOp::NEW_DATA, 0, 0, out, op.length });
+                out += op.length;
+                continue;
+            }
+            std::vector<Segment> segments;
+            slice(chain.resolve(count - 1, last.headData.oldFiles[op.old_file].name), op.old_offset, op.length,
+                  segments);
+            add_covers(segments, out);
+        }
+        head.newFiles.push_back(last.headData.newFiles[i]);
+        plan.file_ops.push_back(plan.ops.size());
+    }
+
+    // Then everything else the diffs write that is still there at the end: an old_path file
+    // under another name is a same file pair, anything else only covers
+    std::unordered_set<std::string> seen;
+    for(const auto& file : last.headData.newFiles)
+        seen.insert(file.name);
+    std::vector<std::string> written;
+    for(size_t j = 0; j < count; j++) {
+        const HeadData& diff_head = chain.diffs[j].headData;
+        for(const auto& file : diff_head.newFiles) {
+            if(seen.insert(file.name).second)
+                written.push_back(file.name);
+        }
+        for(const auto& pair : diff_head.sameFiles) {
+            if(seen.insert(pair.newName).second)
+                written.push_back(pair.newName);
+        }
+        for(const auto& name : diff_head.emptyFiles) {
+            if(seen.insert(name).second)
+                written.push_back(name);
+        }
+    }
+
+    std::vector<u32> pair_sources;
+    for(const std::string& name : written) {
+        if(!chain.exists(count, name))
+            continue;
+        const Resolved& file = chain.resolve(count, name);
+        // Still has to be in new_path if the last diff lists it, like applying it alone does
+        if(unchanged(name, file)) {
+            if(last_step.pair_source.contains(name) || last_step.empty.contains(name))
+                pair_sources.push_back(chain.old_ids.at(name));
+            continue;
+        }
+        if(file.segments.empty()) {
+            head.emptyFiles.push_back(name);
+        }
+        else if(file.segments.size() == 1 && file.segments[0].src < BLOB && file.segments[0].offset == 0 &&
+                file.size == chain.old_sizes[file.segments[0].src]) {
+            head.sameFiles.push_back({ chain.old_names[file.segments[0].src], name });
+            pair_sources.push_back(file.segments[0].src);
+        }
+        else {
+            u64 out = 0;
+            add_covers(file.segments, out);
+            head.newFiles.push_back({ name, 0, file.size });
+            plan.file_ops.push_back(plan.ops.size());
+        }
+    }
+
+    // Pair sources that stay where they are, so --delete-removed leaves them alone, and
+    // the unchanged files listed above
+    std::unordered_set<u32> kept;
+    for(u32 src : pair_sources) {
+        const std::string& name = chain.old_names[src];
+        if(kept.insert(src).second && survives(name)) {
+            head.sameFiles.push_back({ name, name });
+            head.otherOldFiles.push_back(name);
+        }
+    }
+
+    // old_path files the chain replaces or deletes are the old files of the whole chain. The
+    // ones still on disk, a resumed -i patch may have deleted some already
+    std::vector<u32> index;
+    for(const std::string& name : originals) {
+        if(survives(name) || (!chain.expected.contains(name) && !std::filesystem::is_regular_file(source / name)))
+            continue;
+        u32 id = chain.old_id(name);
+        index.resize(chain.old_names.size(), NONE);
+        index[id] = head.oldFiles.size();
+        head.oldFiles.push_back({ name, 0, chain.old_sizes[id] });
+    }
+    index.resize(chain.old_names.size(), NONE);
+
+    // The others covers read come after them: old_path files no diff changes, then the new
+    // data of earlier diffs
+    std::vector<u32> blob_index(count, NONE);
+    for(PlanOp& op : plan.ops) {
+        if(op.kind != PlanOp::COVER)
+            continue;
+        u32& to = op.old_file < BLOB ? index[op.old_file] : blob_index[op.old_file - BLOB];
+        if(to == NONE) {
+            to = head.oldFiles.size() + chain.extra.size();
+            chain.extra.push_back({ op.old_file, op.old_file < BLOB ? chain.old_sizes[op.old_file] : 0 });
+        }
+        if(op.old_file >= BLOB) {
+            u64& size = chain.extra[to - head.oldFiles.size()].second;
+            size = std::max(size, op.old_offset + op.length);
+        }
+        op.old_file = to;
+    }
+
+    head.oldDirs = chain.diffs.front().headData.oldDirs;
+    head.newDirs = last.headData.newDirs;
+
+    chain.diff = last;
+    chain.diff.headData = std::move(head);
+    chain.diff.oldRefFileCount.value = chain.diff.headData.oldFiles.size();
+    chain.diff.newRefFileCount.value = chain.diff.headData.newFiles.size();
+    chain.diff.sameFilePairCount.value = chain.diff.headData.sameFiles.size();
+    chain.diff.sameFileSize.value = 0;
+    for(const auto& pair : chain.diff.headData.sameFiles)
+        chain.diff.sameFileSize.value += chain.old_sizes[chain.old_id(pair.oldName)];
+    for(const Step& step : chain.steps)
+        plan.covers_in += step.plan.covers_in;
+
+    // Only what add_old_files() needs is kept
+    chain.steps.clear();
+    chain.memo.clear();
+    return chain;
+}
+
+std::string Chain::identify() const {
+    std::string id;
+    for(const auto& path : diff_files)
+        id += (id.empty() ? "" : "+") + Journal::identify(path);
+    return id;
+}
+
+void Chain::add_old_files(OldFiles& old, const std::filesystem::path& dir, u64 memory) const {
+    u64 blobs = 0;
+    for(auto [src, size] : extra) {
+        if(src >= BLOB)
+            blobs += size;
+    }
+
+    for(auto [src, size] : extra) {
+        if(src < BLOB) {
+            std::filesystem::path path = source / old_names[src];
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0)
+                throw std::runtime_error(std::format("Failed to open {} ({})", path.string(), strerror(errno)));
+            old.add(path, fd, size);
+            continue;
+        }
+
+        size_t j = src - BLOB;
+        dwhbll::console::info("Decompressing {} of new data from {}", format_size(size), diff_files[j].string());
+        OutputFile out;
+        out.open_unnamed(dir, std::format("chain-{}", j + 1), blobs <= memory);
+        out.preallocate(size);
+        NewDataStream stream(diff_files[j], diffs[j].mainDiff.newDataOffset);
+        std::vector<u8> buffer(std::min<u64>(size, 4 << 20));
+        for(u64 pos = 0; pos < size;) {
+            u64 n = std::min<u64>(buffer.size(), size - pos);
+            stream.read(buffer.data(), n);
+            out.write(buffer.data(), n, pos);
+            pos += n;
+        }
+        old.add(out.path, out.fd, size);
+        out.fd = -1;
+    }
+}
+
+std::string Chain::summary() const {
+    u64 unchanged = 0, blobs = 0;
+    for(auto [src, size] : extra) {
+        if(src < BLOB)
+            unchanged++;
+        else
+            blobs += size;
+    }
+    return std::format("{} diffs resolved into {} new files, {} same files and {} empty files, reading {} old files, "
+                       "{} unchanged ones and {} of new data from the earlier diffs", diffs.size(),
+                       diff.headData.newFiles.size(), diff.headData.sameFiles.size(),
+                       diff.headData.emptyFiles.size(), diff.headData.oldFiles.size(), unchanged,
+                       format_size(blobs));
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "patching.hpp"
+
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+ * dpatchz chain: consecutive diffs (2.4.3 -> 2.5.0 -> 2.5.1) applied as one, without writing
+ * the trees in between. Every cover of a diff is resolved through the diffs before it, down
+ * to the files of old_path or to the new data of an earlier diff, and the whole chain becomes
+ * a single diff over old_path that Patcher applies like any other. The new data it reads is
+ * the one of the last diff, what it needs of the earlier ones is decompressed aside first
+ */
+class Chain {
+public:
+    // A range of an old_path file, or of the new data of diff `src - BLOB`
+    struct Segment {
+        u32 src;
+        u64 offset;
+        u64 length;
+    };
+
+    static constexpr u32 BLOB = 1u << 31;
+
+    std::vector<std::filesystem::path> diff_files;
+    std::vector<DirDiff> diffs;
+    // The whole chain as one diff over old_path, and its plan. Old files past the ones of
+    // `diff` are what add_old_files() adds
+    DirDiff diff;
+    Plan plan;
+
+    // Parses every diff and resolves them into one. Throws if they don't follow each other
+    static Chain build(const std::vector<std::filesystem::path>& diff_files, const std::filesystem::path& source);
+
+    // What the journal knows the chain by
+    std::string identify() const;
+    // The old_path files the plan reads that no diff changes, then the new data of the earlier
+    // diffs, in memory up to `memory` and in an unnamed file in `dir` beyond it
+    void add_old_files(OldFiles& old, const std::filesystem::path& dir, u64 memory) const;
+    std::string summary() const;
+
+private:
+    // The content of a file at some point of the chain
+    struct Resolved {
+        std::vector<Segment> segments;
+        // Where each segment starts in the file
+        std::vector<u64> starts;
+        u64 size = 0;
+    };
+
+    // What a diff does to each path
+    struct Step {
+        Plan plan;
+        std::unordered_map<std::string, size_t> new_index;
+        std::unordered_map<std::string, std::string> pair_source;
+        std::unordered_set<std::string> empty;
+        std::unordered_set<std::string> old_names;
+        // Position of the first new data byte of each new file in the stream
+        std::vector<u64> data_start;
+    };
+
+    std::filesystem::path source;
+    std::vector<Step> steps;
+    // old_path files by name, the index is the src of their segments
+    std::vector<std::string> old_names;
+    std::unordered_map<std::string, u32> old_ids;
+    // Sizes the diffs expect old_path files to have. A resumed -i patch may have replaced
+    // them already
+    std::unordered_map<std::string, u64> expected;
+    std::vector<u64> old_sizes;
+    // Resolved files after each diff, index 0 is old_path
+    std::vector<std::unordered_map<std::string, Resolved>> memo;
+
+    // Extra old files: old_path files by id, or BLOB + diff with the bytes of its new data needed
+    std::vector<std::pair<u32, u64>> extra;
+
+    u32 old_id(const std::string& name);
+    const Resolved& resolve(size_t level, const std::string& name);
+    // The old_path file `name` is after diff `level`, if it's one that only same file pairs
+    // moved or copied
+    std::optional<std::string> origin(size_t level, std::string name) const;
+    // Whether `name` is a file after diff `level`
+    bool exists(size_t level, const std::string& name) const;
+    // The part [offset, offset + length) of a resolved file
+    static void slice(const Resolved& file, u64 offset, u64 length, std::vector<Segment>& out);
+};
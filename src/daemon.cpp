@@ -0,0 +1,370 @@
+#include "daemon.hpp"
+#include "json.hpp"
+#include "dwhbll-logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static sockaddr_un address_of(const std::filesystem::path& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path.string().size() >= sizeof(address.sun_path))
+        throw std::runtime_error(std::format("{} is too long for a socket path", path.string()));
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+static void send_all(int fd, const std::string& data) {
+    size_t done = 0;
+    while(done < data.size()) {
+        ssize_t n = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throw std::runtime_error(strerror(errno));
+        done += n;
+    }
+}
+
+static std::string finished(u64 id, std::string_view status, double seconds, const std::string& error) {
+    std::string event = std::format("{{\"event\": \"finished\", \"id\": {}, \"status\": \"{}\", \"seconds\": {:.3f}",
+                                    id, status, seconds);
+    if(!error.empty())
+        event += ", \"error\": " + Json::quote(error);
+    return event + "}";
+}
+
+Daemon::Client::~Client() {
+    close(fd);
+}
+
+void Daemon::Client::send(const std::string& event) {
+    try {
+        send_all(fd, event + "\n");
+    } catch(const std::exception&) {
+    }
+}
+
+Daemon::~Daemon() {
+    if(listener >= 0) {
+        close(listener);
+        std::filesystem::remove(socket_path);
+    }
+}
+
+void Daemon::listen() {
+    sockaddr_un address = address_of(socket_path);
+
+    // A socket left by a daemon that was killed is replaced, one that still answers isn't
+    std::filesystem::file_status status = std::filesystem::symlink_status(socket_path);
+    if(std::filesystem::exists(status)) {
+        if(!std::filesystem::is_socket(status))
+            throw std::runtime_error(std::format("{} exists and is not a socket", socket_path.string()));
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool alive = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        if(probe >= 0)
+            close(probe);
+        if(alive)
+            throw std::runtime_error(std::format("A daemon is already listening on {}", socket_path.string()));
+        std::filesystem::remove(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        throw std::runtime_error(std::format("Failed to create a socket ({})", strerror(errno)));
+    // Jobs write wherever the daemon can, only its user gets to submit them
+    mode_t mask = umask(0177);
+    int bound = bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    umask(mask);
+    if(bound != 0 || ::listen(fd, 64) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error(std::format("Failed to listen on {} ({})", socket_path.string(), strerror(err)));
+    }
+    listener = fd;
+}
+
+bool Daemon::read_job(Incoming& incoming) {
+    char buf[4096];
+    while(true) {
+        ssize_t n = recv(incoming.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if(n <= 0)
+            return true;
+        incoming.line.append(buf, n);
+        if(std::memchr(buf, '\n', n) || incoming.line.size() >= MAX_JOB)
+            return true;
+    }
+}
+
+void Daemon::receive(Incoming& incoming) {
+    std::unique_ptr<Client> client = std::move(incoming.client);
+    const std::string& line = incoming.line;
+
+    Queued queued;
+    queued.id = next_id++;
+    queued.job.name = std::to_string(queued.id);
+    try {
+        if(line.find('\n') == std::string::npos)
+            throw std::runtime_error("Expected a job as JSON on one line");
+        Json json = Json::parse(std::string_view(line).substr(0, line.find('\n')));
+        // Relative paths are relative to where the daemon runs, dpatchz submit sends absolute ones
+        Batch::parse_job(json, {}, options, queued.job);
+        queued.priority = json.get_int("priority");
+        queued.reads = std::filesystem::weakly_canonical(queued.job.old_path);
+        queued.writes = queued.job.inplace ? queued.reads : std::filesystem::weakly_canonical(queued.job.new_path);
+    } catch(const std::exception& e) {
+        dwhbll::console::error("Daemon: rejected job {}: {}", queued.id, e.what());
+        client->send(finished(queued.id, "failed", 0, e.what()));
+        return;
+    }
+
+    // Told before the job is in the queue, so it can't start first, and without the lock so
+    // a slow client doesn't hold up the workers. Only this thread adds jobs, there can only
+    // be fewer ahead by the time it's in
+    std::ptrdiff_t ahead;
+    {
+        std::lock_guard lock(mutex);
+        ahead = std::count_if(queue.begin(), queue.end(), [&](const Queued& other) {
+            return other.priority >= queued.priority;
+        });
+    }
+    client->send(std::format("{{\"event\": \"queued\", \"id\": {}, \"name\": {}, \"ahead\": {}}}", queued.id,
+                             Json::quote(queued.job.name), ahead));
+    dwhbll::console::info("Daemon: queued {} (job {}, priority {})", queued.job.name, queued.id, queued.priority);
+    queued.client = std::move(client);
+
+    std::lock_guard lock(mutex);
+    auto at = std::find_if(queue.begin(), queue.end(), [&](const Queued& other) {
+        return other.priority < queued.priority;
+    });
+    queue.insert(at, std::move(queued));
+    wake.notify_all();
+}
+
+std::list<Daemon::Queued>::iterator Daemon::next() {
+    auto conflict = [](const Queued& a, const Queued& b) {
+        return Batch::overlaps(a.writes, b.writes) || Batch::overlaps(a.writes, b.reads) ||
+               Batch::overlaps(b.writes, a.reads);
+    };
+    for(auto it = queue.begin(); it != queue.end(); ++it) {
+        bool blocked = !running.empty() && used + Batch::memory_of(it->job) > memory;
+        for(const Queued& other : running)
+            blocked = blocked || conflict(*it, other);
+        for(auto before = queue.begin(); before != it && !blocked; ++before)
+            blocked = conflict(*it, *before);
+        if(!blocked)
+            return it;
+    }
+    return queue.end();
+}
+
+void Daemon::work() {
+    std::unique_lock lock(mutex);
+    while(true) {
+        auto it = queue.end();
+        wake.wait(lock, [&]() {
+            if(stopping)
+                return true;
+            it = next();
+            return it != queue.end();
+        });
+        if(stopping)
+            return;
+
+        running.splice(running.end(), queue, it);
+        used += Batch::memory_of(it->job);
+        // Descriptors opened before it writes there would be the files it replaces
+        old_fds.forget(it->writes);
+        lock.unlock();
+
+        patch(*it);
+
+        lock.lock();
+        used -= Batch::memory_of(it->job);
+        old_fds.forget(it->writes);
+        running.erase(it);
+        wake.notify_all();
+    }
+}
+
+void Daemon::patch(Queued& queued) {
+    const Batch::Job& job = queued.job;
+    Client& client = *queued.client;
+    client.send(std::format("{{\"event\": \"started\", \"id\": {}}}", queued.id));
+    dwhbll::console::info("Daemon: starting {} (job {})", job.name, queued.id);
+
+    std::string status = "done";
+    std::string error;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        Patcher::check_paths(job.diff, job.old_path, job.new_path, job.options);
+        std::shared_ptr<const Prepared> prepared = prepare(job.diff);
+        Patcher patcher(prepared->diff, prepared->plan, prepared->id,
+                        std::make_unique<NewDataStream>(job.diff, prepared->diff.mainDiff.newDataOffset),
+                        job.old_path, job.new_path, job.options);
+        patcher.old_fds = &old_fds;
+        patcher.progress = [&](size_t files, size_t total) {
+            client.send(std::format("{{\"event\": \"progress\", \"id\": {}, \"files\": {}, \"of\": {}}}",
+                                    queued.id, files, total));
+        };
+        patcher.patch(job.inplace);
+    } catch(const PatchError& e) {
+        status = e.interrupted() ? "interrupted" : "failed";
+        error = e.describe();
+    } catch(const std::exception& e) {
+        status = "failed";
+        error = e.what();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if(status == "done")
+        dwhbll::console::info("Daemon: {} done in {:.1f}s", job.name, seconds);
+    else if(status == "failed")
+        dwhbll::console::error("Daemon: {} failed: {}", job.name, error);
+    client.send(finished(queued.id, status, seconds, error));
+}
+
+std::shared_ptr<const Daemon::Prepared> Daemon::prepare(const std::filesystem::path& diff_file) {
+    std::filesystem::path path = std::filesystem::canonical(diff_file);
+    std::string key = std::format("{}:{}:{}", path.string(), std::filesystem::file_size(path),
+                                  std::filesystem::last_write_time(path).time_since_epoch().count());
+    {
+        std::lock_guard lock(cache_mutex);
+        for(Cached& cached : cache) {
+            if(cached.key == key) {
+                dwhbll::console::debug("Daemon: {} is already parsed", diff_file.string());
+                cached.last_used = ++cache_clock;
+                return cached.prepared;
+            }
+        }
+    }
+
+    // Outside the lock, two jobs of a new diff may both parse it
+    auto prepared = std::make_shared<Prepared>();
+    try {
+        prepared->diff = DirDiff::load(diff_file);
+        prepared->plan = Plan::build(prepared->diff);
+        prepared->id = Journal::identify(diff_file);
+    } catch(const std::exception& e) {
+        throw std::runtime_error(std::format("Failed to parse {}: {}", diff_file.string(), e.what()));
+    }
+
+    std::lock_guard lock(cache_mutex);
+    if(cache.size() >= CACHED_DIFFS) {
+        cache.erase(std::min_element(cache.begin(), cache.end(), [](const Cached& a, const Cached& b) {
+            return a.last_used < b.last_used;
+        }));
+    }
+    cache.push_back({ key, prepared, ++cache_clock });
+    return prepared;
+}
+
+void Daemon::run() {
+    listen();
+    Patcher::catch_signals();
+    dwhbll::console::info("Daemon: listening on {}, up to {} jobs at once", socket_path.string(), threads);
+
+    std::vector<std::thread> pool;
+    for(unsigned t = 0; t < threads; t++)
+        pool.emplace_back(&Daemon::work, this);
+
+    // New connections and the jobs coming in on the ones accepted before, without waiting on
+    // any of them. The signal makes poll() return, the timeout is only there in case it came
+    // just before
+    std::vector<Incoming> incoming;
+    while(!Patcher::signalled()) {
+        std::vector<pollfd> fds = { { listener, POLLIN, 0 } };
+        auto now = std::chrono::steady_clock::now();
+        auto timeout = std::chrono::milliseconds(500);
+        for(const Incoming& in : incoming) {
+            fds.push_back({ in.fd, POLLIN, 0 });
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(in.deadline - now);
+            timeout = std::clamp(left, std::chrono::milliseconds(0), timeout);
+        }
+        if(poll(fds.data(), fds.size(), timeout.count()) < 0)
+            continue;
+
+        now = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < incoming.size();) {
+            bool done = fds[i + 1].revents != 0 && read_job(incoming[i]);
+            if(!done && now < incoming[i].deadline) {
+                i++;
+                continue;
+            }
+            receive(incoming[i]);
+            incoming.erase(incoming.begin() + i);
+            fds.erase(fds.begin() + i + 1);
+        }
+
+        if(fds[0].revents & POLLIN) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if(fd < 0)
+                continue;
+            // Events are sent from the workers, one that stopped reading doesn't hold them up
+            timeval send_timeout = { 5, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+            incoming.push_back({ fd, std::make_unique<Client>(fd), "", now + RECEIVE_TIME });
+        }
+    }
+
+    // The running jobs with a journal stop at their next checkpoint, the others finish
+    dwhbll::console::info("Daemon: stopping, waiting for the running jobs");
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+        for(Queued& queued : queue)
+            queued.client->send(finished(queued.id, "interrupted", 0, "The daemon stopped before it started"));
+        queue.clear();
+        wake.notify_all();
+    }
+    for(std::thread& thread : pool)
+        thread.join();
+}
+
+int Daemon::submit(const std::filesystem::path& socket_path, const std::string& job,
+                   const std::function<void(const Json&)>& on_event) {
+    sockaddr_un address = address_of(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        throw std::runtime_error(std::format("Failed to create a socket ({})", strerror(errno)));
+    Client connection(fd);
+    if(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+        throw std::runtime_error(std::format("Failed to connect to {} ({})", socket_path.string(), strerror(errno)));
+    try {
+        send_all(fd, job + "\n");
+    } catch(const std::exception& e) {
+        throw std::runtime_error(std::format("Failed to send the job to {} ({})", socket_path.string(), e.what()));
+    }
+
+    std::string buffer;
+    char chunk[4096];
+    while(true) {
+        size_t newline;
+        while((newline = buffer.find('\n')) != std::string::npos) {
+            Json event = Json::parse(std::string_view(buffer).substr(0, newline));
+            buffer.erase(0, newline + 1);
+            on_event(event);
+            if(event.get_string("event") == "finished") {
+                std::string status = event.get_string("status");
+                return status == "done" ? 0 : status == "interrupted" ? 130 : 1;
+            }
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throw std::runtime_error("The daemon closed the connection before the job finished");
+        buffer.append(chunk, n);
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "batch.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+
+/*
+ * dpatchz daemon: patches submitted on a Unix socket as JSON jobs, one per connection, for
+ * tools that patch over and over, like launchers. Jobs wait in one queue, highest priority
+ * first, and run like the jobs of a batch: up to `threads` at once, as many as fit in the
+ * memory budget together, one at a time on a tree. Each connection gets the events of its
+ * job back as JSON lines. Parsed and planned diffs are kept for the next jobs using them
+ */
+class Daemon {
+public:
+    Daemon(std::filesystem::path socket_path_, const PatchOptions& options_, unsigned threads_, u64 memory_)
+        : socket_path(std::move(socket_path_)), options(options_), threads(threads_), memory(memory_) {}
+    ~Daemon();
+
+    Daemon(const Daemon&) = delete;
+    Daemon& operator=(const Daemon&) = delete;
+
+    // Serves jobs until SIGINT or SIGTERM, then waits for the running ones. Throws if it
+    // can't listen on the socket
+    void run();
+
+    // dpatchz submit: sends a job to the daemon listening on `socket_path` and passes every
+    // event to `on_event` until the last one. Returns 0 if the job was done, 130 if it was
+    // interrupted, 1 otherwise
+    static int submit(const std::filesystem::path& socket_path, const std::string& job,
+                      const std::function<void(const Json&)>& on_event);
+
+private:
+    // A connection, closed with it. Events sent to a client that went away are dropped, the
+    // job goes on
+    class Client {
+    private:
+        int fd;
+
+    public:
+        explicit Client(int fd_) : fd(fd_) {}
+        ~Client();
+
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        void send(const std::string& event);
+    };
+
+    struct Queued {
+        u64 id = 0;
+        // Higher first, jobs with the same one run in the order they came
+        int priority = 0;
+        Batch::Job job;
+        // What it reads and writes, jobs where they overlap can't run at the same time
+        std::filesystem::path reads;
+        std::filesystem::path writes;
+        std::unique_ptr<Client> client;
+    };
+
+    // A connection whose job hasn't all come in yet
+    struct Incoming {
+        int fd;
+        std::unique_ptr<Client> client;
+        std::string line;
+        // A client that doesn't send its job by then gets its job rejected with what it sent
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // A diff parsed and planned, with what the journal knows it by
+    struct Prepared {
+        DirDiff diff;
+        Plan plan;
+        std::string id;
+    };
+
+    struct Cached {
+        // Path, size and modification time of the diff
+        std::string key;
+        std::shared_ptr<const Prepared> prepared;
+        u64 last_used;
+    };
+
+    static constexpr size_t CACHED_DIFFS = 8;
+    // Longest line a job can be, and how long a client has to send it
+    static constexpr size_t MAX_JOB = 1 << 20;
+    static constexpr std::chrono::seconds RECEIVE_TIME{ 5 };
+
+    std::filesystem::path socket_path;
+    PatchOptions options;
+    unsigned threads;
+    u64 memory;
+    int listener = -1;
+    // Only touched by the thread that accepts connections
+    u64 next_id = 1;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::list<Queued> queue;
+    std::list<Queued> running;
+    u64 used = 0;
+    bool stopping = false;
+    // Old files stay open between jobs reading the same tree
+    OldFdTable old_fds;
+
+    std::mutex cache_mutex;
+    std::vector<Cached> cache;
+    u64 cache_clock = 0;
+
+    void listen();
+    // Reads what a connection sent without waiting, true once its job is all there or no
+    // more is coming
+    static bool read_job(Incoming& incoming);
+    // Queues the job of a connection, or tells the client why it can't
+    void receive(Incoming& incoming);
+    // The first queued job that doesn't wait for a running one or one before it and fits in
+    // what's left of the budget, queue.end() if there is none right now. With the lock held
+    std::list<Queued>::iterator next();
+    void work();
+    void patch(Queued& queued);
+    std::shared_ptr<const Prepared> prepare(const std::filesystem::path& diff_file);
+};
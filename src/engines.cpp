@@ -0,0 +1,1065 @@
+#include "engines.hpp"
+#include "dwhbll-logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int open_output(const std::filesystem::path& path, bool truncate = true) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if(fd < 0)
+        throw std::runtime_error(std::format("Error opening file: {} ({})", path.string(),
+                                             strerror(errno)));
+    return fd;
+}
+
+void preallocate_output(int fd, u64 size, const std::filesystem::path& path) {
+    if(size == 0)
+        return;
+    if(fallocate(fd, 0, 0, size) == 0)
+        return;
+
+    // Not every filesystem can fallocate, a sparse file of the right size still lets
+    // writes land anywhere. Running out of space is a real error though
+    if((errno == EOPNOTSUPP || errno == ENOSYS) && ftruncate(fd, size) == 0)
+        return;
+    throw std::runtime_error(std::format("Failed to allocate {} for file: {} ({})", format_size(size),
+                                         path.string(), strerror(errno)));
+}
+
+static void write_all(int fd, const u8* data, u64 size, u64 offset,
+                      const std::filesystem::path& path) {
+    while(size > 0) {
+        ssize_t w = pwrite(fd, data, size, offset);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            throw std::runtime_error(std::format("Failed to write to file: {} ({})",
+                                                 path.string(), strerror(errno)));
+        data += w;
+        size -= w;
+        offset += w;
+    }
+}
+
+void Writeback::drop(int fd, Extent& extent) {
+    if(extent.end <= extent.start)
+        return;
+
+    u64 length = extent.end - extent.start;
+    unsigned flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+    if(sync_file_range(fd, extent.start, length, flags) != 0)
+        throw std::runtime_error(std::format("Failed to write back output ({})", strerror(errno)));
+
+    if(mapping) {
+        // madvise wants a page aligned start
+        u64 start = extent.start & ~u64(4095);
+        madvise(mapping + start, extent.end - start, MADV_DONTNEED);
+    }
+    posix_fadvise(fd, extent.start, length, POSIX_FADV_DONTNEED);
+    extent = {};
+}
+
+void Writeback::written(int fd, u64 offset, u64 size) {
+    if(window == 0 || size == 0)
+        return;
+
+    current.start = std::min(current.start, offset);
+    current.end = std::max(current.end, offset + size);
+    dirty += size;
+    if(dirty < window)
+        return;
+
+    // Start on this batch while the previous one finishes
+    if(sync_file_range(fd, current.start, current.end - current.start, SYNC_FILE_RANGE_WRITE) != 0)
+        throw std::runtime_error(std::format("Failed to write back output ({})", strerror(errno)));
+    drop(fd, started);
+    started = current;
+    current = {};
+    dirty = 0;
+}
+
+void Writeback::finish(int fd) {
+    if(window == 0)
+        return;
+    drop(fd, started);
+    drop(fd, current);
+    dirty = 0;
+    mapping = nullptr;
+}
+
+OutputFile::~OutputFile() {
+    if(fd >= 0)
+        ::close(fd);
+}
+
+void OutputFile::open(const std::filesystem::path& path_, bool truncate) {
+    path = path_;
+    fd = open_output(path, truncate);
+}
+
+void OutputFile::open_unnamed(const std::filesystem::path& dir, const std::string& name, bool in_memory) {
+    if(in_memory) {
+        path = name + " (memory)";
+        fd = memfd_create(("dpatchz-" + name).c_str(), MFD_CLOEXEC);
+    }
+    else {
+        path = dir / name;
+        fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        // Not every filesystem has O_TMPFILE, a file unlinked right away is just as invisible
+        if(fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+            std::string temp = (dir / std::format(".dpatchz-{}-XXXXXX", name)).string();
+            fd = mkostemp(temp.data(), O_CLOEXEC);
+            if(fd >= 0)
+                unlink(temp.c_str());
+        }
+    }
+    if(fd < 0) {
+        throw std::runtime_error(std::format("Failed to create the {} file in {} ({})", name, dir.string(),
+                                             strerror(errno)));
+    }
+}
+
+void OutputFile::preallocate(u64 size) {
+    preallocate_output(fd, size, path);
+}
+
+void OutputFile::write(const u8* data, u64 size, u64 offset) {
+    write_all(fd, data, size, offset, path);
+    writeback.written(fd, offset, size);
+}
+
+void OutputFile::punch_hole(u64 offset, u64 length) {
+    if(!punch_unsupported) {
+        if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+            return;
+        if(errno != EOPNOTSUPP && errno != ENOSYS) {
+            throw std::runtime_error(std::format("Failed to punch a hole in file: {} ({})",
+                                                 path.string(), strerror(errno)));
+        }
+        punch_unsupported = true;
+    }
+    write_zeros(offset, length);
+}
+
+void OutputFile::write_zeros(u64 offset, u64 length) {
+    static const std::vector<u8> zeros(1 << 20);
+    while(length > 0) {
+        u64 n = std::min<u64>(length, zeros.size());
+        write(zeros.data(), n, offset);
+        offset += n;
+        length -= n;
+    }
+}
+
+void OutputFile::copy_from(OldFiles& old, size_t old_file, u64 old_offset, u64 out_offset,
+                           u64 length) {
+    loff_t off_in = old_offset;
+    loff_t off_out = out_offset;
+    int in = old.fd(old_file);
+
+    // copy_file_range is allowed to copy less than asked, even on regular files
+    while(length > 0 && !copy_unsupported) {
+        ssize_t copied = copy_file_range(in, &off_in, fd, &off_out, length, 0);
+        if(copied < 0 && errno == EINTR)
+            continue;
+        // Some filesystem pairs can't do it at all, e.g. old and new trees on different ones
+        if(copied < 0 && (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS ||
+                          errno == EINVAL)) {
+            copy_unsupported = true;
+            break;
+        }
+        if(copied <= 0) {
+            throw std::runtime_error(std::format("Failed to copy data from {} to {} ({})",
+                                                 old.path(old_file).string(), path.string(),
+                                                 copied == 0 ? "unexpected end of file"
+                                                             : strerror(errno)));
+        }
+        length -= copied;
+    }
+
+    std::vector<u8> buffer(std::min<u64>(length, 1 << 20));
+    while(length > 0) {
+        u64 n = std::min<u64>(length, buffer.size());
+        read_old(old, old_file, off_in, buffer.data(), n);
+        write_all(fd, buffer.data(), n, off_out, path);
+        off_in += n;
+        off_out += n;
+        length -= n;
+    }
+    writeback.written(fd, out_offset, off_out - out_offset);
+}
+
+void OutputFile::truncate(u64 size) {
+    if(ftruncate(fd, size) != 0) {
+        throw std::runtime_error(std::format("Failed to truncate file: {} ({})", path.string(),
+                                             strerror(errno)));
+    }
+}
+
+void OutputFile::close() {
+    writeback.finish(fd);
+    int f = fd;
+    fd = -1;
+    if(::close(f) != 0) {
+        throw std::runtime_error(std::format("Failed to close file: {} ({})", path.string(),
+                                             strerror(errno)));
+    }
+}
+
+void read_old(OldFiles& old, size_t old_file, u64 offset, u8* dest, u64 length) {
+    int fd = old.fd(old_file);
+    while(length > 0) {
+        ssize_t r = pread(fd, dest, length, offset);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0) {
+            throw std::runtime_error(std::format("Failed to read from {} ({})",
+                                                 old.path(old_file).string(),
+                                                 r == 0 ? "unexpected end of file"
+                                                        : strerror(errno)));
+        }
+        dest += r;
+        offset += r;
+        length -= r;
+    }
+}
+
+OldWindow::Window& OldWindow::load(size_t old_file, u64 offset) {
+    uses++;
+    Window* victim = &windows[0];
+    for(Window& w : windows) {
+        if(w.old_file == old_file && offset >= w.start && offset < w.start + w.size) {
+            w.last_use = uses;
+            return w;
+        }
+        if(w.last_use < victim->last_use)
+            victim = &w;
+    }
+
+    // Start a bit before the cover, diffs also go backwards inside a file
+    u64 start = offset > WINDOW_SIZE / 4 ? (offset - WINDOW_SIZE / 4) & ~u64(4095) : 0;
+    u64 size = std::min(WINDOW_SIZE, old.size(old_file) - start);
+    victim->data.resize(WINDOW_SIZE);
+    victim->old_file = SIZE_MAX;
+    read_old(old, old_file, start, victim->data.data(), size);
+    victim->old_file = old_file;
+    victim->start = start;
+    victim->size = size;
+    victim->last_use = uses;
+    return *victim;
+}
+
+void OldWindow::read(size_t old_file, u64 offset, u8* dest, u64 length) {
+    if(length > WINDOW_SIZE / 2 || offset + length > old.size(old_file)) {
+        read_old(old, old_file, offset, dest, length);
+        return;
+    }
+
+    while(length > 0) {
+        Window& w = load(old_file, offset);
+        u64 n = std::min(length, w.start + w.size - offset);
+        std::memcpy(dest, w.data.data() + (offset - w.start), n);
+        dest += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+static constexpr u64 HOLE_BLOCK = 4096;
+
+// Buffers of patches that are done, so the next ones in the same process (dpatchz batch and
+// daemon) don't allocate and fault in new ones
+static std::mutex buffers_mutex;
+static std::vector<std::vector<u8>> buffers;
+static constexpr size_t POOLED_BUFFERS = 4;
+
+WriteBuffer::WriteBuffer(u64 capacity) {
+    {
+        std::lock_guard lock(buffers_mutex);
+        auto it = std::find_if(buffers.begin(), buffers.end(), [&](const auto& b) { return b.size() == capacity; });
+        if(it != buffers.end()) {
+            data = std::move(*it);
+            buffers.erase(it);
+        }
+    }
+    if(data.size() != capacity)
+        data.resize(capacity);
+}
+
+WriteBuffer::~WriteBuffer() {
+    if(data.empty())
+        return;
+    std::lock_guard lock(buffers_mutex);
+    if(buffers.size() < POOLED_BUFFERS)
+        buffers.push_back(std::move(data));
+}
+
+void WriteBuffer::commit_sparse(OutputFile& out, u64 length, u64 min_hole) {
+    // Runs of zero blocks, aligned in the output so the holes are whole filesystem blocks
+    std::vector<std::pair<u64, u64>> holes;
+    u64 end = start + used + length;
+    u64 run = zero_run;
+    u64 block = scanned != UINT64_MAX ? scanned : (start + used + HOLE_BLOCK - 1) & ~(HOLE_BLOCK - 1);
+    for(; block + HOLE_BLOCK <= end; block += HOLE_BLOCK) {
+        if(all_zero(data.data() + (block - start), HOLE_BLOCK)) {
+            if(run == UINT64_MAX)
+                run = block;
+            continue;
+        }
+        if(run != UINT64_MAX && block - run >= min_hole)
+            holes.push_back({ run, block });
+        else if(run < start)
+            out.write_zeros(run, start - run);
+        run = UINT64_MAX;
+    }
+    // A run going on to the end is dropped from the buffer, only where it began is kept until
+    // the next call. Long enough already, it's punched now and goes on from here
+    if(run != UINT64_MAX && block - run >= min_hole) {
+        holes.push_back({ run, block });
+        run = block;
+    }
+    scanned = block;
+    zero_run = run;
+
+    u64 keep = run != UINT64_MAX ? block : holes.empty() ? start : holes.back().second;
+    if(keep <= start) {
+        used += length;
+        return;
+    }
+    u64 pos = start;
+    for(auto [hole_start, hole_end] : holes) {
+        if(hole_start > pos)
+            out.write(data.data() + (pos - start), hole_start - pos, pos);
+        out.punch_hole(hole_start, hole_end - hole_start);
+        pos = std::max(pos, hole_end);
+    }
+    if(run != UINT64_MAX && run > pos)
+        out.write(data.data() + (pos - start), run - pos, pos);
+    std::memmove(data.data(), data.data() + (keep - start), end - keep);
+    start = keep;
+    used = end - keep;
+}
+
+void buffer_cover(WriteBuffer& buffer, OutputFile& out, OldWindow& window, size_t old_file,
+                  u64 old_offset, u64 out_offset, u64 length) {
+    while(length > 0) {
+        std::span<u8> space = buffer.reserve(out, out_offset, length);
+        window.read(old_file, old_offset, space.data(), space.size());
+        buffer.commit(space.size());
+        old_offset += space.size();
+        out_offset += space.size();
+        length -= space.size();
+    }
+}
+
+void buffer_new_data(WriteBuffer& buffer, OutputFile& out, ByteSource& stream,
+                     u64 out_offset, u64 length, u64 min_hole) {
+    while(length > 0) {
+        std::span<u8> space = buffer.reserve(out, out_offset, length);
+        stream.read(space.data(), space.size());
+        if(min_hole > 0)
+            buffer.commit_sparse(out, space.size(), min_hole);
+        else
+            buffer.commit(space.size());
+        out_offset += space.size();
+        length -= space.size();
+    }
+}
+
+CopyEngine::CopyEngine(OldFiles& old_, const PatchOptions& options)
+    : old(old_), window(old_), buffer(options.write_buffer),
+      inline_max(options.inline_threshold), min_hole(options.hole_threshold) {
+    out.writeback.window = options.writeback_window;
+}
+
+void CopyEngine::open(const std::filesystem::path& path, u64 size) {
+    out.open(path);
+    out.preallocate(size);
+}
+
+void CopyEngine::cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length) {
+    if(length <= inline_max)
+        buffer_cover(buffer, out, window, old_file, old_offset, out_offset, length);
+    else
+        out.copy_from(old, old_file, old_offset, out_offset, length);
+}
+
+void CopyEngine::new_data(ByteSource& stream, u64 out_offset, u64 length) {
+    buffer_new_data(buffer, out, stream, out_offset, length, min_hole);
+}
+
+void CopyEngine::flush() {
+    buffer.flush(out);
+}
+
+void CopyEngine::close() {
+    buffer.flush(out);
+    out.close();
+}
+
+MmapEngine::MmapEngine(OldFiles& old_, const PatchOptions& options) : old(old_) {
+    writeback.window = options.writeback_window;
+}
+
+MmapEngine::~MmapEngine() {
+    for(auto& m : old_maps) {
+        if(m.data)
+            munmap(m.data, m.size);
+    }
+    if(out_map.data)
+        munmap(out_map.data, out_map.size);
+    if(out >= 0)
+        ::close(out);
+}
+
+const u8* MmapEngine::old_data(size_t old_file) {
+    if(old_maps.size() <= old_file)
+        old_maps.resize(old_file + 1);
+
+    Mapping& m = old_maps[old_file];
+    if(!m.data) {
+        // Reading past the end of a mapped file is a SIGBUS, not an error code
+        struct stat st;
+        int fd = old.fd(old_file);
+        if(fstat(fd, &st) != 0 || static_cast<u64>(st.st_size) < old.size(old_file)) {
+            throw std::runtime_error(std::format("Old file {} is smaller than expected",
+                                                 old.path(old_file).string()));
+        }
+
+        m.size = old.size(old_file);
+        void* p = mmap(nullptr, m.size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            throw std::runtime_error(std::format("Failed to map file: {} ({})",
+                                                 old.path(old_file).string(), strerror(errno)));
+        }
+        madvise(p, m.size, MADV_WILLNEED);
+        m.data = static_cast<u8*>(p);
+    }
+    return m.data;
+}
+
+void MmapEngine::open(const std::filesystem::path& path, u64 size) {
+    out_path = path;
+    out = open_output(path);
+
+    // Mappings can't grow the file, so it has to have its final size from the start
+    preallocate_output(out, size, path);
+
+    // mmap refuses empty mappings
+    if(size == 0)
+        return;
+
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+    if(p == MAP_FAILED) {
+        throw std::runtime_error(std::format("Failed to map file: {} ({})", path.string(),
+                                             strerror(errno)));
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    out_map = { static_cast<u8*>(p), size };
+    writeback.mapping = out_map.data;
+}
+
+void MmapEngine::cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length) {
+    if(length == 0)
+        return;
+    if(old_offset + length > old.size(old_file)) {
+        throw std::runtime_error(std::format("Failed to copy data from {} to {} (cover past end of file)",
+                                             old.path(old_file).string(), out_path.string()));
+    }
+    std::memcpy(out_map.data + out_offset, old_data(old_file) + old_offset, length);
+    writeback.written(out, out_offset, length);
+}
+
+void MmapEngine::new_data(ByteSource& stream, u64 out_offset, u64 length) {
+    stream.read(out_map.data + out_offset, length);
+    writeback.written(out, out_offset, length);
+}
+
+void MmapEngine::flush() {
+    // Writes to the mapping are in the page cache already
+}
+
+void MmapEngine::close() {
+    writeback.finish(out);
+    if(out_map.data) {
+        munmap(out_map.data, out_map.size);
+        out_map = {};
+    }
+    int fd = out;
+    out = -1;
+    if(::close(fd) != 0) {
+        throw std::runtime_error(std::format("Failed to close file: {} ({})", out_path.string(),
+                                             strerror(errno)));
+    }
+}
+
+BufferedEngine::BufferedEngine(OldFiles& old_, const PatchOptions& options)
+    : old(old_), window(old_), buffer(options.write_buffer),
+      inline_max(options.inline_threshold), min_hole(options.hole_threshold),
+      overwrite(options.overwrite) {
+    out.writeback.window = options.writeback_window;
+}
+
+void BufferedEngine::open(const std::filesystem::path& path, u64 size) {
+    out.open(path, !overwrite);
+    out.preallocate(size);
+    out_size = size;
+}
+
+void BufferedEngine::cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length) {
+    if(length <= inline_max) {
+        buffer_cover(buffer, out, window, old_file, old_offset, out_offset, length);
+        return;
+    }
+
+    while(length > 0) {
+        std::span<u8> space = buffer.reserve(out, out_offset, length);
+        read_old(old, old_file, old_offset, space.data(), space.size());
+        buffer.commit(space.size());
+        old_offset += space.size();
+        out_offset += space.size();
+        length -= space.size();
+    }
+}
+
+void BufferedEngine::new_data(ByteSource& stream, u64 out_offset, u64 length) {
+    buffer_new_data(buffer, out, stream, out_offset, length, min_hole);
+}
+
+void BufferedEngine::flush() {
+    buffer.flush(out);
+}
+
+void BufferedEngine::close() {
+    buffer.flush(out);
+    if(overwrite)
+        out.truncate(out_size);
+    out.close();
+}
+
+static u64 elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - since).count();
+}
+
+AdaptiveEngine::AdaptiveEngine(OldFiles& old_, const PatchOptions& options)
+    : old(old_), window(old_), buffer(options.write_buffer),
+      inline_max(options.inline_threshold), min_hole(options.hole_threshold),
+      zero_copy_min(options.zero_copy_threshold) {
+    out.writeback.window = options.writeback_window;
+}
+
+AdaptiveEngine::~AdaptiveEngine() {
+    static const char* names[] = { "inline", "buffered", "zero-copy" };
+    for(int i = 0; i < STRATEGY_COUNT; i++) {
+        dwhbll::console::debug("adaptive: {} covers ({} bytes) {}", counts[i], bytes[i], names[i]);
+    }
+    dwhbll::console::debug("adaptive: buffered {:.3f} ns/B + flush {:.3f} ns/B, zero-copy {:.3f} ns/B",
+                           buffered_cost.ns_per_byte, flush_ns_per_byte(),
+                           zero_copy_cost.ns_per_byte);
+}
+
+void AdaptiveEngine::open(const std::filesystem::path& path, u64 size) {
+    out.open(path);
+    out.preallocate(size);
+}
+
+void AdaptiveEngine::cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length) {
+    if(length == 0)
+        return;
+
+    Strategy s = pick(old_offset, out_offset, length);
+    counts[s]++;
+    bytes[s] += length;
+
+    auto start = std::chrono::steady_clock::now();
+    switch(s) {
+        case INLINE:
+            buffer_cover(buffer, out, window, old_file, old_offset, out_offset, length);
+            break;
+        case BUFFERED: {
+            // Flushes are accounted separately
+            u64 flush_ns = buffer.flush_ns;
+            buffer_cover(buffer, out, window, old_file, old_offset, out_offset, length);
+            buffered_cost.add(length, elapsed_ns(start) - (buffer.flush_ns - flush_ns));
+            break;
+        }
+        case ZERO_COPY:
+            out.copy_from(old, old_file, old_offset, out_offset, length);
+            zero_copy_cost.add(length, elapsed_ns(start));
+            break;
+        default:
+            break;
+    }
+}
+
+void AdaptiveEngine::new_data(ByteSource& stream, u64 out_offset, u64 length) {
+    buffer_new_data(buffer, out, stream, out_offset, length, min_hole);
+}
+
+void AdaptiveEngine::flush() {
+    buffer.flush(out);
+}
+
+void AdaptiveEngine::close() {
+    buffer.flush(out);
+    out.close();
+}
+
+static u64 round_up(u64 value, u64 align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+DirectEngine::DirectEngine(OldFiles& old_, const PatchOptions& options)
+    : old(old_), direct_fds(old_.count(), NOT_OPEN),
+      read_cap(round_up(options.write_buffer, ALIGN)), out_cap(round_up(options.write_buffer, ALIGN)) {
+    read_buf = static_cast<u8*>(std::aligned_alloc(ALIGN, read_cap));
+    out_buf = static_cast<u8*>(std::aligned_alloc(ALIGN, out_cap));
+    if(!read_buf || !out_buf) {
+        std::free(read_buf);
+        std::free(out_buf);
+        throw std::runtime_error("Failed to allocate O_DIRECT buffers");
+    }
+}
+
+DirectEngine::~DirectEngine() {
+    if(fallback_files > 0)
+        dwhbll::console::debug("direct: {} files went through the page cache", fallback_files);
+    for(int fd : direct_fds) {
+        if(fd >= 0)
+            ::close(fd);
+    }
+    if(out >= 0)
+        ::close(out);
+    std::free(read_buf);
+    std::free(out_buf);
+}
+
+void DirectEngine::load(size_t old_file, u64 offset) {
+    int& direct = direct_fds[old_file];
+    if(direct == NOT_OPEN) {
+        // Through the open descriptor rather than the path, which -i may have replaced
+        std::string self = std::format("/proc/self/fd/{}", old.fd(old_file));
+        direct = ::open(self.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+        if(direct < 0) {
+            direct = REFUSED;
+            fallback_files++;
+        }
+    }
+
+    // Small reads for the first block so scattered tiny covers don't each pull in a full
+    // buffer, the whole buffer once reads keep going forward in the same file
+    u64 start = offset & ~(ALIGN - 1);
+    bool sequential = read_file == old_file && start == read_start + read_size;
+    u64 size = sequential ? read_cap : std::min<u64>(read_cap, 64 << 10);
+
+    read_file = SIZE_MAX;
+    u64 done = 0;
+    while(done < size) {
+        int fd = direct >= 0 ? direct : old.fd(old_file);
+        ssize_t r = pread(fd, read_buf + done, size - done, start + done);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0 && errno == EINVAL && direct >= 0) {
+            // Opened fine but the filesystem doesn't actually do it
+            ::close(direct);
+            direct = REFUSED;
+            fallback_files++;
+            continue;
+        }
+        if(r < 0) {
+            throw std::runtime_error(std::format("Failed to read from {} ({})",
+                                                 old.path(old_file).string(), strerror(errno)));
+        }
+        if(r == 0)
+            break;
+        done += r;
+        // O_DIRECT reads past the end come back short, anything after is the end of the file
+        if(done % ALIGN != 0)
+            break;
+    }
+
+    read_file = old_file;
+    read_start = start;
+    read_size = done;
+}
+
+void DirectEngine::read(size_t old_file, u64 offset, u8* dest, u64 length) {
+    while(length > 0) {
+        if(read_file != old_file || offset < read_start || offset >= read_start + read_size) {
+            load(old_file, offset);
+            if(offset >= read_start + read_size) {
+                throw std::runtime_error(std::format("Failed to read from {} (unexpected end of file)",
+                                                     old.path(old_file).string()));
+            }
+        }
+        u64 n = std::min(length, read_start + read_size - offset);
+        std::memcpy(dest, read_buf + (offset - read_start), n);
+        dest += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+std::span<u8> DirectEngine::reserve(u64 out_offset, u64 length) {
+    // Blocks are only ever written whole, so the output has to come in order
+    if(out_offset != out_start + out_used) {
+        throw std::runtime_error(std::format("Direct engine got a write at {} instead of {}",
+                                             out_offset, out_start + out_used));
+    }
+    if(out_used == out_cap)
+        write_out(false);
+    return { out_buf + out_used, std::min(length, out_cap - out_used) };
+}
+
+void DirectEngine::write_out(bool last) {
+    u64 size = out_used;
+    if(out_direct && last) {
+        // The tail goes out padded to a whole block and gets cut back in close()
+        size = round_up(out_used, ALIGN);
+        std::memset(out_buf + out_used, 0, size - out_used);
+    }
+
+    u64 done = 0;
+    while(done < size) {
+        ssize_t w = pwrite(out, out_buf + done, size - done, out_start + done);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w < 0 && errno == EINVAL && out_direct) {
+            // Same as for reads, carry on through the page cache
+            fcntl(out, F_SETFL, fcntl(out, F_GETFL) & ~O_DIRECT);
+            out_direct = false;
+            fallback_files++;
+            size = out_used;
+            continue;
+        }
+        if(w <= 0) {
+            throw std::runtime_error(std::format("Failed to write to file: {} ({})",
+                                                 out_path.string(), strerror(errno)));
+        }
+        done += w;
+    }
+
+    out_start += out_used;
+    out_used = 0;
+}
+
+void DirectEngine::open(const std::filesystem::path& path, u64 size) {
+    out_path = path;
+    out_size = size;
+    out_start = 0;
+    out_used = 0;
+    out_direct = true;
+    out = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+    if(out < 0 && errno == EINVAL) {
+        out_direct = false;
+        fallback_files++;
+        out = open_output(path);
+    }
+    if(out < 0) {
+        throw std::runtime_error(std::format("Error opening file: {} ({})", path.string(),
+                                             strerror(errno)));
+    }
+    preallocate_output(out, size, path);
+}
+
+void DirectEngine::cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length) {
+    while(length > 0) {
+        std::span<u8> space = reserve(out_offset, length);
+        read(old_file, old_offset, space.data(), space.size());
+        out_used += space.size();
+        old_offset += space.size();
+        out_offset += space.size();
+        length -= space.size();
+    }
+}
+
+void DirectEngine::new_data(ByteSource& stream, u64 out_offset, u64 length) {
+    while(length > 0) {
+        std::span<u8> space = reserve(out_offset, length);
+        stream.read(space.data(), space.size());
+        out_used += space.size();
+        out_offset += space.size();
+        length -= space.size();
+    }
+}
+
+void DirectEngine::flush() {
+    // Only whole blocks can be written: the partial one at the end goes out padded and
+    // stays in the buffer, to be written again once it's complete
+    u64 start = out_start;
+    u64 whole = out_used & ~(ALIGN - 1);
+    u64 tail = out_used - whole;
+    write_out(true);
+    if(out_direct && tail > 0) {
+        std::memmove(out_buf, out_buf + whole, tail);
+        out_start = start + whole;
+        out_used = tail;
+    }
+}
+
+void DirectEngine::close() {
+    bool padded = out_direct && out_used % ALIGN != 0;
+    write_out(true);
+    if(padded && ftruncate(out, out_size) != 0) {
+        throw std::runtime_error(std::format("Failed to resize file: {} ({})", out_path.string(),
+                                             strerror(errno)));
+    }
+
+    int fd = out;
+    out = -1;
+    if(::close(fd) != 0) {
+        throw std::runtime_error(std::format("Failed to close file: {} ({})", out_path.string(),
+                                             strerror(errno)));
+    }
+}
+
+#ifdef DPATCHZ_HAVE_IO_URING
+
+static constexpr u64 URING_CHUNK = 256 << 10;
+
+UringEngine::UringEngine(OldFiles& old_, const PatchOptions& options)
+    : old(old_),
+      // Every buffer can have a read and a write in flight, plus the open, fallocate and close
+      ring(options.queue_depth * 2 + 3, options.queue_depth * 4 + 6),
+      chunk(URING_CHUNK), depth(options.queue_depth),
+      lengths(options.queue_depth), sources(options.queue_depth) {
+    pool = static_cast<u8*>(std::aligned_alloc(4096, depth * chunk));
+    if(!pool)
+        throw std::runtime_error("Failed to allocate io_uring buffers");
+
+    std::vector<iovec> iovecs(depth);
+    for(u32 i = 0; i < depth; i++) {
+        iovecs[i] = { buffer(i), chunk };
+        free_buffers.push_back(i);
+    }
+
+    try {
+        ring.register_buffers(iovecs);
+        ring.register_sparse_files(1);
+    } catch(...) {
+        std::free(pool);
+        throw;
+    }
+}
+
+UringEngine::~UringEngine() {
+    // The kernel may still be writing into the buffers after an error
+    try {
+        while(inflight > 0) {
+            ring.submit(1);
+            io_uring_cqe cqe;
+            while(ring.pop(cqe))
+                inflight--;
+        }
+    } catch(const std::exception&) {
+        // Leaking the buffers is better than handing them back while in use
+        return;
+    }
+    std::free(pool);
+}
+
+std::string UringEngine::unsupported_reason(const PatchOptions& options) {
+    std::string reason = Uring::unsupported_reason();
+    if(!reason.empty())
+        return reason;
+
+    // Registering the buffers is what usually fails (RLIMIT_MEMLOCK on older kernels)
+    try {
+        static const std::vector<DiffFile> no_files;
+        OldFiles none({}, no_files);
+        UringEngine probe(none, options);
+    } catch(const std::exception& e) {
+        return e.what();
+    }
+    return "";
+}
+
+io_uring_sqe* UringEngine::next_sqe(u32 needed) {
+    // Linked requests have to go in the same submission
+    if(ring.free_sqes() < needed)
+        ring.submit();
+    while(ring.free_sqes() < needed)
+        reap(1);
+
+    io_uring_sqe* sqe = ring.get_sqe();
+    if(drain_next) {
+        sqe->flags |= IOSQE_IO_DRAIN;
+        drain_next = false;
+    }
+    inflight++;
+    return sqe;
+}
+
+u32 UringEngine::acquire() {
+    while(free_buffers.empty())
+        reap(1);
+
+    u32 index = free_buffers.back();
+    free_buffers.pop_back();
+    return index;
+}
+
+void UringEngine::reap(u32 wait) {
+    ring.submit(wait);
+    io_uring_cqe cqe;
+    while(ring.pop(cqe))
+        complete(cqe);
+}
+
+void UringEngine::complete(const io_uring_cqe& cqe) {
+    inflight--;
+    Tag tag = static_cast<Tag>(cqe.user_data >> 32);
+    u32 index = cqe.user_data & 0xFFFFFFFF;
+
+    switch(tag) {
+        case OPEN:
+            if(cqe.res < 0) {
+                throw std::runtime_error(std::format("Error opening file: {} ({})", out_path,
+                                                     strerror(-cqe.res)));
+            }
+            break;
+        case READ:
+            if(cqe.res < 0 || static_cast<u64>(cqe.res) != lengths[index]) {
+                throw std::runtime_error(std::format("Failed to copy data from {} to {} ({})",
+                                                     old.path(sources[index]).string(), out_path,
+                                                     cqe.res < 0 ? strerror(-cqe.res)
+                                                                 : "unexpected end of file"));
+            }
+            break;
+        case WRITE:
+            // A failed read cancels its linked write, the read reports the error
+            if(cqe.res == -ECANCELED)
+                break;
+            if(cqe.res < 0 || static_cast<u64>(cqe.res) != lengths[index]) {
+                throw std::runtime_error(std::format("Failed to write to file: {} ({})", out_path,
+                                                     cqe.res < 0 ? strerror(-cqe.res)
+                                                                 : "short write"));
+            }
+            free_buffers.push_back(index);
+            break;
+        case FALLOCATE:
+            // Same as preallocate_output, not supported just means no preallocation
+            if(cqe.res < 0 && cqe.res != -EOPNOTSUPP && cqe.res != -ENOSYS) {
+                throw std::runtime_error(std::format("Failed to allocate file: {} ({})", out_path,
+                                                     strerror(-cqe.res)));
+            }
+            break;
+        case CLOSE:
+            if(cqe.res < 0) {
+                throw std::runtime_error(std::format("Failed to close file: {} ({})", out_path,
+                                                     strerror(-cqe.res)));
+            }
+            break;
+    }
+}
+
+void UringEngine::open(const std::filesystem::path& path, u64 size) {
+    out_path = path.string();
+
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<u64>(out_path.c_str());
+    sqe->len = 0644;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    // Direct descriptor slot 0, the file never gets a regular fd
+    sqe->file_index = 1;
+    sqe->user_data = static_cast<u64>(OPEN) << 32;
+    drain_next = true;
+
+    if(size > 0) {
+        sqe = next_sqe();
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->off = 0;
+        // fallocate takes the length in addr and the mode in len
+        sqe->addr = size;
+        sqe->len = 0;
+        sqe->user_data = static_cast<u64>(FALLOCATE) << 32;
+    }
+}
+
+void UringEngine::cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length) {
+    int in = old.fd(old_file);
+
+    while(length > 0) {
+        u32 index = acquire();
+        u64 n = std::min(length, chunk);
+        lengths[index] = n;
+        sources[index] = old_file;
+
+        io_uring_sqe* read = next_sqe(2);
+        read->opcode = IORING_OP_READ_FIXED;
+        read->flags |= IOSQE_IO_LINK;
+        read->fd = in;
+        read->addr = reinterpret_cast<u64>(buffer(index));
+        read->len = n;
+        read->off = old_offset;
+        read->buf_index = index;
+        read->user_data = static_cast<u64>(READ) << 32 | index;
+
+        io_uring_sqe* write = next_sqe();
+        write->opcode = IORING_OP_WRITE_FIXED;
+        write->flags |= IOSQE_FIXED_FILE;
+        write->fd = 0;
+        write->addr = reinterpret_cast<u64>(buffer(index));
+        write->len = n;
+        write->off = out_offset;
+        write->buf_index = index;
+        write->user_data = static_cast<u64>(WRITE) << 32 | index;
+
+        old_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+}
+
+void UringEngine::new_data(ByteSource& stream, u64 out_offset, u64 length) {
+    while(length > 0) {
+        u32 index = acquire();
+        u64 n = std::min(length, chunk);
+        lengths[index] = n;
+        stream.read(buffer(index), n);
+
+        io_uring_sqe* write = next_sqe();
+        write->opcode = IORING_OP_WRITE_FIXED;
+        write->flags |= IOSQE_FIXED_FILE;
+        write->fd = 0;
+        write->addr = reinterpret_cast<u64>(buffer(index));
+        write->len = n;
+        write->off = out_offset;
+        write->buf_index = index;
+        write->user_data = static_cast<u64>(WRITE) << 32 | index;
+
+        out_offset += n;
+        length -= n;
+    }
+}
+
+void UringEngine::flush() {
+    while(inflight > 0)
+        reap(1);
+}
+
+void UringEngine::close() {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    // Everything queued for this file has to be done before it goes away
+    sqe->flags |= IOSQE_IO_DRAIN;
+    sqe->file_index = 1;
+    sqe->user_data = static_cast<u64>(CLOSE) << 32;
+
+    while(inflight > 0)
+        reap(1);
+}
+
+#endif
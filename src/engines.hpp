@@ -0,0 +1,414 @@
+#pragma once
+
+#include "patching.hpp"
+#include "uring.hpp"
+
+#include <chrono>
+#include <span>
+
+/*
+ * I/O engines used by Patcher::run, see IoEngine in patching.hpp for the interface.
+ * Errors are reported by throwing std::runtime_error, Patcher adds the context.
+ */
+
+// Keeps the dirty pages of an output bounded: every `window` bytes written, writeback
+// of them is started with sync_file_range, and the batch before is waited for and
+// dropped from the page cache. window = 0 leaves everything to the kernel
+class Writeback {
+private:
+    struct Extent {
+        u64 start = UINT64_MAX;
+        u64 end = 0;
+    };
+
+    Extent current, started;
+    u64 dirty = 0;
+
+    void drop(int fd, Extent& extent);
+
+public:
+    u64 window = 0;
+    // Output mapping if there is one, its pages have to be unmapped to be dropped
+    u8* mapping = nullptr;
+
+    void written(int fd, u64 offset, u64 size);
+    // Writes back and drops everything left, before the descriptor gets closed
+    void finish(int fd);
+};
+
+// Output descriptor for the engines writing through pwrite and copy_file_range
+class OutputFile {
+public:
+    std::filesystem::path path;
+    int fd = -1;
+    Writeback writeback;
+    // Set once copy_file_range failed for a reason that won't go away, copies fall
+    // back to pread/pwrite
+    bool copy_unsupported = false;
+    bool punch_unsupported = false;
+
+    OutputFile() = default;
+    ~OutputFile();
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    // Keeps what's already in the file when `truncate` is false
+    void open(const std::filesystem::path& path_, bool truncate = true);
+    // A file nothing else can see that goes away once closed: a memfd when `in_memory`, an
+    // unnamed file in `dir` otherwise. `name` is what errors call it
+    void open_unnamed(const std::filesystem::path& dir, const std::string& name, bool in_memory);
+    // Reserves `size` bytes so later writes anywhere in the file can't run out of space
+    void preallocate(u64 size);
+    void write(const u8* data, u64 size, u64 offset);
+    // Deallocates a range that should read as zeros, writes the zeros where that's not
+    // supported
+    void punch_hole(u64 offset, u64 length);
+    void write_zeros(u64 offset, u64 length);
+    // copy_file_range, lets the filesystem share extents or copy server side. Falls back to
+    // pread/pwrite when the filesystems involved can't do it
+    void copy_from(OldFiles& old, size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    // Cuts the file to `size`, for outputs opened without truncating
+    void truncate(u64 size);
+    void close();
+};
+
+// fallocate()s the output to its final size so writes land in contiguous extents and a
+// full disk shows up right away. Falls back to a sparse file where fallocate isn't supported
+void preallocate_output(int fd, u64 size, const std::filesystem::path& path);
+
+// pread until `length` bytes of the old file are in `dest`
+void read_old(OldFiles& old, size_t old_file, u64 offset, u8* dest, u64 length);
+
+// A few large pread windows over the old files, serves tiny covers without a syscall
+// each. Windows are replaced least recently used first
+class OldWindow {
+private:
+    static constexpr u64 WINDOW_SIZE = 1 << 20;
+    static constexpr size_t WINDOW_COUNT = 4;
+
+    struct Window {
+        size_t old_file = SIZE_MAX;
+        u64 start = 0;
+        u64 size = 0;
+        u64 last_use = 0;
+        std::vector<u8> data;
+    };
+
+    OldFiles& old;
+    Window windows[WINDOW_COUNT];
+    u64 uses = 0;
+
+    Window& load(size_t old_file, u64 offset);
+
+public:
+    explicit OldWindow(OldFiles& old_) : old(old_) {}
+
+    // Same as read_old, goes through the windows when `length` fits in one
+    void read(size_t old_file, u64 offset, u8* dest, u64 length);
+};
+
+// Contiguous run of output bytes waiting to go out with a single pwrite
+class WriteBuffer {
+private:
+    std::vector<u8> data;
+    u64 start = 0;
+    u64 used = 0;
+    // commit_sparse: where it stopped looking for zero blocks and where the run of them it
+    // stopped in began, so a run can go on across calls. The zeros of that run up to start
+    // aren't in data, flush writes them. UINT64_MAX when there is none
+    u64 scanned = UINT64_MAX;
+    u64 zero_run = UINT64_MAX;
+
+public:
+    // The memory comes from the buffers of finished patches when one has the right size
+    explicit WriteBuffer(u64 capacity);
+    ~WriteBuffer();
+
+    WriteBuffer(WriteBuffer&&) = default;
+    WriteBuffer& operator=(WriteBuffer&&) = default;
+
+    // Space for up to `length` bytes going at out_offset. Flushes first when the buffer
+    // is full or out_offset doesn't follow what's already there
+    std::span<u8> reserve(OutputFile& out, u64 out_offset, u64 length) {
+        if((used > 0 || zero_run != UINT64_MAX) && (start + used != out_offset || used == data.size()))
+            flush(out);
+        if(used == 0)
+            start = out_offset;
+        return { data.data() + used, std::min<u64>(length, data.size() - used) };
+    }
+
+    void commit(u64 length) { used += length; }
+
+    // Same as commit, but runs of all-zero 4K blocks of at least min_hole bytes in the new
+    // bytes are punched out of the file instead of written. A run still going at the end
+    // stays in the buffer for the next call
+    void commit_sparse(OutputFile& out, u64 length, u64 min_hole);
+
+    void flush(OutputFile& out) {
+        if(zero_run != UINT64_MAX && zero_run < start)
+            out.write_zeros(zero_run, start - zero_run);
+        scanned = zero_run = UINT64_MAX;
+        if(used == 0)
+            return;
+        auto begin = std::chrono::steady_clock::now();
+        out.write(data.data(), used, start);
+        flush_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count();
+        flushed += used;
+        used = 0;
+    }
+
+    // Bytes written so far and the time it took, for the adaptive engine
+    u64 flushed = 0;
+    u64 flush_ns = 0;
+};
+
+// Reads a cover through `window` into `buffer`, flushing it whenever it fills up
+void buffer_cover(WriteBuffer& buffer, OutputFile& out, OldWindow& window, size_t old_file,
+                  u64 old_offset, u64 out_offset, u64 length);
+// Same for new data, zero runs of min_hole bytes or more become holes (0 disables)
+void buffer_new_data(WriteBuffer& buffer, OutputFile& out, ByteSource& stream,
+                     u64 out_offset, u64 length, u64 min_hole);
+
+// Copies covers with copy_file_range. Covers up to inline_threshold are read through
+// an OldWindow instead and written together with the new data around them
+class CopyEngine {
+private:
+    OldFiles& old;
+    OldWindow window;
+    OutputFile out;
+    WriteBuffer buffer;
+    u64 inline_max;
+    u64 min_hole;
+
+public:
+    CopyEngine(OldFiles& old_, const PatchOptions& options);
+
+    void open(const std::filesystem::path& path, u64 size);
+    void cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    void new_data(ByteSource& stream, u64 out_offset, u64 length);
+    void flush();
+    void close();
+};
+
+// Maps old files read-only and outputs read-write: covers become memcpy and new data
+// is decompressed straight into the output mapping
+class MmapEngine {
+private:
+    struct Mapping {
+        u8* data = nullptr;
+        u64 size = 0;
+    };
+
+    OldFiles& old;
+    std::vector<Mapping> old_maps;
+    std::filesystem::path out_path;
+    int out = -1;
+    Mapping out_map;
+    Writeback writeback;
+
+    const u8* old_data(size_t old_file);
+
+public:
+    MmapEngine(OldFiles& old_, const PatchOptions& options);
+    ~MmapEngine();
+
+    void open(const std::filesystem::path& path, u64 size);
+    void cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    void new_data(ByteSource& stream, u64 out_offset, u64 length);
+    void flush();
+    void close();
+};
+
+// pread/pwrite only: covers and new data are gathered in a large buffer and written
+// with one pwrite each time it fills up
+class BufferedEngine {
+private:
+    OldFiles& old;
+    OldWindow window;
+    OutputFile out;
+    WriteBuffer buffer;
+    u64 inline_max;
+    u64 min_hole;
+    bool overwrite;
+    u64 out_size = 0;
+
+public:
+    BufferedEngine(OldFiles& old_, const PatchOptions& options);
+
+    void open(const std::filesystem::path& path, u64 size);
+    void cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    void new_data(ByteSource& stream, u64 out_offset, u64 length);
+    void flush();
+    void close();
+};
+
+// Picks a strategy for every cover:
+//   inline     covers up to inline_max are read into the write buffer next to the new data
+//   zero-copy  covers from zero_copy_min up, with the same alignment on both sides,
+//              go through copy_file_range so the filesystem can share extents
+//   otherwise  whichever of the two has had the better measured throughput so far,
+//              trying the other one every now and then in case things changed
+class AdaptiveEngine {
+private:
+    enum Strategy { INLINE, BUFFERED, ZERO_COPY, STRATEGY_COUNT };
+
+    // Exponentially weighted average cost of a byte
+    struct Throughput {
+        double ns_per_byte = 0;
+        u64 samples = 0;
+
+        void add(u64 bytes, u64 ns) {
+            double sample = static_cast<double>(ns) / bytes;
+            ns_per_byte = samples == 0 ? sample : ns_per_byte * 0.8 + sample * 0.2;
+            samples++;
+        }
+    };
+
+    static constexpr u64 ALIGNMENT = 4096;
+    static constexpr u64 EXPLORE_EVERY = 32;
+
+    OldFiles& old;
+    OldWindow window;
+    OutputFile out;
+    WriteBuffer buffer;
+    u64 inline_max;
+    u64 min_hole;
+    u64 zero_copy_min;
+
+    Throughput buffered_cost, zero_copy_cost;
+    u64 undecided = 0;
+    u64 counts[STRATEGY_COUNT] = {};
+    u64 bytes[STRATEGY_COUNT] = {};
+
+    Strategy pick(u64 old_offset, u64 out_offset, u64 length) {
+        if(length <= inline_max)
+            return INLINE;
+        if(length >= zero_copy_min && old_offset % ALIGNMENT == out_offset % ALIGNMENT)
+            return ZERO_COPY;
+
+        // Try both before trusting the numbers
+        if(buffered_cost.samples == 0)
+            return BUFFERED;
+        if(zero_copy_cost.samples == 0)
+            return ZERO_COPY;
+
+        double buffered = buffered_cost.ns_per_byte + flush_ns_per_byte();
+        Strategy best = buffered <= zero_copy_cost.ns_per_byte ? BUFFERED : ZERO_COPY;
+        if(++undecided % EXPLORE_EVERY == 0)
+            return best == BUFFERED ? ZERO_COPY : BUFFERED;
+        return best;
+    }
+
+    double flush_ns_per_byte() const {
+        return buffer.flushed ? static_cast<double>(buffer.flush_ns) / buffer.flushed : 0;
+    }
+
+public:
+    AdaptiveEngine(OldFiles& old_, const PatchOptions& options);
+    ~AdaptiveEngine();
+
+    void open(const std::filesystem::path& path, u64 size);
+    void cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    void new_data(ByteSource& stream, u64 out_offset, u64 length);
+    void flush();
+    void close();
+};
+
+// O_DIRECT for old file reads and output writes, for files much bigger than the page
+// cache. Outputs are assembled in an aligned buffer and written in whole blocks, the tail
+// is rounded up and truncated back. Old data is read in aligned blocks and copied out,
+// since covers start and end anywhere. Files the filesystem won't do O_DIRECT on go
+// through the page cache as usual
+class DirectEngine {
+private:
+    static constexpr u64 ALIGN = 4096;
+    static constexpr int NOT_OPEN = -1;
+    static constexpr int REFUSED = -2;
+
+    OldFiles& old;
+    // O_DIRECT descriptors of the old files, or NOT_OPEN/REFUSED
+    std::vector<int> direct_fds;
+
+    u8* read_buf = nullptr;
+    u64 read_cap;
+    size_t read_file = SIZE_MAX;
+    u64 read_start = 0;
+    u64 read_size = 0;
+
+    u8* out_buf = nullptr;
+    u64 out_cap;
+    u64 out_start = 0;
+    u64 out_used = 0;
+
+    std::filesystem::path out_path;
+    int out = -1;
+    bool out_direct = false;
+    u64 out_size = 0;
+
+    void load(size_t old_file, u64 offset);
+    void read(size_t old_file, u64 offset, u8* dest, u64 length);
+    std::span<u8> reserve(u64 out_offset, u64 length);
+    void write_out(bool last);
+
+public:
+    u64 fallback_files = 0;
+
+    DirectEngine(OldFiles& old_, const PatchOptions& options);
+    ~DirectEngine();
+
+    void open(const std::filesystem::path& path, u64 size);
+    void cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    void new_data(ByteSource& stream, u64 out_offset, u64 length);
+    void flush();
+    void close();
+};
+
+#ifdef DPATCHZ_HAVE_IO_URING
+
+// Pushes everything through io_uring: the output is opened into a direct descriptor,
+// new data is written from registered buffers and covers are linked read + write pairs
+// through the same buffers. Up to queue_depth buffers are in flight at any time, the
+// only waits are for a free buffer and for the whole file to be done in close()
+class UringEngine {
+private:
+    enum Tag : u64 { OPEN = 1, FALLOCATE, READ, WRITE, CLOSE };
+
+    OldFiles& old;
+    Uring ring;
+    u64 chunk;
+    u32 depth;
+    u8* pool = nullptr;
+
+    std::vector<u32> free_buffers;
+    std::vector<u64> lengths;
+    std::vector<size_t> sources;
+    u32 inflight = 0;
+
+    // OPENAT reads the path asynchronously, it has to outlive the request
+    std::string out_path;
+    // The first request after an open has to wait for it
+    bool drain_next = false;
+
+    u8* buffer(u32 index) { return pool + index * chunk; }
+    io_uring_sqe* next_sqe(u32 needed = 1);
+    u32 acquire();
+    void reap(u32 wait);
+    void complete(const io_uring_cqe& cqe);
+
+public:
+    UringEngine(OldFiles& old_, const PatchOptions& options);
+    ~UringEngine();
+
+    // Empty if the kernel can run this engine with these options, otherwise why not
+    static std::string unsupported_reason(const PatchOptions& options);
+
+    void open(const std::filesystem::path& path, u64 size);
+    void cover(size_t old_file, u64 old_offset, u64 out_offset, u64 length);
+    void new_data(ByteSource& stream, u64 out_offset, u64 length);
+    void flush();
+    void close();
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "hotcache.hpp"
+#include "engines.hpp"
+
+#include <algorithm>
+
+HotCache::HotCache(OldFiles& old_, const Plan& plan, u64 budget) : old(old_) {
+    if(budget == 0)
+        return;
+
+    std::vector<std::vector<std::pair<u64, u64>>> reads(old.count());
+    for(const PlanOp& op : plan.ops) {
+        if(op.kind == PlanOp::COVER)
+            reads[op.old_file].push_back({ op.old_offset, op.old_offset + op.length });
+    }
+
+    // Sweep over the reads of every file for the ranges at least two of them overlap
+    std::vector<Segment> candidates;
+    for(size_t file = 0; file < reads.size(); file++) {
+        std::vector<std::pair<u64, int>> events;
+        for(auto [start, end] : reads[file]) {
+            events.push_back({ start, 1 });
+            events.push_back({ end, -1 });
+        }
+        // Ends before starts at the same position, touching reads don't overlap
+        std::sort(events.begin(), events.end());
+
+        int depth = 0;
+        u64 start = 0;
+        for(auto [pos, delta] : events) {
+            int before = depth;
+            depth += delta;
+            if(before < 2 && depth >= 2) {
+                start = pos;
+            }
+            else if(before >= 2 && depth < 2 && pos > start) {
+                Segment* last = candidates.empty() ? nullptr : &candidates.back();
+                if(last && last->old_file == file && last->end == start)
+                    last->end = pos;
+                else
+                    candidates.push_back({ file, start, pos });
+            }
+        }
+    }
+
+    // How much each one would be read
+    auto find = [&](size_t file, u64 offset) {
+        return std::lower_bound(candidates.begin(), candidates.end(), std::pair{ file, offset },
+                                [](const Segment& s, const std::pair<size_t, u64>& pos) {
+                                    return s.old_file < pos.first ||
+                                           (s.old_file == pos.first && s.end <= pos.second);
+                                });
+    };
+    for(size_t file = 0; file < reads.size(); file++) {
+        for(auto [start, end] : reads[file]) {
+            for(auto it = find(file, start); it != candidates.end() && it->old_file == file &&
+                                             it->start < end; it++) {
+                it->uses++;
+                it->touched += std::min(end, it->end) - std::max(start, it->start);
+            }
+        }
+    }
+
+    // Best savings per byte of memory first
+    std::vector<size_t> order;
+    for(size_t i = 0; i < candidates.size(); i++) {
+        if(candidates[i].end - candidates[i].start >= MIN_SEGMENT)
+            order.push_back(i);
+    }
+    auto saving = [&](size_t i) {
+        const Segment& s = candidates[i];
+        return static_cast<double>(s.touched) / (s.end - s.start);
+    };
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return saving(a) > saving(b);
+    });
+
+    std::vector<bool> chosen(candidates.size());
+    for(size_t i : order) {
+        u64 size = candidates[i].end - candidates[i].start;
+        if(cached + size > budget)
+            continue;
+        cached += size;
+        chosen[i] = true;
+    }
+    for(size_t i = 0; i < candidates.size(); i++) {
+        if(chosen[i])
+            segments.push_back(std::move(candidates[i]));
+    }
+}
+
+void HotCache::skip(size_t old_file, u64 offset, u64 length) {
+    u64 end = offset + length;
+    for(Segment& segment : segments) {
+        if(segment.old_file == old_file && segment.start < end && segment.end > offset && --segment.uses == 0) {
+            segment.data.clear();
+            segment.data.shrink_to_fit();
+        }
+    }
+}
+
+HotCache::Segment& HotCache::load(Segment& segment) {
+    if(!segment.loaded) {
+        segment.data.resize(segment.end - segment.start);
+        read_old(old, segment.old_file, segment.start, segment.data.data(), segment.data.size());
+        segment.loaded = true;
+        loaded_bytes += segment.data.size();
+    }
+    return segment;
+}
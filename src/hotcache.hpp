@@ -0,0 +1,82 @@
+#pragma once
+
+#include "patching.hpp"
+
+/*
+ * Old data that more than one cover reads, kept in memory after the first read so the
+ * repeats don't go back to the disk. An analysis pass over the plan finds the ranges,
+ * the ones saving the most reads per byte go in first until `budget` is used, and each
+ * range is freed after its last reference
+ */
+class HotCache {
+private:
+    // Don't bother with anything smaller, OldWindow deals with those fine
+    static constexpr u64 MIN_SEGMENT = 1024;
+
+    struct Segment {
+        size_t old_file;
+        u64 start;
+        u64 end;
+        // Covers that still have to read from it
+        u64 uses = 0;
+        // Bytes all those covers read from it
+        u64 touched = 0;
+        std::vector<u8> data;
+        bool loaded = false;
+    };
+
+    OldFiles& old;
+    // Sorted by old file then start
+    std::vector<Segment> segments;
+
+    Segment& load(Segment& segment);
+
+public:
+    u64 cached = 0;
+    u64 loaded_bytes = 0;
+    u64 hit_bytes = 0;
+    u64 hits = 0;
+
+    HotCache(OldFiles& old_, const Plan& plan, u64 budget);
+
+    bool empty() const { return segments.empty(); }
+    // Counts a cover done by an earlier run as served, without reading anything
+    void skip(size_t old_file, u64 offset, u64 length);
+    size_t size() const { return segments.size(); }
+
+    // Splits the read of a cover in pieces, in order: fn(data, old_offset, length) gets the
+    // cached bytes for the parts in the cache and nullptr for the rest. Has to be called
+    // once for every cover of the plan, in order
+    template <typename F>
+    void serve(size_t old_file, u64 offset, u64 length, F&& fn) {
+        u64 end = offset + length;
+        auto it = std::lower_bound(segments.begin(), segments.end(), std::pair{ old_file, offset },
+                                   [](const Segment& s, const std::pair<size_t, u64>& pos) {
+                                       return s.old_file < pos.first ||
+                                              (s.old_file == pos.first && s.end <= pos.second);
+                                   });
+
+        for(; it != segments.end() && it->old_file == old_file && it->start < end; it++) {
+            if(it->start > offset) {
+                fn(nullptr, offset, it->start - offset);
+                offset = it->start;
+            }
+
+            u64 n = std::min(end, it->end) - offset;
+            if(it->loaded) {
+                hits++;
+                hit_bytes += n;
+            }
+            fn(load(*it).data.data() + (offset - it->start), offset, n);
+            offset += n;
+
+            if(--it->uses == 0) {
+                it->data.clear();
+                it->data.shrink_to_fit();
+            }
+        }
+
+        if(offset < end)
+            fn(nullptr, offset, end - offset);
+    }
+};
@@ -0,0 +1,206 @@
+#include "inplace.hpp"
+#include "engines.hpp"
+
+#include <algorithm>
+#include <tuple>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+InplaceSpill InplaceSpill::build(Plan& plan, const DirDiff& diff, u32 spill_file) {
+    InplaceSpill spill;
+    const auto& old_files = diff.headData.oldFiles;
+    const auto& new_files = diff.headData.newFiles;
+
+    // New file written over each old file, SIZE_MAX when the old file is left alone
+    std::unordered_map<std::string_view, size_t> new_index;
+    for(size_t i = 0; i < new_files.size(); i++)
+        new_index.emplace(new_files[i].name, i);
+    std::vector<size_t> overwritten_by(old_files.size(), SIZE_MAX);
+    for(size_t i = 0; i < old_files.size(); i++) {
+        auto it = new_index.find(old_files[i].name);
+        if(it != new_index.end())
+            overwritten_by[i] = it->second;
+    }
+
+    std::vector<size_t> conflicts;
+    for(size_t file = 0; file + 1 < plan.file_ops.size(); file++) {
+        for(size_t i = plan.file_ops[file]; i < plan.file_ops[file + 1]; i++) {
+            PlanOp& op = plan.ops[i];
+            // Past the old files of the diff nothing is ever overwritten
+            if(op.kind != PlanOp::COVER || op.old_file >= old_files.size())
+                continue;
+
+            // An earlier file has been written and truncated over the whole old file. In
+            // our own file everything before out_offset is written, and while the cover is
+            // copied the writes stay out_offset - old_offset ahead of the reads
+            size_t writer = overwritten_by[op.old_file];
+            if(writer == file && op.old_offset == op.out_offset) {
+                op.kind = PlanOp::KEEP;
+                spill.kept += op.length;
+                continue;
+            }
+            if(writer < file || (writer == file && op.old_offset < op.out_offset)) {
+                conflicts.push_back(i);
+                spill.ranges.push_back({ op.old_file, op.old_offset, op.length, 0 });
+            }
+        }
+    }
+
+    std::sort(spill.ranges.begin(), spill.ranges.end(), [](const Range& a, const Range& b) {
+        return std::tie(a.old_file, a.offset) < std::tie(b.old_file, b.offset);
+    });
+    std::vector<Range> merged;
+    for(const Range& r : spill.ranges) {
+        if(!merged.empty() && merged.back().old_file == r.old_file &&
+           r.offset <= merged.back().offset + merged.back().length) {
+            Range& last = merged.back();
+            last.length = std::max(last.length, r.offset + r.length - last.offset);
+            continue;
+        }
+        merged.push_back(r);
+    }
+    spill.ranges = std::move(merged);
+    for(Range& r : spill.ranges) {
+        r.spill_offset = spill.size;
+        spill.size += r.length;
+    }
+
+    for(size_t i : conflicts) {
+        PlanOp& op = plan.ops[i];
+        auto it = std::upper_bound(spill.ranges.begin(), spill.ranges.end(), op,
+                                   [](const PlanOp& op, const Range& r) {
+            return std::tie(op.old_file, op.old_offset) < std::tie(r.old_file, r.offset);
+        }) - 1;
+        op.old_offset = it->spill_offset + (op.old_offset - it->offset);
+        op.old_file = spill_file;
+    }
+    spill.covers = conflicts.size();
+
+    return spill;
+}
+
+int InplaceSpill::create(OldFiles& old, const std::filesystem::path& dir, u64 memory) const {
+    OutputFile out;
+    out.open_unnamed(dir, "spill", in_memory(memory));
+    out.preallocate(size);
+    for(const Range& r : ranges)
+        out.copy_from(old, r.old_file, r.offset, r.spill_offset, r.length);
+
+    int fd = out.fd;
+    out.fd = -1;
+    return fd;
+}
+
+static int open_dir(const std::filesystem::path& path) {
+    int fd = open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        throw std::runtime_error(std::format("Failed to open directory: {} ({})", path.string(), strerror(errno)));
+    return fd;
+}
+
+EarlyPublish::EarlyPublish(const Plan& plan, const DirDiff& diff_, const std::filesystem::path& source,
+                           const std::filesystem::path& written_to, bool delete_removed_, bool keep_old_)
+    : diff(diff_), delete_removed(delete_removed_), keep_old(keep_old_) {
+    const auto& old_files = diff.headData.oldFiles;
+    const auto& new_files = diff.headData.newFiles;
+
+    last_reader.assign(old_files.size(), NONE);
+    for(size_t file = 0; file + 1 < plan.file_ops.size(); file++) {
+        for(const PlanOp& op : plan.file(file)) {
+            // The spill file of --no-tmp comes after the old files
+            if(op.kind == PlanOp::COVER && op.old_file < old_files.size())
+                last_reader[op.old_file] = file;
+        }
+    }
+    last_read_by.resize(new_files.size());
+    for(size_t i = 0; i < old_files.size(); i++) {
+        if(last_reader[i] != NONE)
+            last_read_by[last_reader[i]].push_back(i);
+    }
+
+    std::unordered_map<std::string_view, size_t> old_index;
+    for(size_t i = 0; i < old_files.size(); i++)
+        old_index.emplace(old_files[i].name, i);
+    old_at.assign(new_files.size(), NONE);
+    new_at.assign(old_files.size(), NONE);
+    for(size_t i = 0; i < new_files.size(); i++) {
+        auto it = old_index.find(new_files[i].name);
+        if(it != old_index.end()) {
+            old_at[i] = it->second;
+            new_at[it->second] = i;
+        }
+    }
+
+    waiting.assign(new_files.size(), false);
+
+    source_dir = open_dir(source);
+    if(written_to != source) {
+        for(const auto& dir : diff.headData.newDirs)
+            std::filesystem::create_directories(source / dir.name);
+        written_dir = open_dir(written_to);
+    }
+}
+
+EarlyPublish::~EarlyPublish() {
+    if(source_dir >= 0)
+        close(source_dir);
+    if(written_dir >= 0)
+        close(written_dir);
+}
+
+void EarlyPublish::release(OldFiles& old, size_t old_file, bool resumed) {
+    old.release(old_file);
+    size_t replacement = new_at[old_file];
+    if(replacement == NONE && delete_removed) {
+        const std::string& name = diff.headData.oldFiles[old_file].name;
+        if(unlinkat(source_dir, name.c_str(), 0) != 0 && errno != ENOENT) {
+            throw std::runtime_error(std::format("Failed to delete {} ({})", old.path(old_file).string(),
+                                                 strerror(errno)));
+        }
+        deleted++;
+    }
+    else if(replacement != NONE && waiting[replacement]) {
+        publish(replacement, resumed);
+    }
+}
+
+void EarlyPublish::publish(size_t file, bool resumed) {
+    waiting[file] = false;
+    if(written_dir < 0)
+        return;
+
+    const std::string& name = diff.headData.newFiles[file].name;
+    if(renameat(written_dir, name.c_str(), source_dir, name.c_str()) != 0) {
+        // Moved before the interruption
+        if(resumed && errno == ENOENT)
+            return;
+        throw std::runtime_error(std::format("Failed to move {} in place ({})", name, strerror(errno)));
+    }
+    published++;
+}
+
+void EarlyPublish::start(OldFiles& old) {
+    for(size_t i = 0; i < last_reader.size(); i++) {
+        if(last_reader[i] == NONE)
+            release(old, i, true);
+    }
+}
+
+void EarlyPublish::done(OldFiles& old, size_t file, bool resumed) {
+    size_t replaced = old_at[file];
+    bool still_read = replaced != NONE && last_reader[replaced] != NONE && last_reader[replaced] > file;
+    if(still_read && keep_old) {
+        waiting[file] = true;
+    }
+    else {
+        // Later files reading the old version keep doing so through its descriptor
+        if(still_read)
+            old.fd(replaced);
+        publish(file, resumed);
+    }
+
+    for(size_t i : last_read_by[file])
+        release(old, i, resumed);
+}
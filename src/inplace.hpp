@@ -0,0 +1,93 @@
+#pragma once
+
+#include "patching.hpp"
+
+/*
+ * What it takes to write the new files straight over the old ones (-i --no-tmp). Files
+ * are still written in stream order and front to back, so a cover can only read data
+ * that is already gone when its old file is the destination of an earlier new file, or
+ * of its own new file with the writes already past the cover's offset. Those ranges are
+ * copied aside before anything is written and the covers read the copy instead.
+ * Covers copying a file onto itself at the same offset have nothing to do at all
+ */
+class InplaceSpill {
+public:
+    struct Range {
+        u32 old_file;
+        u64 offset;
+        u64 length;
+        // Where the range is in the spill file
+        u64 spill_offset;
+    };
+
+    // Sorted by old file and offset, never overlapping
+    std::vector<Range> ranges;
+    u64 size = 0;
+    // Covers pointed at the spill file
+    u64 covers = 0;
+    // Bytes of the covers turned into KEEP
+    u64 kept = 0;
+
+    // Points every cover of `plan` that would read overwritten data at old file `spill_file`,
+    // and turns the ones that would copy bytes onto themselves into KEEP
+    static InplaceSpill build(Plan& plan, const DirDiff& diff, u32 spill_file);
+
+    bool in_memory(u64 memory) const { return size <= memory; }
+    // Copies the ranges to a memfd, or an unnamed file in `dir` when they don't fit in
+    // `memory`, and returns its descriptor
+    int create(OldFiles& old, const std::filesystem::path& dir, u64 memory) const;
+};
+
+/*
+ * -i: every new file is renamed over its old version as soon as it is written, so an
+ * interrupted patch leaves each file either fully old or fully new. Later files that
+ * still read the old version do it through its descriptor, opened before the rename,
+ * which is closed after the last of them to free the space. With --delete-removed old
+ * files that have no new version go away after their last reader too.
+ * With `keep_old` the rename waits for the last reader instead, so a run resumed from the
+ * journal still finds every old file it needs
+ * With --no-tmp the new files are already where they belong and only deleting is left
+ */
+class EarlyPublish {
+private:
+    static constexpr size_t NONE = SIZE_MAX;
+
+    const DirDiff& diff;
+    bool delete_removed;
+    bool keep_old;
+    // O_PATH descriptors of old_path and of where the new files are written, -1 for the
+    // latter with --no-tmp
+    int source_dir = -1;
+    int written_dir = -1;
+
+    // Last new file that reads each old file, NONE when nothing does
+    std::vector<size_t> last_reader;
+    // The other way around, old files each new file is the last reader of
+    std::vector<std::vector<size_t>> last_read_by;
+    // Old file at the path of each new file and the other way around, NONE when there is none
+    std::vector<size_t> old_at;
+    std::vector<size_t> new_at;
+    // New files that are written, but wait for readers of the old file they replace
+    std::vector<bool> waiting;
+
+    void release(OldFiles& old, size_t old_file, bool resumed);
+    void publish(size_t file, bool resumed);
+
+public:
+    u64 published = 0;
+    u64 deleted = 0;
+
+    // `written_to` is where the new files are written, `source` itself with --no-tmp
+    EarlyPublish(const Plan& plan, const DirDiff& diff_, const std::filesystem::path& source,
+                 const std::filesystem::path& written_to, bool delete_removed_, bool keep_old_);
+    ~EarlyPublish();
+
+    EarlyPublish(const EarlyPublish&) = delete;
+    EarlyPublish& operator=(const EarlyPublish&) = delete;
+
+    // Before the first new file: old files nothing reads
+    void start(OldFiles& old);
+    // New file `file` is written and closed. `resumed` when that was by an interrupted run,
+    // which may have moved and deleted things already
+    void done(OldFiles& old, size_t file, bool resumed = false);
+};
@@ -0,0 +1,165 @@
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#include <set>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static constexpr const char* MAGIC = "dpatchz-journal 1";
+
+Journal::Journal(std::filesystem::path path_, const std::string& diff_id, u64 interval_)
+    : path(std::move(path_)), interval(interval_) {
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+        return;
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    // A record cut short by a crash was never committed
+    size_t valid = content.rfind('\n') == std::string::npos ? 0 : content.rfind('\n') + 1;
+    std::istringstream lines(content.substr(0, valid));
+    std::string line;
+    std::string id;
+    bool header = std::getline(lines, line) && line == MAGIC;
+    header = header && std::getline(lines, line) && line.starts_with("diff ");
+    id = header ? line.substr(5) : "";
+    header = header && std::getline(lines, line) &&
+             std::sscanf(line.c_str(), "interval %" SCNu64, &interval) == 1;
+    header = header && std::getline(lines, line) && line.starts_with("tmp ");
+    // Killed before start() wrote the header: nothing else was written yet, it starts over
+    if(!header && std::count(content.begin(), content.end(), '\n') < 4 &&
+       std::string_view(MAGIC).starts_with(content.substr(0, std::strlen(MAGIC)))) {
+        return;
+    }
+    if(!header)
+        throw std::runtime_error(std::format("{} is not a dpatchz journal, or a broken one", path.string()));
+    if(id != diff_id) {
+        throw std::runtime_error(std::format("{} is the journal of an interrupted patch with another diff, "
+                                             "delete it to start over", path.string()));
+    }
+    tmp_dir = line.substr(4);
+
+    size_t file;
+    Position at;
+    while(std::getline(lines, line)) {
+        if(std::sscanf(line.c_str(), "done %zu", &file) == 1) {
+            resume = { file + 1, 0, 0 };
+        }
+        else if(std::sscanf(line.c_str(), "at %zu %zu %" SCNu64, &at.file, &at.op, &at.new_data) == 3) {
+            if(at.file == resume.file)
+                resume = at;
+        }
+        else {
+            throw std::runtime_error(std::format("{} has an unknown record: {}", path.string(), line));
+        }
+    }
+
+    fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(fd < 0 || ftruncate(fd, valid) != 0)
+        throw std::runtime_error(std::format("Failed to open {} ({})", path.string(), strerror(errno)));
+    resumed = true;
+}
+
+Journal::~Journal() {
+    if(fd >= 0)
+        close(fd);
+}
+
+void Journal::append(const std::string& records) {
+    u64 done = 0;
+    while(done < records.size()) {
+        ssize_t w = write(fd, records.data() + done, records.size() - done);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            throw std::runtime_error(std::format("Failed to write to {} ({})", path.string(), strerror(errno)));
+        done += w;
+    }
+    if(fdatasync(fd) != 0)
+        throw std::runtime_error(std::format("Failed to sync {} ({})", path.string(), strerror(errno)));
+}
+
+void Journal::start(const std::string& diff_id, const std::string& tmp_dir_) {
+    tmp_dir = tmp_dir_;
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0)
+        throw std::runtime_error(std::format("Failed to create {} ({})", path.string(), strerror(errno)));
+    append(std::format("{}\ndiff {}\ninterval {}\ntmp {}\n", MAGIC, diff_id, interval, tmp_dir));
+}
+
+std::vector<size_t> Journal::commit(const Position* at) {
+    // Everything the records below talk about has to be on disk before them: the outputs and
+    // the dirs they were created in. Writeback of all of them starts first so they go together
+    std::vector<int> fds;
+    std::set<std::filesystem::path> dirs;
+    auto open_synced = [&](const std::filesystem::path& file, int flags) {
+        int out = open(file.c_str(), flags | O_CLOEXEC);
+        if(out < 0) {
+            throw std::runtime_error(std::format("Failed to open {} to sync it ({})", file.string(),
+                                                 strerror(errno)));
+        }
+        fds.push_back(out);
+    };
+    try {
+        for(const auto& file : outputs) {
+            open_synced(file, O_RDONLY);
+            sync_file_range(fds.back(), 0, 0, SYNC_FILE_RANGE_WRITE);
+            dirs.insert(file.parent_path());
+        }
+        for(const auto& dir : dirs)
+            open_synced(dir, O_RDONLY | O_DIRECTORY);
+        for(int out : fds) {
+            if(fdatasync(out) != 0)
+                throw std::runtime_error(std::format("Failed to sync the outputs ({})", strerror(errno)));
+        }
+    } catch(...) {
+        for(int out : fds)
+            close(out);
+        throw;
+    }
+    for(int out : fds)
+        close(out);
+    // The file it stopped in gets more writes
+    outputs.erase(outputs.begin(), at && !outputs.empty() ? outputs.end() - 1 : outputs.end());
+
+    std::string records;
+    for(size_t file : pending)
+        records += std::format("done {}\n", file);
+    if(at)
+        records += std::format("at {} {} {}\n", at->file, at->op, at->new_data);
+    append(records);
+
+    written = 0;
+    return std::exchange(pending, {});
+}
+
+void Journal::remove() {
+    close(fd);
+    fd = -1;
+    std::filesystem::remove(path);
+}
+
+std::string Journal::identify(const std::filesystem::path& diff_file) {
+    constexpr u64 SAMPLE = 1 << 20;
+    std::ifstream in(diff_file, std::ios::binary);
+    u64 size = std::filesystem::file_size(diff_file);
+    std::vector<char> data(std::min(size, SAMPLE));
+
+    // FNV-1a
+    u64 hash = 0xcbf29ce484222325;
+    for(u64 offset : { u64(0), size - data.size() }) {
+        in.seekg(offset);
+        in.read(data.data(), data.size());
+        for(char c : data) {
+            hash ^= static_cast<u8>(c);
+            hash *= 0x100000001b3;
+        }
+    }
+    return std::format("{}-{:016x}", size, hash);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/*
+ * Append-only record of how far a patch got, so an interrupted run picks up where it
+ * stopped instead of starting over. The outputs are synced before anything about them
+ * is recorded, so whatever the journal says is written is on disk. Records only go in
+ * every `interval` bytes of output, the files written in between are synced together
+ */
+class Journal {
+public:
+    // Ops before `op` of new file `file` are written, using `new_data` bytes of the new
+    // data stream
+    struct Position {
+        size_t file = 0;
+        size_t op = 0;
+        u64 new_data = 0;
+    };
+
+private:
+    std::filesystem::path path;
+    int fd = -1;
+    u64 written = 0;
+    // Files written since the last commit
+    std::vector<size_t> pending;
+    // Their paths, the last one may still be being written
+    std::vector<std::filesystem::path> outputs;
+
+    void append(const std::string& records);
+
+public:
+    static constexpr const char* NAME = ".dpatchz-journal";
+
+    u64 interval;
+    // Where the interrupted run stopped, the start for a new journal
+    Position resume;
+    bool resumed = false;
+    // -i: temporary dir of the run, relative to old_path
+    std::string tmp_dir;
+
+    // Continues the journal at `path` if there is one, throws if it was written for another
+    // diff. start() has to be called otherwise
+    Journal(std::filesystem::path path_, const std::string& diff_id, u64 interval_);
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void start(const std::string& diff_id, const std::string& tmp_dir_);
+
+    // `path` is being written, it is synced by the next commit
+    void output(const std::filesystem::path& path) { outputs.push_back(path); }
+    // Another `n` bytes went to the outputs
+    void wrote(u64 n) { written += n; }
+    bool due() const { return written >= interval; }
+    // New file `file` is complete, it is recorded with the next commit
+    void file_done(size_t file) { pending.push_back(file); }
+    // Syncs the outputs and records the files completed since the last commit, and `at`
+    // when stopping in the middle of a file. Returns the files it recorded
+    std::vector<size_t> commit(const Position* at = nullptr);
+    // The patch is complete, the journal goes away
+    void remove();
+
+    // Identifies a diff by its size and a hash of its first and last MiB
+    static std::string identify(const std::filesystem::path& diff_file);
+};
@@ -0,0 +1,303 @@
+#include "json.hpp"
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+namespace {
+
+class JsonParser {
+private:
+    std::string_view text;
+    size_t pos = 0;
+    // Objects and arrays the value being parsed is in, value() recurses into each of them
+    static constexpr size_t MAX_DEPTH = 64;
+    size_t depth = 0;
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error(std::format("Invalid JSON at offset {}: {}", pos, what));
+    }
+
+    void skip_space() {
+        while(pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+            pos++;
+    }
+
+    bool take(char c) {
+        skip_space();
+        if(pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if(!take(c))
+            fail(std::format("expected '{}'", c));
+    }
+
+    bool take_word(std::string_view word) {
+        if(text.substr(pos, word.size()) != word)
+            return false;
+        pos += word.size();
+        return true;
+    }
+
+    void put_utf8(std::string& out, u32 c) {
+        if(c < 0x80) {
+            out += static_cast<char>(c);
+        }
+        else if(c < 0x800) {
+            out += static_cast<char>(0xC0 | (c >> 6));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if(c < 0x10000) {
+            out += static_cast<char>(0xE0 | (c >> 12));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else {
+            out += static_cast<char>(0xF0 | (c >> 18));
+            out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+
+    u32 hex4() {
+        if(pos + 4 > text.size())
+            fail("truncated \\u escape");
+        u32 value = 0;
+        for(int i = 0; i < 4; i++) {
+            char c = text[pos++];
+            value <<= 4;
+            if(c >= '0' && c <= '9')
+                value |= c - '0';
+            else if(c >= 'a' && c <= 'f')
+                value |= c - 'a' + 10;
+            else if(c >= 'A' && c <= 'F')
+                value |= c - 'A' + 10;
+            else
+                fail("bad \\u escape");
+        }
+        return value;
+    }
+
+    std::string string() {
+        expect('"');
+        std::string out;
+        while(true) {
+            if(pos >= text.size())
+                fail("unterminated string");
+            char c = text[pos++];
+            if(c == '"')
+                return out;
+            if(static_cast<u8>(c) < 0x20)
+                fail("control character in a string");
+            if(c != '\\') {
+                out += c;
+                continue;
+            }
+            if(pos >= text.size())
+                fail("unterminated string");
+            switch(text[pos++]) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    u32 c = hex4();
+                    // Surrogate pair
+                    if(c >= 0xD800 && c < 0xDC00 && take_word("\\u")) {
+                        u32 low = hex4();
+                        if(low < 0xDC00 || low >= 0xE000)
+                            fail("bad surrogate pair");
+                        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    put_utf8(out, c);
+                    break;
+                }
+                default:
+                    fail("unknown escape");
+            }
+        }
+    }
+
+public:
+    explicit JsonParser(std::string_view text_) : text(text_) {}
+
+    Json value() {
+        skip_space();
+        if(pos >= text.size())
+            fail("unexpected end");
+
+        Json json;
+        char c = text[pos];
+        if((c == '{' || c == '[') && depth == MAX_DEPTH)
+            fail(std::format("nested deeper than {}", MAX_DEPTH));
+
+        if(c == '{') {
+            pos++;
+            depth++;
+            json.type = Json::Type::Object;
+            if(!take('}')) {
+                do {
+                    skip_space();
+                    std::string key = string();
+                    expect(':');
+                    json.object.emplace_back(std::move(key), value());
+                } while(take(','));
+                expect('}');
+            }
+            depth--;
+        }
+        else if(c == '[') {
+            pos++;
+            depth++;
+            json.type = Json::Type::Array;
+            if(!take(']')) {
+                do {
+                    json.array.push_back(value());
+                } while(take(','));
+                expect(']');
+            }
+            depth--;
+        }
+        else if(c == '"') {
+            json.type = Json::Type::String;
+            json.string = string();
+        }
+        else if(take_word("true")) {
+            json.type = Json::Type::Bool;
+            json.boolean = true;
+        }
+        else if(take_word("false")) {
+            json.type = Json::Type::Bool;
+        }
+        else if(take_word("null")) {
+            json.type = Json::Type::Null;
+        }
+        else if(c == '-' || (c >= '0' && c <= '9')) {
+            size_t start = pos;
+            while(pos < text.size() && std::string_view("+-.eE0123456789").find(text[pos]) != std::string_view::npos)
+                pos++;
+            std::string number(text.substr(start, pos - start));
+            size_t used = 0;
+            try {
+                json.number = std::stod(number, &used);
+            } catch(const std::exception&) {
+                used = 0;
+            }
+            if(used != number.size())
+                fail(std::format("bad number {}", number));
+            json.type = Json::Type::Number;
+        }
+        else {
+            fail(std::format("unexpected '{}'", c));
+        }
+        return json;
+    }
+
+    void end() {
+        skip_space();
+        if(pos != text.size())
+            fail("trailing characters");
+    }
+};
+
+}
+
+Json Json::parse(std::string_view text) {
+    JsonParser parser(text);
+    Json json = parser.value();
+    parser.end();
+    return json;
+}
+
+Json Json::parse_file(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+        throw std::runtime_error(std::format("Failed to open {} ({})", path.string(), strerror(errno)));
+    std::ostringstream text;
+    text << in.rdbuf();
+    try {
+        return parse(text.str());
+    } catch(const std::exception& e) {
+        throw std::runtime_error(std::format("{}: {}", path.string(), e.what()));
+    }
+}
+
+const Json* Json::find(std::string_view key) const {
+    for(const auto& [name, value] : object) {
+        if(name == key)
+            return &value;
+    }
+    return nullptr;
+}
+
+std::string Json::get_string(std::string_view key, const std::string& fallback) const {
+    const Json* value = find(key);
+    if(!value || value->type == Type::Null)
+        return fallback;
+    if(value->type != Type::String)
+        throw std::runtime_error(std::format("\"{}\" has to be a string", key));
+    return value->string;
+}
+
+bool Json::get_bool(std::string_view key, bool fallback) const {
+    const Json* value = find(key);
+    if(!value || value->type == Type::Null)
+        return fallback;
+    if(value->type != Type::Bool)
+        throw std::runtime_error(std::format("\"{}\" has to be true or false", key));
+    return value->boolean;
+}
+
+u64 Json::get_size(std::string_view key, u64 fallback) const {
+    const Json* value = find(key);
+    if(!value || value->type == Type::Null)
+        return fallback;
+    if(value->type == Type::Number && value->number >= 0 && value->number == std::floor(value->number))
+        return static_cast<u64>(value->number);
+    if(value->type == Type::String) {
+        if(std::optional<u64> size = parse_size(value->string))
+            return *size;
+    }
+    throw std::runtime_error(std::format("\"{}\" has to be a size like 4096 or \"64M\"", key));
+}
+
+int Json::get_int(std::string_view key, int fallback) const {
+    const Json* value = find(key);
+    if(!value || value->type == Type::Null)
+        return fallback;
+    if(value->type != Type::Number || value->number != std::floor(value->number) ||
+       std::abs(value->number) > std::numeric_limits<int>::max()) {
+        throw std::runtime_error(std::format("\"{}\" has to be a whole number", key));
+    }
+    return static_cast<int>(value->number);
+}
+
+std::string Json::quote(std::string_view text) {
+    std::string out = "\"";
+    for(char c : text) {
+        switch(c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if(static_cast<u8>(c) < 0x20)
+                    out += std::format("\\u{:04x}", static_cast<int>(c));
+                else
+                    out += c;
+        }
+    }
+    return out + "\"";
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * Just enough JSON for job manifests and reports: values are parsed into a tree, objects keep
+ * their members in order. Numbers are doubles, sizes can also be strings like "64M"
+ */
+class Json {
+public:
+    enum class Type {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> array;
+    std::vector<std::pair<std::string, Json>> object;
+
+    // Throws with the offset of the first thing that isn't valid JSON
+    static Json parse(std::string_view text);
+    static Json parse_file(const std::filesystem::path& path);
+
+    // Member `key` of an object, nullptr if there is none
+    const Json* find(std::string_view key) const;
+
+    // The member `key` of an object as a given type, `fallback` when it's missing. Throw if
+    // it's there with another type
+    std::string get_string(std::string_view key, const std::string& fallback = "") const;
+    bool get_bool(std::string_view key, bool fallback = false) const;
+    u64 get_size(std::string_view key, u64 fallback = 0) const;
+    int get_int(std::string_view key, int fallback = 0) const;
+
+    // "text" with everything JSON needs escaped
+    static std::string quote(std::string_view text);
+};
@@ -0,0 +1,242 @@
+#include "linkfarm.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+LinkFarm::LinkFarm(const std::filesystem::path& source, const std::filesystem::path& dest,
+                   const std::unordered_set<std::string>& skip_, LinkMode mode_)
+    : skip(skip_), mode(mode_) {
+    source_root = open(source.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(source_root < 0)
+        throw std::runtime_error(std::format("Failed to open {} ({})", source.string(), strerror(errno)));
+    dest_root = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dest_root < 0)
+        throw std::runtime_error(std::format("Failed to open {} ({})", dest.string(), strerror(errno)));
+
+    struct stat st;
+    if(fstat(dest_root, &st) != 0)
+        throw std::runtime_error(std::format("Failed to stat {} ({})", dest.string(), strerror(errno)));
+    dest_dev = st.st_dev;
+    dest_ino = st.st_ino;
+}
+
+LinkFarm::~LinkFarm() {
+    if(source_root >= 0)
+        close(source_root);
+    if(dest_root >= 0)
+        close(dest_root);
+}
+
+LinkResult link_file(int source_dir, const char* source_name, int dest_dir, const char* dest_name, bool hardlink,
+                     const std::string& rel) {
+    // Whatever a previous run left there goes, truncating it could empty an old file it's
+    // a hardlink of
+    unlinkat(dest_dir, dest_name, 0);
+
+    if(hardlink) {
+        if(linkat(source_dir, source_name, dest_dir, dest_name, 0) == 0)
+            return LinkResult::Hardlinked;
+        // Other filesystem, too many links... a copy still works
+        if(errno != EXDEV && errno != EPERM && errno != EMLINK)
+            throw std::runtime_error(std::format("Failed to link {} ({})", rel, strerror(errno)));
+    }
+
+    int in = openat(source_dir, source_name, O_RDONLY | O_CLOEXEC);
+    if(in < 0)
+        throw std::runtime_error(std::format("Failed to open {} ({})", rel, strerror(errno)));
+    struct stat st;
+    fstat(in, &st);
+    int out = openat(dest_dir, dest_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if(out < 0) {
+        close(in);
+        throw std::runtime_error(std::format("Failed to create {} ({})", rel, strerror(errno)));
+    }
+
+    auto fail = [&](const char* what) {
+        int err = errno;
+        close(in);
+        close(out);
+        throw std::runtime_error(std::format("Failed to {} {} ({})", what, rel, strerror(err)));
+    };
+
+    LinkResult result = LinkResult::Reflinked;
+    if(ioctl(out, FICLONE, in) != 0) {
+        result = LinkResult::Copied;
+        u64 left = st.st_size;
+        bool fallback = false;
+        while(left > 0 && !fallback) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0);
+            if(n < 0 && errno == EINTR)
+                continue;
+            fallback = n < 0 && (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL);
+            if(!fallback && n <= 0)
+                fail("copy");
+            if(n > 0)
+                left -= n;
+        }
+        std::vector<u8> buffer(fallback ? std::min<u64>(left, 1 << 20) : 0);
+        while(left > 0) {
+            ssize_t n = read(in, buffer.data(), std::min<u64>(left, buffer.size()));
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                fail("read");
+            for(ssize_t w = 0; w < n;) {
+                ssize_t r = write(out, buffer.data() + w, n - w);
+                if(r < 0 && errno == EINTR)
+                    continue;
+                if(r <= 0)
+                    fail("write");
+                w += r;
+            }
+            left -= n;
+        }
+    }
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    futimens(out, times);
+    close(in);
+    if(close(out) != 0)
+        throw std::runtime_error(std::format("Failed to write {} ({})", rel, strerror(errno)));
+    return result;
+}
+
+std::vector<std::string> LinkFarm::populate(const std::string& rel) {
+    const char* path = rel.empty() ? "." : rel.c_str();
+    int source_dir = openat(source_root, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(source_dir < 0)
+        throw std::runtime_error(std::format("Failed to open {} ({})", path, strerror(errno)));
+    DIR* dir = fdopendir(source_dir);
+    if(!dir) {
+        close(source_dir);
+        throw std::runtime_error(std::format("Failed to read {} ({})", path, strerror(errno)));
+    }
+
+    if(!rel.empty() && mkdirat(dest_root, path, 0755) != 0 && errno != EEXIST) {
+        closedir(dir);
+        throw std::runtime_error(std::format("Failed to create {} ({})", path, strerror(errno)));
+    }
+    int dest_dir = openat(dest_root, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dest_dir < 0) {
+        closedir(dir);
+        throw std::runtime_error(std::format("Failed to open {} in new_path ({})", path, strerror(errno)));
+    }
+
+    std::vector<std::string> subdirs;
+    try {
+        while(dirent* entry = readdir(dir)) {
+            std::string_view name = entry->d_name;
+            if(name == "." || name == "..")
+                continue;
+            std::string entry_rel = rel.empty() ? std::string(name) : rel + "/" + std::string(name);
+            if(skip.contains(entry_rel))
+                continue;
+
+            struct stat st;
+            if(fstatat(source_dir, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                throw std::runtime_error(std::format("Failed to stat {} ({})", entry_rel, strerror(errno)));
+
+            if(S_ISDIR(st.st_mode)) {
+                if(st.st_dev != dest_dev || st.st_ino != dest_ino)
+                    subdirs.push_back(std::move(entry_rel));
+            }
+            else if(S_ISREG(st.st_mode)) {
+                switch(link_file(source_dir, entry->d_name, dest_dir, entry->d_name, mode == LinkMode::Hardlink,
+                                 entry_rel)) {
+                    case LinkResult::Hardlinked:
+                        hardlinked++;
+                        break;
+                    case LinkResult::Reflinked:
+                        reflinked++;
+                        break;
+                    case LinkResult::Copied:
+                        copied++;
+                        break;
+                }
+                files++;
+                bytes += st.st_size;
+            }
+            else if(S_ISLNK(st.st_mode)) {
+                std::string target(st.st_size + 1, '\0');
+                ssize_t n = readlinkat(source_dir, entry->d_name, target.data(), target.size());
+                if(n < 0) {
+                    throw std::runtime_error(std::format("Failed to read link {} ({})", entry_rel,
+                                                         strerror(errno)));
+                }
+                target.resize(n);
+                unlinkat(dest_dir, entry->d_name, 0);
+                if(symlinkat(target.c_str(), dest_dir, entry->d_name) != 0) {
+                    throw std::runtime_error(std::format("Failed to create link {} ({})", entry_rel,
+                                                         strerror(errno)));
+                }
+                files++;
+            }
+        }
+    } catch(...) {
+        closedir(dir);
+        close(dest_dir);
+        throw;
+    }
+
+    closedir(dir);
+    close(dest_dir);
+    dirs++;
+    return subdirs;
+}
+
+void LinkFarm::run(unsigned threads) {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::string> queue = { "" };
+    // Directories queued or being read, the walk is over at 0
+    size_t pending = 1;
+    std::exception_ptr error;
+
+    auto worker = [&]() {
+        std::unique_lock lock(mutex);
+        while(true) {
+            wake.wait(lock, [&]() { return !queue.empty() || pending == 0 || error; });
+            if(pending == 0 || error)
+                return;
+            std::string rel = std::move(queue.front());
+            queue.pop_front();
+
+            lock.unlock();
+            std::vector<std::string> subdirs;
+            std::exception_ptr failed;
+            try {
+                subdirs = populate(rel);
+            } catch(...) {
+                failed = std::current_exception();
+            }
+            lock.lock();
+
+            if(failed && !error)
+                error = failed;
+            pending += subdirs.size();
+            pending--;
+            for(std::string& subdir : subdirs)
+                queue.push_back(std::move(subdir));
+            wake.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for(std::thread& thread : pool)
+        thread.join();
+
+    if(error)
+        std::rethrow_exception(error);
+}
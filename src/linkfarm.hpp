@@ -0,0 +1,61 @@
+#pragma once
+
+#include "patching.hpp"
+
+#include <atomic>
+#include <unordered_set>
+
+#include <sys/stat.h>
+
+enum class LinkResult {
+    Hardlinked,
+    Reflinked,
+    Copied,
+};
+
+// Puts a copy of `source_name` in directory `source_dir` at `dest_name` in `dest_dir`, replacing
+// whatever is there: a hardlink if asked and possible, else a reflink, else copy_file_range.
+// `rel` names the file in errors
+LinkResult link_file(int source_dir, const char* source_name, int dest_dir, const char* dest_name, bool hardlink,
+                     const std::string& rel);
+
+/*
+ * --link-unchanged: the diff only has the files that changed, this fills new_path with the
+ * rest of old_path so it's a complete tree. Files are reflinked (or hardlinked) when the
+ * filesystem allows it, so nothing is duplicated, and copied with copy_file_range otherwise.
+ * Directories are handed out to a few threads, everything inside one is done relative to
+ * its descriptors
+ */
+class LinkFarm {
+private:
+    // Skipped: the files of the diff, old and new versions
+    const std::unordered_set<std::string>& skip;
+    LinkMode mode;
+    int source_root = -1;
+    int dest_root = -1;
+    // new_path itself when it's inside old_path, it isn't walked
+    dev_t dest_dev;
+    ino_t dest_ino;
+
+    // Copies or links every entry of directory `rel` (relative to both roots, "" for the
+    // roots themselves), returns its subdirectories
+    std::vector<std::string> populate(const std::string& rel);
+
+public:
+    std::atomic<u64> files = 0;
+    std::atomic<u64> dirs = 0;
+    std::atomic<u64> bytes = 0;
+    std::atomic<u64> reflinked = 0;
+    std::atomic<u64> hardlinked = 0;
+    std::atomic<u64> copied = 0;
+
+    LinkFarm(const std::filesystem::path& source, const std::filesystem::path& dest,
+             const std::unordered_set<std::string>& skip_, LinkMode mode_);
+    ~LinkFarm();
+
+    LinkFarm(const LinkFarm&) = delete;
+    LinkFarm& operator=(const LinkFarm&) = delete;
+
+    // Walks old_path with `threads` threads, throws the first error any of them hit
+    void run(unsigned threads);
+};
@@ -1,19 +1,19 @@
 #include "../thirdparty/argparse.hpp"
+#include "batch.hpp"
+#include "chain.hpp"
+#include "daemon.hpp"
+#include "json.hpp"
+#include "multi.hpp"
 #include "patching.hpp"
 #include "parsing.hpp"
+#include "undo.hpp"
 #include "dwhbll-logging.hpp"
 
 u64 cache_size;
 
-int main(int argc, char** argv) {
-    argparse::ArgumentParser program("dpatchz");
-
-    program.add_argument("diff_file");
-    program.add_argument("source_dir");
-    program.add_argument("output_dir")
-        .help("Has to not exist or be empty. Ignored if -i is passed")
-        .nargs(0,1);
-
+// The options of a patch, shared with dpatchz batch. -i, --skip-existing and --undo-log are
+// about one patch and are added by the caller
+static void add_patch_options(argparse::ArgumentParser& program) {
     program.add_argument("-v", "--verbose")
         .default_value(false)
         .implicit_value(true);
@@ -23,11 +23,312 @@ int main(int argc, char** argv) {
         .default_value(4096)
         .scan<'i', int>();
 
+    program.add_argument("--no-tmp")
+        .help("With -i, write the new files straight over the old ones instead of through a temporary "
+              "dir. Needs almost no extra space, but an interrupted patch leaves the tree broken")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--delete-removed")
+        .help("With -i, delete the old files that have no new version, as soon as no new file reads them")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--no-journal")
+        .help("Don't keep a journal of the progress in old_path (-i) or new_path. Without it an interrupted "
+              "patch can't be resumed")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--link-unchanged")
+        .help("Without -i, also put every file of source_dir the diff doesn't change in output_dir, for a "
+              "complete tree. reflink: reflinks where the filesystem can, copies otherwise. hardlink: "
+              "hardlinks, same as reflink across filesystems")
+        .choices("reflink", "hardlink");
+
+    program.add_argument("--checkpoint")
+        .help("Output written between two journal updates, a resumed patch redoes at most this much. "
+              "Default: 256M")
+        .default_value(std::string("256M"));
+
+    program.add_argument("--spill-memory")
+        .help("With --no-tmp, old data that would be overwritten before it is read is kept in memory "
+              "up to this size and in an unnamed file in source_dir beyond it. Default: 256M")
+        .default_value(std::string("256M"));
+
+    program.add_argument("-e", "--engine")
+        .help("I/O engine used to write the new files. copy: copy_file_range between files, "
+              "mmap: memcpy between mapped files, uring: batched io_uring requests, "
+              "buffered: pread/pwrite through a large buffer, adaptive: picks per cover, "
+              "direct: O_DIRECT reads and writes, bypassing the page cache")
+        .default_value(std::string("copy"))
+        .choices("copy", "mmap", "uring", "buffered", "adaptive", "direct");
+
+    program.add_argument("--schedule")
+        .help("Order of the writes. stream: each new file front to back, disk: new data first, then every "
+              "cover sorted by old file and offset to avoid seeking on HDDs (--engine is ignored)")
+        .default_value(std::string("stream"))
+        .choices("stream", "disk");
+
+    program.add_argument("--queue-depth")
+        .help("Number of 256KiB buffers the io_uring engine keeps in flight. Default: 32")
+        .default_value(32)
+        .scan<'i', int>();
+
+    program.add_argument("--inline-threshold")
+        .help("Covers up to this size are read from a window of the old file and written together "
+              "with the new data around them (copy, buffered and adaptive engines), 0 disables. Default: 16K")
+        .default_value(std::string("16K"));
+
+    program.add_argument("--zero-copy-threshold")
+        .help("Aligned covers from this size up use copy_file_range in the adaptive engine. Default: 4M")
+        .default_value(std::string("4M"));
+
+    program.add_argument("--write-buffer")
+        .help("Write buffer of the copy, buffered and adaptive engines. Default: 8M")
+        .default_value(std::string("8M"));
+
+    program.add_argument("--prefetch")
+        .help("How much old data ahead of the current cover is prefetched, 0 disables. Default: 32M")
+        .default_value(std::string("32M"));
+
+    program.add_argument("--writeback-window")
+        .help("Write back and drop outputs from the page cache every this many bytes, 0 leaves it to the "
+              "kernel. Smooths out writes on big patches, not used by the uring engine. Default: 0")
+        .default_value(std::string("0"));
+
+    program.add_argument("--hole-threshold")
+        .help("Runs of zeros in the new data at least this long are punched out as holes instead of "
+              "written (copy, buffered and adaptive engines, --schedule disk). Default: 64K")
+        .default_value(std::string("64K"));
+
+    program.add_argument("--dense")
+        .help("Write every zero, never leave holes in the new files")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--hot-cache")
+        .help("Memory for old data that several covers read, so it is only read from disk once. "
+              "0 disables. Default: 64M")
+        .default_value(std::string("64M"));
+
+    program.add_argument("--no-space-check")
+        .help("Don't check that the new files fit on disk before patching")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--evict-old")
+        .help("Drop old data from the page cache once no later cover needs it")
+        .default_value(false)
+        .implicit_value(true);
+}
+
+// Fills `options` from the parsed arguments, along with the verbosity and the read cache.
+// False, after saying why, if one of them is invalid
+static bool read_patch_options(argparse::ArgumentParser& program, PatchOptions& options) {
+    if(program.get<bool>("verbose"))
+        dwhbll::console::defaultLevel = dwhbll::console::Level::DEBUG;
+    cache_size = program.get<int>("-c");
+
+    std::string engine = program.get<std::string>("--engine");
+    if(engine == "mmap")
+        options.engine = EngineKind::Mmap;
+    else if(engine == "uring")
+        options.engine = EngineKind::Uring;
+    else if(engine == "buffered")
+        options.engine = EngineKind::Buffered;
+    else if(engine == "adaptive")
+        options.engine = EngineKind::Adaptive;
+    else if(engine == "direct")
+        options.engine = EngineKind::Direct;
+
+    options.no_tmp = program.get<bool>("--no-tmp");
+    options.delete_removed = program.get<bool>("--delete-removed");
+    options.journal = !program.get<bool>("--no-journal");
+    if(auto mode = program.present("--link-unchanged"))
+        options.link_unchanged = *mode == "hardlink" ? LinkMode::Hardlink : LinkMode::Reflink;
+    options.evict_old = program.get<bool>("--evict-old");
+    options.check_space = !program.get<bool>("--no-space-check");
+    if(program.get<bool>("--dense"))
+        options.hole_threshold = 0;
+    if(program.get<std::string>("--schedule") == "disk")
+        options.schedule = Schedule::Disk;
+
+    int queue_depth = program.get<int>("--queue-depth");
+    if(queue_depth < 1 || queue_depth > 1024) {
+        dwhbll::console::fatal("--queue-depth has to be between 1 and 1024");
+        return false;
+    }
+    options.queue_depth = queue_depth;
+
+    for(auto [name, field] : { std::pair{ "--inline-threshold", &options.inline_threshold },
+                               std::pair{ "--zero-copy-threshold", &options.zero_copy_threshold },
+                               std::pair{ "--write-buffer", &options.write_buffer },
+                               std::pair{ "--prefetch", &options.prefetch },
+                               std::pair{ "--writeback-window", &options.writeback_window },
+                               std::pair{ "--hole-threshold", &options.hole_threshold },
+                               std::pair{ "--hot-cache", &options.hot_cache },
+                               std::pair{ "--spill-memory", &options.spill_memory },
+                               std::pair{ "--checkpoint", &options.checkpoint } }) {
+        std::optional<u64> size = parse_size(program.get<std::string>(name));
+        if(!size) {
+            dwhbll::console::fatal("{} expects a size like 64K, 4M or 1G", name);
+            return false;
+        }
+        *field = *size;
+    }
+    if(options.write_buffer == 0) {
+        dwhbll::console::fatal("--write-buffer can't be 0");
+        return false;
+    }
+    if(options.checkpoint == 0) {
+        dwhbll::console::fatal("--checkpoint can't be 0");
+        return false;
+    }
+    return true;
+}
+
+// dpatchz rollback undo_log old_path
+static int rollback(int argc, char** argv) {
+    argparse::ArgumentParser program("dpatchz rollback");
+
+    program.add_argument("undo_log")
+        .help("Written by a patch with -i --undo-log");
+    program.add_argument("old_path")
+        .help("The directory that was patched");
+
+    program.add_argument("-v", "--verbose")
+        .default_value(false)
+        .implicit_value(true);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if(program.get<bool>("verbose"))
+        dwhbll::console::defaultLevel = dwhbll::console::Level::DEBUG;
+
+    std::filesystem::path log = program.get<std::string>("undo_log");
+    std::filesystem::path root = program.get<std::string>("old_path");
+    if(!std::filesystem::is_regular_file(log)) {
+        dwhbll::console::fatal("{} doesn't exist or is not a file", log.string());
+        return 1;
+    }
+    if(!std::filesystem::is_directory(root)) {
+        dwhbll::console::fatal("{} doesn't exist or is not a directory", root.string());
+        return 1;
+    }
+
+    try {
+        UndoLog::rollback(log, root);
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("Rollback failed: {}", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+// dpatchz batch [options] manifest
+static int batch(int argc, char** argv) {
+    argparse::ArgumentParser program("dpatchz batch");
+
+    program.add_argument("manifest")
+        .help("JSON list of the patches: diff, old and new paths (no new path for -i) and their own options");
+
+    program.add_argument("-j", "--jobs")
+        .help("Patches that run at the same time, patches writing to the same tree always run one after "
+              "the other. Default: 4")
+        .default_value(4)
+        .scan<'i', int>();
+
+    program.add_argument("--memory")
+        .help("Memory the patches running at the same time may use together, counting their write buffer, "
+              "hot cache and spill. A patch that needs more runs alone. Default: 1G")
+        .default_value(std::string("1G"));
+
+    program.add_argument("--device-jobs")
+        .help("Patches that read or write the same disk at the same time. Default: 1 on spinning disks, "
+              "up to --jobs on anything else")
+        .default_value(0)
+        .scan<'i', int>();
+
+    program.add_argument("--report")
+        .help("Write how each patch went to this file, as JSON");
+
+    add_patch_options(program);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    PatchOptions options;
+    if(!read_patch_options(program, options))
+        return 1;
+    int jobs = program.get<int>("--jobs");
+    if(jobs < 1 || jobs > 64) {
+        dwhbll::console::fatal("--jobs has to be between 1 and 64");
+        return 1;
+    }
+    int device_jobs = program.get<int>("--device-jobs");
+    if(device_jobs < 0 || device_jobs > 64) {
+        dwhbll::console::fatal("--device-jobs has to be between 0 and 64");
+        return 1;
+    }
+    std::optional<u64> memory = parse_size(program.get<std::string>("--memory"));
+    if(!memory) {
+        dwhbll::console::fatal("--memory expects a size like 64K, 4M or 1G");
+        return 1;
+    }
+
+    std::filesystem::path manifest = program.get<std::string>("manifest");
+    std::optional<Batch> batch;
+    try {
+        batch.emplace(manifest, options);
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
+
+    int status = batch->run(jobs, *memory, device_jobs);
+    if(auto report = program.present("--report")) {
+        try {
+            batch->write_report(*report);
+        } catch(const std::exception& e) {
+            dwhbll::console::fatal("{}", e.what());
+            return 1;
+        }
+    }
+    return status;
+}
+
+// dpatchz chain [options] diff_file... old_path [new_path]
+static int chain(int argc, char** argv) {
+    argparse::ArgumentParser program("dpatchz chain");
+
+    program.add_argument("paths")
+        .help("The diffs in the order they apply, then old_path, then new_path unless -i is passed")
+        .nargs(argparse::nargs_pattern::at_least_one);
+
     program.add_argument("-i")
         .help("Inplace patching")
         .default_value(false)
         .implicit_value(true);
 
+    program.add_argument("--undo-log")
+        .help("With -i, first write what it takes to undo the whole chain to this file, for dpatchz rollback");
+
+    add_patch_options(program);
+
     try {
         program.parse_args(argc, argv);
     }
@@ -37,10 +338,361 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    bool verbose = program.get<bool>("verbose");
-    if(verbose) {
-        dwhbll::console::defaultLevel = dwhbll::console::Level::DEBUG;
+    PatchOptions options;
+    if(!read_patch_options(program, options))
+        return 1;
+    bool inplace = program.get<bool>("-i");
+
+    std::vector<std::string> paths = program.get<std::vector<std::string>>("paths");
+    size_t trees = inplace ? 1 : 2;
+    if(paths.size() < trees + 1) {
+        dwhbll::console::fatal("dpatchz chain needs at least one diff, old_path{}", inplace ? "" : " and new_path");
+        return 1;
+    }
+    std::vector<std::filesystem::path> diffs(paths.begin(), paths.end() - trees);
+    std::filesystem::path source_dir = paths[paths.size() - trees];
+    std::filesystem::path output_dir = inplace ? "" : paths.back();
+
+    if(options.no_tmp && !inplace) {
+        dwhbll::console::fatal("--no-tmp only makes sense with -i");
+        return 1;
+    }
+    if(options.delete_removed && !inplace) {
+        dwhbll::console::fatal("--delete-removed only makes sense with -i");
+        return 1;
+    }
+    if(options.link_unchanged != LinkMode::None && inplace) {
+        dwhbll::console::fatal("--link-unchanged only makes sense without -i");
+        return 1;
+    }
+    if(auto undo_log = program.present("--undo-log")) {
+        if(!inplace) {
+            dwhbll::console::fatal("--undo-log only makes sense with -i");
+            return 1;
+        }
+        options.undo_log = *undo_log;
+    }
+
+    try {
+        for(const auto& diff_path : diffs)
+            Patcher::check_paths(diff_path, source_dir, output_dir, options);
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
+
+    try {
+        Chain chain = Chain::build(diffs, source_dir);
+        dwhbll::console::info("{}", chain.summary());
+        Patcher patcher(chain.diff, chain.plan, chain.identify(),
+                        std::make_unique<NewDataStream>(diffs.back(), chain.diff.mainDiff.newDataOffset),
+                        source_dir, output_dir, options,
+                        [&chain, memory = options.spill_memory](OldFiles& old, const std::filesystem::path& dir) {
+                            chain.add_old_files(old, dir, memory);
+                        });
+        patcher.patch(inplace);
+    } catch(const PatchError& e) {
+        if(e.interrupted())
+            dwhbll::console::info("{}", e.describe());
+        else
+            dwhbll::console::fatal("{}", e.describe());
+        return e.status;
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+// dpatchz multi [options] diff_file old_path new_path [old_path new_path]...
+static int multi(int argc, char** argv) {
+    argparse::ArgumentParser program("dpatchz multi");
+
+    program.add_argument("diff_file");
+    program.add_argument("trees")
+        .help("old_path new_path for every tree, or only old_path with -i")
+        .nargs(argparse::nargs_pattern::at_least_one);
+
+    program.add_argument("-i")
+        .help("Inplace patching")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--window")
+        .help("Decompressed new data kept in memory for the trees that are behind, a tree that gets this far "
+              "ahead of the slowest one waits for it. Default: 64M")
+        .default_value(std::string("64M"));
+
+    add_patch_options(program);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    PatchOptions options;
+    if(!read_patch_options(program, options))
+        return 1;
+    bool inplace = program.get<bool>("-i");
+    std::optional<u64> window = parse_size(program.get<std::string>("--window"));
+    if(!window) {
+        dwhbll::console::fatal("--window expects a size like 64K, 4M or 1G");
+        return 1;
+    }
+
+    if(options.no_tmp && !inplace) {
+        dwhbll::console::fatal("--no-tmp only makes sense with -i");
+        return 1;
+    }
+    if(options.delete_removed && !inplace) {
+        dwhbll::console::fatal("--delete-removed only makes sense with -i");
+        return 1;
+    }
+    if(options.link_unchanged != LinkMode::None && inplace) {
+        dwhbll::console::fatal("--link-unchanged only makes sense without -i");
+        return 1;
+    }
+
+    std::vector<std::string> paths = program.get<std::vector<std::string>>("trees");
+    if(!inplace && paths.size() % 2 != 0) {
+        dwhbll::console::fatal("Every old_path needs a new_path, unless -i is passed");
+        return 1;
+    }
+    std::vector<MultiPatch::Target> targets;
+    for(size_t i = 0; i < paths.size(); i += inplace ? 1 : 2)
+        targets.push_back({ paths[i], inplace ? "" : paths[i + 1] });
+
+    try {
+        MultiPatch patch(program.get<std::string>("diff_file"), std::move(targets), options, inplace);
+        return patch.run(*window);
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
+}
+
+// dpatchz daemon [options] socket
+static int serve(int argc, char** argv) {
+    argparse::ArgumentParser program("dpatchz daemon");
+
+    program.add_argument("socket")
+        .help("Unix socket to listen on for jobs, from dpatchz submit");
+
+    program.add_argument("-j", "--jobs")
+        .help("Jobs that run at the same time, jobs writing to the same tree always run one after "
+              "the other. Default: 4")
+        .default_value(4)
+        .scan<'i', int>();
+
+    program.add_argument("--memory")
+        .help("Memory the jobs running at the same time may use together, counting their write buffer, "
+              "hot cache and spill. A job that needs more runs alone. Default: 1G")
+        .default_value(std::string("1G"));
+
+    add_patch_options(program);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    PatchOptions options;
+    if(!read_patch_options(program, options))
+        return 1;
+    int jobs = program.get<int>("--jobs");
+    if(jobs < 1 || jobs > 64) {
+        dwhbll::console::fatal("--jobs has to be between 1 and 64");
+        return 1;
+    }
+    std::optional<u64> memory = parse_size(program.get<std::string>("--memory"));
+    if(!memory) {
+        dwhbll::console::fatal("--memory expects a size like 64K, 4M or 1G");
+        return 1;
+    }
+
+    try {
+        Daemon daemon(program.get<std::string>("socket"), options, jobs, *memory);
+        daemon.run();
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
     }
+    return 0;
+}
+
+// dpatchz submit [options] socket diff_file old_path [new_path]
+static int submit(int argc, char** argv) {
+    argparse::ArgumentParser program("dpatchz submit");
+
+    program.add_argument("socket")
+        .help("Where dpatchz daemon listens");
+    program.add_argument("diff_file");
+    program.add_argument("old_path");
+    program.add_argument("new_path")
+        .help("Ignored if -i is passed")
+        .nargs(0,1);
+
+    program.add_argument("-i")
+        .help("Inplace patching")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("-p", "--priority")
+        .help("Jobs with a higher priority start first. Default: 0")
+        .default_value(0)
+        .scan<'i', int>();
+
+    program.add_argument("--name")
+        .help("What the daemon calls the job in its log");
+
+    program.add_argument("--no-tmp")
+        .help("With -i, write the new files straight over the old ones instead of through a temporary dir")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--delete-removed")
+        .help("With -i, delete the old files that have no new version")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--no-journal")
+        .help("Don't keep a journal of the progress, an interrupted job can't be resumed")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--skip-existing")
+        .help("md5 manifest of the new files, the ones that already match it are not written again");
+
+    program.add_argument("--undo-log")
+        .help("With -i, first write what it takes to undo the patch to this file");
+
+    program.add_argument("--link-unchanged")
+        .help("Without -i, also put every file of old_path the diff doesn't change in new_path")
+        .choices("reflink", "hardlink");
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    bool inplace = program.get<bool>("-i");
+    std::optional<std::string> new_path = program.present("new_path");
+    if(!inplace && !new_path) {
+        dwhbll::console::fatal("new_path is needed unless -i is passed");
+        return 1;
+    }
+
+    // The daemon runs elsewhere, it gets absolute paths. What doesn't fit the job is for the
+    // daemon to refuse
+    auto path = [](const std::string& value) {
+        return Json::quote(std::filesystem::absolute(value).lexically_normal().string());
+    };
+    std::string job = std::format("{{\"diff\": {}, \"old\": {}", path(program.get<std::string>("diff_file")),
+                                  path(program.get<std::string>("old_path")));
+    if(!inplace)
+        job += std::format(", \"new\": {}", path(*new_path));
+    if(auto name = program.present("--name"))
+        job += std::format(", \"name\": {}", Json::quote(*name));
+    job += std::format(", \"priority\": {}", program.get<int>("--priority"));
+    for(auto [flag, key] : { std::pair{ "--no-tmp", "no_tmp" }, std::pair{ "--delete-removed", "delete_removed" } }) {
+        if(program.get<bool>(flag))
+            job += std::format(", \"{}\": true", key);
+    }
+    if(program.get<bool>("--no-journal"))
+        job += ", \"journal\": false";
+    for(auto [flag, key] : { std::pair{ "--skip-existing", "skip_existing" }, std::pair{ "--undo-log", "undo_log" } }) {
+        if(auto value = program.present(flag))
+            job += std::format(", \"{}\": {}", key, path(*value));
+    }
+    if(auto mode = program.present("--link-unchanged"))
+        job += std::format(", \"link_unchanged\": {}", Json::quote(*mode));
+    job += "}";
+
+    try {
+        return Daemon::submit(program.get<std::string>("socket"), job, [](const Json& event) {
+            std::string kind = event.get_string("event");
+            if(kind == "queued")
+                dwhbll::console::info("Queued as job {}, {} queued ahead of it", event.get_size("id"),
+                                      event.get_size("ahead"));
+            else if(kind == "started")
+                dwhbll::console::info("Started");
+            else if(kind == "progress")
+                dwhbll::console::info("[{}/{}] files patched", event.get_size("files"), event.get_size("of"));
+            else if(kind == "finished" && event.get_string("status") == "done")
+                dwhbll::console::info("Done in {:.1f}s", event.find("seconds")->number);
+            else if(kind == "finished" && event.get_string("status") == "interrupted")
+                dwhbll::console::info("{}", event.get_string("error"));
+            else if(kind == "finished")
+                dwhbll::console::fatal("{}", event.get_string("error"));
+        });
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    // Subcommands come first, anything else is a patch
+    if(argc > 1 && std::string_view(argv[1]) == "rollback")
+        return rollback(argc - 1, argv + 1);
+    if(argc > 1 && std::string_view(argv[1]) == "batch")
+        return batch(argc - 1, argv + 1);
+    if(argc > 1 && std::string_view(argv[1]) == "chain")
+        return chain(argc - 1, argv + 1);
+    if(argc > 1 && std::string_view(argv[1]) == "multi")
+        return multi(argc - 1, argv + 1);
+    if(argc > 1 && std::string_view(argv[1]) == "daemon")
+        return serve(argc - 1, argv + 1);
+    if(argc > 1 && std::string_view(argv[1]) == "submit")
+        return submit(argc - 1, argv + 1);
+
+    argparse::ArgumentParser program("dpatchz");
+
+    program.add_argument("diff_file");
+    program.add_argument("source_dir");
+    program.add_argument("output_dir")
+        .help("Has to not exist or be empty, unless --skip-existing is passed. Ignored if -i is passed")
+        .nargs(0,1);
+
+    program.add_argument("-i")
+        .help("Inplace patching")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--skip-existing")
+        .help("md5 manifest of the new files (md5sum format, paths relative to new_path). New files that "
+              "already match it, in new_path or old_path with -i, are not written again");
+
+    program.add_argument("--undo-log")
+        .help("With -i, first write what it takes to undo the patch to this file, for dpatchz rollback. "
+              "Only old data that ends up in no new file is stored");
+
+    add_patch_options(program);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    PatchOptions options;
+    if(!read_patch_options(program, options))
+        return 1;
 
     std::filesystem::path diff_path = program.get<std::string>("diff_file");
     std::filesystem::path source_dir = program.get<std::string>("source_dir");
@@ -50,50 +702,57 @@ int main(int argc, char** argv) {
     if(!inplace) {
         output_dir = program.get<std::string>("output_dir");
     }
-    cache_size = program.get<int>("-c");
 
-    if(!std::filesystem::exists(diff_path) || std::filesystem::is_directory(diff_path)) {
-        dwhbll::console::fatal("{} doesn't exist or is not a file", diff_path.string());
+    if(options.no_tmp && !inplace) {
+        dwhbll::console::fatal("--no-tmp only makes sense with -i");
         return 1;
     }
-    if(!std::filesystem::exists(source_dir) || !std::filesystem::is_directory(source_dir)) {
-        dwhbll::console::fatal("{} doesn't exist or is not a directory", source_dir.string());
+    if(options.delete_removed && !inplace) {
+        dwhbll::console::fatal("--delete-removed only makes sense with -i");
         return 1;
     }
-    if(std::filesystem::exists(output_dir)) {
-        if(!std::filesystem::is_directory(output_dir)) {
-            dwhbll::console::fatal("{} exists and is not a directory", output_dir.string());
-            return 1;
-        }
-        else if(!std::filesystem::is_empty(output_dir)) {
-            dwhbll::console::fatal("{} exists and is not empty", output_dir.string());
+    if(options.link_unchanged != LinkMode::None && inplace) {
+        dwhbll::console::fatal("--link-unchanged only makes sense without -i");
+        return 1;
+    }
+    if(auto undo_log = program.present("--undo-log")) {
+        if(!inplace) {
+            dwhbll::console::fatal("--undo-log only makes sense with -i");
             return 1;
         }
+        options.undo_log = *undo_log;
     }
+    if(auto manifest = program.present("--skip-existing"))
+        options.skip_existing = *manifest;
 
-    Parser parser(diff_path);
-    DirDiff diff = DirDiff::parse(parser);
-
-    dwhbll::console::debug("Parsed diff file:\n{}\n{}\n{}\n{}\n", diff.to_string(), 
-                           diff.headData.to_string(), diff.mainDiff.to_string(),
-                           diff.mainDiff.coverBuf.to_string());
-
-    // Kuro diffs don't seem to be using RLE so we just ignore it
-    // TODO: implement RLE anyway
-    if(diff.mainDiff.compressedRleCodeBufSize.value > 0)
-        parser.read_bytes<u8>(diff.mainDiff.compressedRleCodeBufSize.value);
-    else
-        parser.read_bytes<u8>(diff.mainDiff.rleCodeBufSize.value);
-
-    if(diff.mainDiff.compressedRleCtrlBufSize.value > 0)
-        parser.read_bytes<u8>(diff.mainDiff.compressedRleCtrlBufSize.value);
-    else
-        parser.read_bytes<u8>(diff.mainDiff.rleCtrlBufSize.value);
+    try {
+        Patcher::check_paths(diff_path, source_dir, output_dir, options);
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
 
-    diff.mainDiff.newDataOffset = parser.position();
+    DirDiff diff;
+    try {
+        diff = DirDiff::load(diff_path);
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("Failed to parse {}: {}", diff_path.string(), e.what());
+        return 1;
+    }
 
-    Patcher patcher(diff, diff_path, source_dir, output_dir);
-    patcher.patch(inplace);
+    try {
+        Patcher patcher(diff, diff_path, source_dir, output_dir, options);
+        patcher.patch(inplace);
+    } catch(const PatchError& e) {
+        if(e.interrupted())
+            dwhbll::console::info("{}", e.describe());
+        else
+            dwhbll::console::fatal("{}", e.describe());
+        return e.status;
+    } catch(const std::exception& e) {
+        dwhbll::console::fatal("{}", e.what());
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,177 @@
+#include "manifest.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// RFC 1321
+class Md5 {
+private:
+    static constexpr u32 K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static constexpr int SHIFT[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+    u32 state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    u8 block[64];
+    size_t used = 0;
+    u64 length = 0;
+
+    void compress(const u8* p) {
+        u32 m[16];
+        for(int i = 0; i < 16; i++)
+            m[i] = p[i * 4] | p[i * 4 + 1] << 8 | p[i * 4 + 2] << 16 | static_cast<u32>(p[i * 4 + 3]) << 24;
+
+        u32 a = state[0], b = state[1], c = state[2], d = state[3];
+        for(int i = 0; i < 64; i++) {
+            u32 f;
+            int g;
+            if(i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            }
+            else if(i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            }
+            else if(i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            }
+            else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            u32 next = d;
+            d = c;
+            c = b;
+            b += std::rotl(a + f + K[i] + m[g], SHIFT[i / 16 * 4 + i % 4]);
+            a = next;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+public:
+    void update(const u8* data, size_t n) {
+        length += n;
+        if(used > 0) {
+            size_t take = std::min(n, sizeof(block) - used);
+            std::memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            n -= take;
+            if(used < sizeof(block))
+                return;
+            compress(block);
+            used = 0;
+        }
+        for(; n >= sizeof(block); data += sizeof(block), n -= sizeof(block))
+            compress(data);
+        std::memcpy(block, data, n);
+        used = n;
+    }
+
+    std::string hex() {
+        u64 bits = length * 8;
+        u8 pad[72] = { 0x80 };
+        size_t pad_length = (used < 56 ? 56 : 120) - used;
+        for(int i = 0; i < 8; i++)
+            pad[pad_length + i] = static_cast<u8>(bits >> (i * 8));
+        update(pad, pad_length + 8);
+
+        std::string out;
+        for(u32 word : state) {
+            for(int i = 0; i < 4; i++)
+                out += std::format("{:02x}", (word >> (i * 8)) & 0xff);
+        }
+        return out;
+    }
+};
+
+}
+
+Manifest::Manifest(const std::filesystem::path& path) {
+    std::ifstream in(path);
+    if(!in)
+        throw std::runtime_error(std::format("Failed to open manifest {}", path.string()));
+
+    std::string line;
+    for(size_t number = 1; std::getline(in, line); number++) {
+        if(!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if(line.empty())
+            continue;
+
+        size_t space = line.find_first_of(" \t");
+        size_t name = space == std::string::npos ? space : line.find_first_not_of(" \t*", space);
+        std::string sum = line.substr(0, space);
+        bool hex = sum.size() == 32 &&
+                   std::all_of(sum.begin(), sum.end(), [](unsigned char c) { return std::isxdigit(c); });
+        if(!hex || name == std::string::npos) {
+            throw std::runtime_error(std::format("{}:{}: expected \"<md5> <path>\", got \"{}\"", path.string(),
+                                                 number, line));
+        }
+
+        std::transform(sum.begin(), sum.end(), sum.begin(), [](unsigned char c) { return std::tolower(c); });
+        // Same names as the diff, relative and with forward slashes
+        std::string file = std::filesystem::path(line.substr(name)).lexically_normal().generic_string();
+        if(file.starts_with("/"))
+            file.erase(0, 1);
+        sums[file] = sum;
+    }
+}
+
+bool Manifest::matches(const std::string& name, const std::filesystem::path& file, u64 size) const {
+    auto it = sums.find(std::filesystem::path(name).lexically_normal().generic_string());
+    if(it == sums.end())
+        return false;
+
+    // The size rules out most files without reading them
+    struct stat st;
+    if(stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || static_cast<u64>(st.st_size) != size)
+        return false;
+    return md5(file) == it->second;
+}
+
+std::string Manifest::md5(const std::filesystem::path& file) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        throw std::runtime_error(std::format("Failed to open {} ({})", file.string(), strerror(errno)));
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    Md5 hash;
+    std::vector<u8> buffer(1 << 20);
+    while(true) {
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(std::format("Failed to read {} ({})", file.string(), strerror(err)));
+        }
+        if(n == 0)
+            break;
+        hash.update(buffer.data(), n);
+    }
+    close(fd);
+    return hash.hex();
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+/*
+ * md5 sums of the new files, in the format md5sum writes: the hex digest, spaces and the
+ * path relative to new_path. The diff itself only has checksums of whole directories, this
+ * is what tells whether a file is already in its final form
+ */
+class Manifest {
+private:
+    std::unordered_map<std::string, std::string> sums;
+
+public:
+    // Throws if the file can't be read or has a line that isn't "<md5> <path>"
+    explicit Manifest(const std::filesystem::path& path);
+
+    // True if `file` is `size` bytes long and has the md5 listed for `name`. Files missing
+    // from the manifest never match
+    bool matches(const std::string& name, const std::filesystem::path& file, u64 size) const;
+    size_t size() const { return sums.size(); }
+
+    // Lowercase hex md5 of a whole file
+    static std::string md5(const std::filesystem::path& file);
+};
@@ -0,0 +1,172 @@
+#include "multi.hpp"
+#include "dwhbll-logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+SharedNewData::SharedNewData(const std::filesystem::path& diff_file, u64 offset, u64 size_, u64 window_,
+                             size_t readers)
+    : stream(diff_file, offset), size(size_), window(std::max(window_, 2 * CHUNK)), positions(readers, 0) {}
+
+SharedNewData::Reader::~Reader() {
+    shared.detach(index);
+}
+
+u64 SharedNewData::Reader::read(u8* buf, size_t size) {
+    shared.advance(index, buf, size);
+    current_index += size;
+    return size;
+}
+
+void SharedNewData::Reader::skip(u64 size) {
+    shared.advance(index, nullptr, size);
+    current_index += size;
+}
+
+void SharedNewData::trim() {
+    u64 slowest = *std::min_element(positions.begin(), positions.end());
+    bool dropped = false;
+    while(!chunks.empty() && start + chunks.front().size() <= slowest) {
+        start += chunks.front().size();
+        chunks.pop_front();
+        dropped = true;
+    }
+    if(dropped)
+        wake.notify_all();
+}
+
+void SharedNewData::detach(size_t index) {
+    std::lock_guard lock(mutex);
+    positions[index] = DETACHED;
+    trim();
+}
+
+void SharedNewData::advance(size_t index, u8* buf, u64 length) {
+    std::unique_lock lock(mutex);
+    while(length > 0) {
+        u64 pos = positions[index];
+        if(pos < end) {
+            // Chunks only go once every reader is past them, this one can be read without the lock
+            size_t chunk = (pos - start) / CHUNK;
+            const std::vector<u8>& data = chunks[chunk];
+            u64 at = pos - start - chunk * CHUNK;
+            u64 n = std::min<u64>(length, data.size() - at);
+            lock.unlock();
+            if(buf) {
+                std::memcpy(buf, data.data() + at, n);
+                buf += n;
+            }
+            lock.lock();
+            positions[index] += n;
+            length -= n;
+            trim();
+            continue;
+        }
+
+        if(failure)
+            std::rethrow_exception(failure);
+        if(end == size)
+            throw std::runtime_error("Read past the end of the new data");
+
+        if(decompressing || end - start >= window) {
+            wake.wait(lock);
+            continue;
+        }
+        decompressing = true;
+        std::vector<u8> data(std::min(CHUNK, size - end));
+        lock.unlock();
+        try {
+            stream.read(data.data(), data.size());
+        } catch(...) {
+            lock.lock();
+            failure = std::current_exception();
+            decompressing = false;
+            wake.notify_all();
+            throw;
+        }
+        lock.lock();
+        end += data.size();
+        decompressed += data.size();
+        chunks.push_back(std::move(data));
+        decompressing = false;
+        wake.notify_all();
+    }
+}
+
+int MultiPatch::run(u64 window) {
+    errors.assign(targets.size(), "");
+
+    DirDiff diff;
+    Plan plan;
+    std::string diff_id;
+    try {
+        diff = DirDiff::load(diff_file);
+        plan = Plan::build(diff);
+        diff_id = Journal::identify(diff_file);
+    } catch(const std::exception& e) {
+        throw std::runtime_error(std::format("Failed to parse {}: {}", diff_file.string(), e.what()));
+    }
+
+    u64 size = 0;
+    for(const PlanOp& op : plan.ops) {
+        if(op.kind == PlanOp::NEW_DATA)
+            size += op.length;
+    }
+    SharedNewData shared(diff_file, diff.mainDiff.newDataOffset, size, window, targets.size());
+
+    // Every reader is made before any patch starts, so none of them misses the first chunks
+    std::vector<std::unique_ptr<SharedNewData::Reader>> readers;
+    for(size_t i = 0; i < targets.size(); i++)
+        readers.push_back(shared.reader(i));
+
+    // Not a vector<bool>, the threads write their own element
+    std::vector<u8> interrupted(targets.size(), false);
+    auto patch = [&](size_t i) {
+        const Target& target = targets[i];
+        try {
+            Patcher::check_paths(diff_file, target.old_path, target.new_path, options);
+            Patcher patcher(diff, plan, diff_id, std::move(readers[i]), target.old_path, target.new_path, options);
+            patcher.patch(inplace);
+        } catch(const PatchError& e) {
+            interrupted[i] = e.interrupted();
+            errors[i] = e.describe();
+        } catch(const std::exception& e) {
+            errors[i] = e.what();
+        }
+        // Whatever happened, the others don't wait for it anymore
+        readers[i].reset();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for(size_t i = 1; i < targets.size(); i++)
+        pool.emplace_back(patch, i);
+    patch(0);
+    for(std::thread& thread : pool)
+        thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0, stopped = 0;
+    for(size_t i = 0; i < targets.size(); i++) {
+        const Target& target = targets[i];
+        std::string path = (inplace ? target.old_path : target.new_path).string();
+        if(interrupted[i]) {
+            stopped++;
+            dwhbll::console::info("{}: interrupted", path);
+        }
+        else if(!errors[i].empty()) {
+            failed++;
+            dwhbll::console::error("{}: {}", path, errors[i]);
+        }
+    }
+    dwhbll::console::info("{} of {} trees patched in {:.1f}s, {} failed, {} interrupted. {} of new data "
+                          "decompressed once for all of them", targets.size() - failed - stopped, targets.size(),
+                          seconds, failed, stopped, format_size(shared.decompressed));
+    if(stopped > 0) {
+        // The trees that were patched would be patched again
+        dwhbll::console::info("Interrupted, run it again with the interrupted trees only to resume them");
+        return 130;
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "patching.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+
+/*
+ * The new data of a diff decompressed once for several patches reading it at their own pace.
+ * Whichever reader is furthest ahead decompresses the next chunk, the chunks stay until the
+ * reader furthest behind is past them, and a reader that gets `window` bytes ahead of it
+ * waits. Readers have to exist from the start, the data before the slowest one is gone
+ */
+class SharedNewData {
+public:
+    class Reader : public NewData {
+    private:
+        SharedNewData& shared;
+        size_t index;
+
+    public:
+        Reader(SharedNewData& shared_, size_t index_) : shared(shared_), index(index_) {}
+        // A patch that stops early doesn't hold the others back
+        ~Reader() override;
+
+        u64 read(u8* buf, size_t size) override;
+        void skip(u64 size) override;
+    };
+
+    // Decompressed so far, for the summary
+    u64 decompressed = 0;
+
+    SharedNewData(const std::filesystem::path& diff_file, u64 offset, u64 size_, u64 window_, size_t readers);
+
+    // One reader per patch, each index once
+    std::unique_ptr<Reader> reader(size_t index) { return std::make_unique<Reader>(*this, index); }
+
+private:
+    static constexpr u64 CHUNK = 1 << 20;
+    static constexpr u64 DETACHED = UINT64_MAX;
+
+    NewDataStream stream;
+    // Length of the whole stream
+    u64 size;
+    u64 window;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    // CHUNK bytes each but the last one, the first one starts at `start`
+    std::deque<std::vector<u8>> chunks;
+    u64 start = 0;
+    u64 end = 0;
+    std::vector<u64> positions;
+    bool decompressing = false;
+    std::exception_ptr failure;
+
+    // Moves reader `index` `length` bytes forward, copying them to `buf` unless it's null
+    void advance(size_t index, u8* buf, u64 length);
+    // Drops the chunks every reader is past, with the lock held
+    void trim();
+    void detach(size_t index);
+};
+
+/*
+ * dpatchz multi: one diff applied to several trees at once, e.g. identical installs on one host.
+ * The diff is parsed and planned once and its new data decompressed once, every tree gets its
+ * own patch in its own thread with its new data read from a SharedNewData. A tree that fails
+ * doesn't stop the others
+ */
+class MultiPatch {
+public:
+    struct Target {
+        std::filesystem::path old_path;
+        // Empty with -i
+        std::filesystem::path new_path;
+    };
+
+    std::vector<Target> targets;
+    // Why each target failed, empty for the ones that were patched
+    std::vector<std::string> errors;
+
+    MultiPatch(std::filesystem::path diff_file_, std::vector<Target> targets_, const PatchOptions& options_,
+               bool inplace_)
+        : targets(std::move(targets_)), diff_file(std::move(diff_file_)), options(options_), inplace(inplace_) {}
+
+    // Patches every target, with at most `window` bytes of new data in memory. Returns 0 if
+    // they all succeeded, 130 if they were interrupted, 1 otherwise
+    int run(u64 window);
+
+private:
+    std::filesystem::path diff_file;
+    PatchOptions options;
+    bool inplace;
+};
@@ -103,7 +103,8 @@ std::string DiffZ::to_string() {
 
 HeadData HeadData::parse(Parser &parser, u64 size, u64 compressed_size,
                           u64 old_path_count, u64 new_path_count,
-                          u64 old_ref_file_count, u64 new_ref_file_count) {
+                          u64 old_ref_file_count, u64 new_ref_file_count,
+                          u64 same_file_pair_count) {
     HeadData head;
 
     std::vector<u8> data = parser.read_maybe_compressed(size, compressed_size);
@@ -111,8 +112,8 @@ HeadData HeadData::parse(Parser &parser, u64 size, u64 compressed_size,
     std::vector<std::string> oldFiles;
     std::vector<std::string> newFiles;
 
-    std::vector<u8> oldFileOffsets;
-    std::vector<u8> newFileOffsets;
+    std::vector<u64> oldFileOffsets;
+    std::vector<u64> newFileOffsets;
 
     std::vector<VarInt> oldFileSizes;
     std::vector<VarInt> newFileSizes;
@@ -128,15 +129,20 @@ HeadData HeadData::parse(Parser &parser, u64 size, u64 compressed_size,
     for(size_t i = 0; i < new_path_count; i++)
         newFiles.push_back(sub_parser.read_string());
 
+    // Unchanged files and directories between two references can make these large, they
+    // only have to stay within the path list
     for(size_t i = 0; i < old_ref_file_count; i++) {
         VarInt v = sub_parser.read_varint();
-        // Still haven't found an offset larger than a byte, but still keep a sanity check
-        assert(v.value < 128);
+        if(v.value >= old_path_count)
+            throw std::runtime_error(std::format("Old file {} has offset {} past the {} old paths", i, v.value,
+                                                 old_path_count));
         oldFileOffsets.push_back(v.value);
     }
     for(size_t i = 0; i < new_ref_file_count; i++) {
         VarInt v = sub_parser.read_varint();
-        assert(v.value < 128);
+        if(v.value >= new_path_count)
+            throw std::runtime_error(std::format("New file {} has offset {} past the {} new paths", i, v.value,
+                                                 new_path_count));
         newFileOffsets.push_back(v.value);
     }
 
@@ -145,37 +151,64 @@ HeadData HeadData::parse(Parser &parser, u64 size, u64 compressed_size,
     for(size_t i = 0; i < new_ref_file_count; i++)
         newFileSizes.push_back(sub_parser.read_varint());
 
+    // Pairs of (new path index, old path index), the new one grows, the old one can go both ways
+    std::vector<std::pair<size_t, size_t>> samePairs;
+    for(size_t i = 0, new_index = -1, old_index = -1; i < same_file_pair_count; i++) {
+        new_index += 1 + sub_parser.read_varint().value;
+        VarInt inc = sub_parser.read_varint(1);
+        old_index += 1 + inc.value_signed;
+        if(new_index >= new_path_count || old_index >= old_path_count)
+            throw std::runtime_error(std::format("Same file pair {} points outside of the path lists", i));
+        samePairs.emplace_back(new_index, old_index);
+    }
+
     for(size_t i = 0; i < new_ref_file_count; i++)
         unknown.push_back(sub_parser.read_varint());
 
-    for(size_t i = 0, j = 0; i < old_path_count; i++) {
-        if(oldFiles[i].ends_with('/') || oldFiles[i].empty()) {
-            head.oldDirs.push_back(Directory(oldFiles[i]));
-        }
-        else {
-            head.oldFiles.push_back(DiffFile(oldFiles[i], oldFileOffsets[j], 
-                                         oldFileSizes[j].value));
-            j++;
-        }
+    // The offsets are how many paths there are since the last reference, usually the
+    // directories in between
+    std::vector<bool> oldUsed(old_path_count, false);
+    std::vector<bool> newUsed(new_path_count, false);
+    for(size_t i = 0, index = -1; i < old_ref_file_count; i++) {
+        index += 1 + oldFileOffsets[i];
+        if(index >= old_path_count)
+            throw std::runtime_error(std::format("Old file {} points outside of the path list", i));
+        head.oldFiles.push_back(DiffFile(oldFiles[index], oldFileOffsets[i], oldFileSizes[i].value));
+        oldUsed[index] = true;
+    }
+    for(size_t i = 0, index = -1; i < new_ref_file_count; i++) {
+        index += 1 + newFileOffsets[i];
+        if(index >= new_path_count)
+            throw std::runtime_error(std::format("New file {} points outside of the path list", i));
+        head.newFiles.push_back(DiffFile(newFiles[index], newFileOffsets[i], newFileSizes[i].value));
+        newUsed[index] = true;
+    }
+    for(auto [new_index, old_index] : samePairs) {
+        head.sameFiles.push_back(SameFilePair(oldFiles[old_index], newFiles[new_index]));
+        newUsed[new_index] = true;
     }
 
-    for(size_t i = 0, j = 0; i < new_path_count; i++) {
-        if(newFiles[i].ends_with('/') || newFiles[i].empty()) {
+    for(size_t i = 0; i < old_path_count; i++) {
+        if(oldUsed[i])
+            continue;
+        if(oldFiles[i].ends_with('/') || oldFiles[i].empty())
+            head.oldDirs.push_back(Directory(oldFiles[i]));
+        else
+            head.otherOldFiles.push_back(oldFiles[i]);
+    }
+    for(size_t i = 0; i < new_path_count; i++) {
+        if(newUsed[i])
+            continue;
+        if(newFiles[i].ends_with('/') || newFiles[i].empty())
             head.newDirs.push_back(Directory(newFiles[i]));
-        }
-        else {
-            head.newFiles.push_back(DiffFile(newFiles[i], newFileOffsets[j], 
-                                         newFileSizes[j].value));
-            j++;
-        }
+        else
+            head.emptyFiles.push_back(newFiles[i]);
     }
 
     sub_parser.check_read(size);
 
     assert(head.oldFiles.size() == old_ref_file_count);
     assert(head.newFiles.size() == new_ref_file_count);
-    assert(head.oldDirs.size() == old_path_count - old_ref_file_count);
-    assert(head.newDirs.size() == new_path_count - new_ref_file_count);
 
     return head;
 }
@@ -194,7 +227,7 @@ std::string HeadData::to_string() {
         for (const auto& file : files) {
             oss << "    {\n"
                 << "      name: \"" << file.name << "\",\n"
-                << "      fileOffset: " << static_cast<int>(file.fileOffset) << ",\n"
+                << "      fileOffset: " << file.fileOffset << ",\n"
                 << "      fileSize: " << file.fileSize << ",\n"
                 << "    },\n";
         }
@@ -214,6 +247,15 @@ std::string HeadData::to_string() {
         oss << "  ]\n";
     }
 
+    oss << "  sameFiles: [\n";
+    for(const auto& pair : sameFiles)
+        oss << "      \"" << pair.oldName << "\" -> \"" << pair.newName << "\"\n";
+    oss << "  ]\n";
+    oss << "  emptyFiles: [\n";
+    for(const auto& name : emptyFiles)
+        oss << "      name: \"" << name << "\"\n";
+    oss << "  ]\n";
+
     oss << "}";
     return oss.str();
 }
@@ -239,12 +281,11 @@ DirDiff DirDiff::parse(Parser& parser) {
     diff.newRefFileCount = parser.read_varint();
     diff.newRefSize = parser.read_varint();
 
+    diff.sameFilePairCount = parser.read_varint();
+    diff.sameFileSize = parser.read_varint();
+
     // We discard all this since it seems to always be 0 in kuro diffs
     // We still check it's still really zero, just in case kuro changes the diffs
-    // sameFilePairCount
-    parser.match_varint(0);
-    // sameFileSize
-    parser.match_varint(0);
     // newExecuteCount
     parser.match_varint(0);
     // privateReservedDataSize
@@ -261,12 +302,37 @@ DirDiff DirDiff::parse(Parser& parser) {
     diff.checksum = parser.read_bytes<u8>(diff.checksumByteSize.value * 4);
     diff.headData = HeadData::parse(parser, diff.headDataSize.value, diff.headDataCompressedSize.value, 
                                     diff.oldPathCount.value, diff.newPathCount.value,
-                                    diff.oldRefFileCount.value, diff.newRefFileCount.value);
+                                    diff.oldRefFileCount.value, diff.newRefFileCount.value,
+                                    diff.sameFilePairCount.value);
     diff.mainDiff = DiffZ::parse(parser);
 
     return diff;
 }
 
+DirDiff DirDiff::load(const std::filesystem::path& path) {
+    Parser parser(path);
+    DirDiff diff = DirDiff::parse(parser);
+
+    dwhbll::console::debug("Parsed diff file:\n{}\n{}\n{}\n{}\n", diff.to_string(),
+                           diff.headData.to_string(), diff.mainDiff.to_string(),
+                           diff.mainDiff.coverBuf.to_string());
+
+    // Kuro diffs don't seem to be using RLE so we just ignore it
+    // TODO: implement RLE anyway
+    if(diff.mainDiff.compressedRleCodeBufSize.value > 0)
+        parser.read_bytes<u8>(diff.mainDiff.compressedRleCodeBufSize.value);
+    else
+        parser.read_bytes<u8>(diff.mainDiff.rleCodeBufSize.value);
+
+    if(diff.mainDiff.compressedRleCtrlBufSize.value > 0)
+        parser.read_bytes<u8>(diff.mainDiff.compressedRleCtrlBufSize.value);
+    else
+        parser.read_bytes<u8>(diff.mainDiff.rleCtrlBufSize.value);
+
+    diff.mainDiff.newDataOffset = parser.position();
+    return diff;
+}
+
 std::string DirDiff::to_string() {
     std::string s = std::format(
         "DirDiff {{\n"
@@ -282,6 +348,8 @@ std::string DirDiff::to_string() {
         "  oldRefSize: {}\n"
         "  newRefFileCount: {}\n"
         "  newRefSize: {}\n"
+        "  sameFilePairCount: {}\n"
+        "  sameFileSize: {}\n"
         "  headDataSize: {}\n"
         "  headDataCompressedSize: {}\n"
         "  checksumByteSize: {}\n"
@@ -299,6 +367,8 @@ std::string DirDiff::to_string() {
         oldRefSize.value,
         newRefFileCount.value,
         newRefSize.value,
+        sameFilePairCount.value,
+        sameFileSize.value,
         headDataSize.value,
         headDataCompressedSize.value,
         checksumByteSize.value,
@@ -309,8 +379,7 @@ std::string DirDiff::to_string() {
 }   
 
 void Parser::error(const std::string &err) const {
-    dwhbll::console::fatal("Parse error at {}: {}", format_context(), err);
-    std::exit(1);
+    throw std::runtime_error(std::format("Parse error at {}: {}", format_context(), err));
 }
 
 std::string Parser::format_context() const {
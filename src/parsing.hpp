@@ -2,6 +2,7 @@
 
 #include "dwhbll-streams.hpp"
 #include "utils.hpp"
+#include <filesystem>
 #include <string>
 #include <vector>
 #include <format>
@@ -55,7 +56,7 @@ struct DiffZ {
 struct DiffFile {
     std::string name;
 
-    u8 fileOffset;
+    u64 fileOffset;
     u64 fileSize;
 };
 
@@ -63,15 +64,27 @@ struct Directory {
     std::string name;
 };
 
+// A new file that is byte for byte an old one, it has no data in the diff
+struct SameFilePair {
+    std::string oldName;
+    std::string newName;
+};
+
 struct HeadData {
     std::vector<DiffFile> oldFiles;
     std::vector<DiffFile> newFiles;
     std::vector<Directory> oldDirs;
     std::vector<Directory> newDirs;
+    std::vector<SameFilePair> sameFiles;
+    // New files with nothing in them, not counted as references
+    std::vector<std::string> emptyFiles;
+    // Old files that aren't references: sources of same file pairs, empty and removed files
+    std::vector<std::string> otherOldFiles;
 
     static HeadData parse(Parser& parser, u64 size, u64 compressed_size, 
                           u64 old_path_count, u64 new_path_count,
-                          u64 old_ref_file_count, u64 new_ref_file_count);
+                          u64 old_ref_file_count, u64 new_ref_file_count,
+                          u64 same_file_pair_count);
     std::string to_string();
 };
 
@@ -85,9 +98,11 @@ struct DirDiff {
     VarInt oldRefFileCount, newRefFileCount;
     VarInt oldRefSize, newRefSize;
 
+    // 0 in kuro diffs, standard hdiffz lists unchanged and moved files there
+    VarInt sameFilePairCount;
+    VarInt sameFileSize;
+
     // Supposedly always equal to 0
-    // VarInt sameFilePairCount;
-    // VarInt sameFileSize;
     // VarInt newExecuteCount;
     // VarInt privateReservedDataSize;
     // VarInt privateExternDataSize;
@@ -103,6 +118,9 @@ struct DirDiff {
     DiffZ mainDiff;
 
     static DirDiff parse(Parser& parser);
+    // Parses the diff file at `path` and finds where its new data starts. Throws if it isn't
+    // a diff dpatchz can apply
+    static DirDiff load(const std::filesystem::path& path);
     std::string to_string();
 };
 
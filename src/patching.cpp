@@ -1,8 +1,177 @@
 #include "patching.hpp"
+#include "engines.hpp"
+#include "hotcache.hpp"
+#include "inplace.hpp"
+#include "journal.hpp"
+#include "linkfarm.hpp"
+#include "manifest.hpp"
+#include "prefetch.hpp"
+#include "schedule.hpp"
+#include "undo.hpp"
 #include "dwhbll-logging.hpp"
-#include <utility>
 
-u64 Patcher::read(u8* buf, size_t size) {
+#include <algorithm>
+#include <csignal>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+OldFdTable::~OldFdTable() {
+    for(const auto& [path, entry] : entries)
+        close(entry.fd);
+}
+
+int OldFdTable::acquire(const std::filesystem::path& path) {
+    std::lock_guard lock(mutex);
+    auto it = entries.find(path.string());
+    if(it == entries.end()) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            throw std::runtime_error(std::format("Failed to open file: {} ({})", path.string(), strerror(errno)));
+        it = entries.emplace(path.string(), Entry{ fd }).first;
+        opened++;
+    }
+    else {
+        idle -= it->second.users == 0;
+        reused++;
+    }
+    it->second.users++;
+    return it->second.fd;
+}
+
+void OldFdTable::release(const std::filesystem::path& path) {
+    std::lock_guard lock(mutex);
+    auto it = entries.find(path.string());
+    if(it == entries.end() || it->second.users == 0)
+        return;
+    if(--it->second.users > 0)
+        return;
+    it->second.last_use = ++uses;
+    idle++;
+
+    while(idle > MAX_IDLE) {
+        auto oldest = entries.end();
+        for(auto e = entries.begin(); e != entries.end(); ++e) {
+            if(e->second.users == 0 && (oldest == entries.end() || e->second.last_use < oldest->second.last_use))
+                oldest = e;
+        }
+        close(oldest->second.fd);
+        entries.erase(oldest);
+        idle--;
+    }
+}
+
+void OldFdTable::forget(const std::filesystem::path& dir) {
+    std::lock_guard lock(mutex);
+    std::string prefix = (dir / "").string();
+    for(auto it = entries.begin(); it != entries.end();) {
+        if(it->second.users == 0 && it->first.starts_with(prefix)) {
+            close(it->second.fd);
+            it = entries.erase(it);
+            idle--;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+OldFiles::OldFiles(std::filesystem::path root_, const std::vector<DiffFile>& files_, OldFdTable* shared_)
+    : fds(files_.size(), -1), shared(shared_), shared_count(shared_ ? files_.size() : 0) {
+    // The same tree has to give the same paths whatever way it was named
+    if(shared)
+        root_ = std::filesystem::weakly_canonical(root_);
+    for(const auto& file : files_) {
+        paths.push_back(root_ / file.name);
+        sizes.push_back(file.fileSize);
+    }
+}
+
+OldFiles::~OldFiles() {
+    for(size_t i = 0; i < fds.size(); i++) {
+        if(fds[i] >= 0 && i < shared_count)
+            shared->release(paths[i]);
+        else if(fds[i] >= 0)
+            close(fds[i]);
+    }
+}
+
+int OldFiles::fd(size_t index) {
+    // The path may be a new file by now
+    if(fds[index] == RELEASED)
+        throw std::runtime_error(std::format("{} read after it was released", path(index).string()));
+    if(fds[index] < 0 && index < shared_count) {
+        fds[index] = shared->acquire(path(index));
+    }
+    else if(fds[index] < 0) {
+        fds[index] = open(path(index).c_str(), O_RDONLY | O_CLOEXEC);
+        if(fds[index] < 0) {
+            throw std::runtime_error(std::format("Failed to open file: {} ({})",
+                                                 path(index).string(), strerror(errno)));
+        }
+    }
+    return fds[index];
+}
+
+void OldFiles::release(size_t index) {
+    if(fds[index] >= 0 && index < shared_count)
+        shared->release(path(index));
+    else if(fds[index] >= 0)
+        close(fds[index]);
+    fds[index] = RELEASED;
+}
+
+size_t OldFiles::add(std::filesystem::path path, int fd, u64 size) {
+    paths.push_back(std::move(path));
+    sizes.push_back(size);
+    fds.push_back(fd);
+    return paths.size() - 1;
+}
+
+// Contexts of the streams that are done, ZSTD_initDStream() resets them for the next one
+static std::mutex dstreams_mutex;
+static std::vector<ZSTD_DStream*> dstreams;
+
+NewDataStream::NewDataStream(const std::filesystem::path& diff_file, u64 offset)
+    : mem(diff_file, std::ios::binary), inBuf(CHUNK_SIZE) {
+    if (!mem)
+        throw std::runtime_error(std::format("Failed to open diff file {}", diff_file.string()));
+
+    mem.seekg(offset, std::ios::beg);
+
+    {
+        std::lock_guard lock(dstreams_mutex);
+        if(!dstreams.empty()) {
+            dstream = dstreams.back();
+            dstreams.pop_back();
+        }
+    }
+    if (!dstream)
+        dstream = ZSTD_createDStream();
+    if (!dstream)
+        throw std::runtime_error("Failed to create ZSTD_DStream");
+
+    size_t const initResult = ZSTD_initDStream(dstream);
+    if (ZSTD_isError(initResult))
+        throw std::runtime_error("ZSTD_initDStream error");
+}
+
+NewDataStream::~NewDataStream() {
+    if (!dstream)
+        return;
+    std::lock_guard lock(dstreams_mutex);
+    dstreams.push_back(dstream);
+}
+
+u64 NewDataStream::read(u8* buf, size_t size) {
     if (!buf || size == 0)
         return 0;
 
@@ -34,12 +203,32 @@ u64 Patcher::read(u8* buf, size_t size) {
     return size;
 }
 
+void NewData::skip(u64 size) {
+    std::vector<u8> scratch(std::min<u64>(size, 1 << 20));
+    while(size > 0) {
+        u64 n = std::min<u64>(size, scratch.size());
+        read(scratch.data(), n);
+        size -= n;
+    }
+}
+
 void Patcher::error(const std::string &err) const {
-    if(cur_out_file)
-        dwhbll::console::fatal("Error while patching {}: {}", cur_out_file->name, err);
-    else
-        dwhbll::console::fatal("Error while patching: {}", cur_out_file->name, err);
-    std::exit(1);
+    throw PatchError(err, cur_out_file ? cur_out_file->name : "");
+}
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void on_signal(int) {
+    interrupted = 1;
+}
+
+void Patcher::catch_signals() {
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+}
+
+bool Patcher::signalled() {
+    return interrupted;
 }
 
 std::filesystem::path get_tmp_dir(std::filesystem::path path) {
@@ -55,163 +244,742 @@ std::filesystem::path get_tmp_dir(std::filesystem::path path) {
     return path / (std::to_string(cur) + ".tmp");
 }
 
+void Patcher::check_paths(const std::filesystem::path& diff_file, const std::filesystem::path& source,
+                          const std::filesystem::path& dest, const PatchOptions& options) {
+    if(!std::filesystem::exists(diff_file) || std::filesystem::is_directory(diff_file))
+        throw std::runtime_error(std::format("{} doesn't exist or is not a file", diff_file.string()));
+    if(!std::filesystem::exists(source) || !std::filesystem::is_directory(source))
+        throw std::runtime_error(std::format("{} doesn't exist or is not a directory", source.string()));
+    if(!options.skip_existing.empty() && !std::filesystem::is_regular_file(options.skip_existing)) {
+        throw std::runtime_error(std::format("{} doesn't exist or is not a file",
+                                             options.skip_existing.string()));
+    }
+    if(std::filesystem::exists(dest)) {
+        if(!std::filesystem::is_directory(dest))
+            throw std::runtime_error(std::format("{} exists and is not a directory", dest.string()));
+        // Unless it's what an interrupted patch left, to be resumed or checked
+        if(!std::filesystem::is_empty(dest) && !std::filesystem::exists(dest / Journal::NAME) &&
+           options.skip_existing.empty())
+            throw std::runtime_error(std::format("{} exists and is not empty", dest.string()));
+    }
+}
+
+template <IoEngine Engine>
+void Patcher::run(OldFiles& old, const std::filesystem::path& destination_dir, bool inplace) {
+    Engine engine(old, options);
+
+    std::vector<Prefetcher::Range> reads;
+    for(const PlanOp& op : plan.ops) {
+        if(op.kind == PlanOp::COVER)
+            reads.push_back({ op.old_file, op.old_offset, op.length });
+    }
+    Prefetcher prefetcher(old, std::move(reads), options);
+    size_t cover = 0;
+
+    // Everything is in memory already with mmap
+    HotCache cache(old, plan, std::is_same_v<Engine, MmapEngine> ? 0 : options.hot_cache);
+
+    // Whatever an interrupted run already wrote
+    Journal::Position start = journal ? journal->resume : Journal::Position{};
+    u64 skipped = 0;
+    for(size_t i = 0; i <= start.file && i < diff.headData.newFiles.size(); i++) {
+        auto ops = plan.file(i);
+        for(const PlanOp& op : ops.first(i < start.file ? ops.size() : start.op)) {
+            if(op.kind == PlanOp::COVER) {
+                cache.skip(op.old_file, op.old_offset, op.length);
+                cover++;
+            }
+            else if(op.kind == PlanOp::NEW_DATA) {
+                skipped += op.length;
+            }
+        }
+    }
+    try {
+        newData->skip(skipped);
+        if(start.op > 0 && newData->current_index != start.new_data) {
+            throw std::runtime_error(std::format("The journal says {} bytes of new data were used, the plan says {}",
+                                                 start.new_data, newData->current_index));
+        }
+        for(size_t i = 0; publish && i < start.file; i++)
+            publish->done(old, i, true);
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+    prefetcher.skip_to(cover);
+
+    auto write_file = [&](auto& engine, size_t i, const std::filesystem::path& path, size_t first) {
+        if(journal)
+            journal->output(path);
+        engine.open(path, cur_out_file->fileSize);
+
+        auto ops = plan.file(i);
+        for(size_t k = first; k < ops.size(); k++) {
+            const PlanOp& op = ops[k];
+            if(journal && (interrupted || journal->due())) {
+                engine.flush();
+                Journal::Position at = { i, k, newData->current_index };
+                commit(old, &at);
+                if(interrupted)
+                    throw PatchError("Interrupted, run the same command again to resume", "", 130);
+            }
+
+            if(op.kind == PlanOp::KEEP)
+                continue;
+            if(op.kind == PlanOp::COVER) {
+                prefetcher.before(cover);
+                cache.serve(op.old_file, op.old_offset, op.length,
+                            [&](const u8* data, u64 old_offset, u64 length) {
+                    u64 out_offset = op.out_offset + (old_offset - op.old_offset);
+                    if(data) {
+                        MemorySource source(data, length);
+                        engine.new_data(source, out_offset, length);
+                    }
+                    else {
+                        engine.cover(op.old_file, old_offset, out_offset, length);
+                    }
+                });
+                prefetcher.after(cover++);
+            }
+            else
+                engine.new_data(*newData, op.out_offset, op.length);
+            if(journal)
+                journal->wrote(op.length);
+        }
 
-void Patcher::merge_dirs(const std::filesystem::path& a, const std::filesystem::path& b) {
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(b)) {
-        if (std::filesystem::is_directory(entry.path())) continue;
+        engine.close();
+    };
 
-        std::filesystem::path relative_path = std::filesystem::relative(entry.path(), b);
-        std::filesystem::path target_path = a / relative_path;
+    for(size_t i = start.file; i < diff.headData.newFiles.size(); i++) {
+        cur_out_file = &diff.headData.newFiles[i];
+        std::filesystem::path destionation_file = destination_dir / cur_out_file->name;
+        if(inplace) {
+            dwhbll::console::info("[{}/{}] Patching {} inplace", i + 1, diff.headData.newFiles.size(),
+                                  (destionation_file).string());
+        }
+        else {
+            dwhbll::console::info("[{}/{}] Patching {}", i + 1, diff.headData.newFiles.size(),
+                                  (destionation_file).string());
+        }
+
+        if(up_to_date[i]) {
+            // Its covers are KEEP, only its new data has to go by
+            u64 length = 0;
+            for(const PlanOp& op : plan.file(i).subspan(i == start.file ? start.op : 0)) {
+                if(op.kind == PlanOp::NEW_DATA)
+                    length += op.length;
+            }
+            try {
+                newData->skip(length);
+                if(journal)
+                    journal->file_done(i);
+                else if(publish)
+                    publish->done(old, i, true);
+            } catch(const std::exception& e) {
+                error(e.what());
+            }
+            dwhbll::console::info("[{}/{}] {} is already up to date", i + 1, diff.headData.newFiles.size(),
+                                  (destionation_file).string());
+            if(progress)
+                progress(i + 1, diff.headData.newFiles.size());
+            continue;
+        }
 
         try {
-            std::filesystem::create_directories(target_path.parent_path());
-            std::filesystem::rename(entry.path(), target_path);
-        } catch (const std::exception& e) {
-            error(std::format("Error copying {} to {}: {}", entry.path().string(), target_path.string(), e.what()));
+            if(i == start.file && start.op > 0) {
+                // The rest of the file the interrupted run was in, the part already written
+                // has to stay
+                PatchOptions resume_options = options;
+                resume_options.overwrite = true;
+                BufferedEngine resume_engine(old, resume_options);
+                write_file(resume_engine, i, destionation_file, start.op);
+            }
+            else {
+                write_file(engine, i, destionation_file, 0);
+            }
+
+            if(journal)
+                journal->file_done(i);
+            else if(publish)
+                publish->done(old, i);
+        } catch(const PatchError&) {
+            throw;
+        } catch(const std::exception& e) {
+            error(e.what());
+        }
+
+        dwhbll::console::info("[{}/{}] Patched {}", i + 1,
+                              diff.headData.newFiles.size(),
+                              (destionation_file).string());
+        if(progress)
+            progress(i + 1, diff.headData.newFiles.size());
+    }
+
+    cur_out_file = nullptr;
+    if(journal) {
+        try {
+            commit(old, nullptr);
+        } catch(const std::exception& e) {
+            error(e.what());
         }
     }
 
-    std::filesystem::remove_all(b);
+    dwhbll::console::debug("Prefetched {} of old data, evicted {}", format_size(prefetcher.prefetched),
+                           format_size(prefetcher.evicted));
+    if(!cache.empty()) {
+        double rate = 100.0 * cache.hit_bytes / std::max<u64>(1, cache.hit_bytes + cache.loaded_bytes);
+        dwhbll::console::info("Hot cache: {} ranges ({}) read once, {} repeat reads ({}) served from memory, "
+                              "{:.1f}% hit rate", cache.size(), format_size(cache.loaded_bytes), cache.hits,
+                              format_size(cache.hit_bytes), rate);
+    }
 }
 
-void Patcher::update_file(u64 offset) {
-    u64 cur_offset = 0;
-    for(auto &file : diff.headData.oldFiles) {
-        if(cur_offset + file.fileSize >= offset) {
-            if(file.name != cur_in_file.file->name) {
-                // Update the file pointer
-                fclose(cur_in_file.ptr);
-                cur_in_file.file = &file;
-                cur_in_file.ptr = fopen((source / file.name).c_str(), "r");
-                if(!cur_in_file.ptr) {
-                    error(std::format("Failed to open file: {} ({})", 
-                                      (source / file.name).string(), strerror(errno)));
-                }
+void Patcher::commit(OldFiles& old, const Journal::Position* at) {
+    for(size_t file : journal->commit(at)) {
+        // Up to date files were never in the temporary dir
+        if(publish)
+            publish->done(old, file, up_to_date[file]);
+    }
+}
+
+void Patcher::find_up_to_date(const std::filesystem::path& target_dir, bool inplace, size_t from) {
+    const auto& new_files = diff.headData.newFiles;
+    const auto& same_files = diff.headData.sameFiles;
+    up_to_date.assign(new_files.size(), false);
+    same_up_to_date.assign(same_files.size(), false);
+    if(options.skip_existing.empty())
+        return;
+
+    size_t count = 0;
+    u64 size = 0;
+    try {
+        Manifest manifest(options.skip_existing);
+        dwhbll::console::info("Checking the new files against {} ({} entries)", options.skip_existing.string(),
+                              manifest.size());
+        for(size_t i = from; i < new_files.size(); i++) {
+            if(manifest.matches(new_files[i].name, target_dir / new_files[i].name, new_files[i].fileSize)) {
+                up_to_date[i] = true;
+                plan.keep(i);
+                count++;
+                size += new_files[i].fileSize;
+            }
+        }
+        // The diff doesn't have their sizes, only the manifest tells them apart
+        for(size_t i = 0; i < same_files.size(); i++) {
+            std::filesystem::path file = target_dir / same_files[i].newName;
+            std::error_code ec;
+            u64 file_size = std::filesystem::file_size(file, ec);
+            if(!ec && manifest.matches(same_files[i].newName, file, file_size)) {
+                same_up_to_date[i] = true;
+                count++;
+                size += file_size;
             }
-            fseek(cur_in_file.ptr, offset - cur_offset, SEEK_SET);
-            return;
         }
-        cur_offset += file.fileSize;
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+    dwhbll::console::info("{} of {} new files ({}) are already up to date", count,
+                          new_files.size() + same_files.size(), format_size(size));
+
+    if(!inplace || count == 0)
+        return;
+    // With -i an up to date file is at the path of its old version, which is gone
+    std::unordered_set<std::string_view> replaced;
+    for(size_t i = 0; i < new_files.size(); i++) {
+        if(up_to_date[i])
+            replaced.insert(new_files[i].name);
+    }
+    for(size_t i = 0; i < same_files.size(); i++) {
+        if(same_up_to_date[i] && same_files[i].oldName != same_files[i].newName)
+            replaced.insert(same_files[i].newName);
+    }
+    std::vector<bool> old_gone;
+    for(const auto& file : diff.headData.oldFiles)
+        old_gone.push_back(replaced.contains(file.name));
+    for(size_t i = from; i < new_files.size(); i++) {
+        for(const PlanOp& op : plan.file(i)) {
+            if(op.kind == PlanOp::COVER && op.old_file < old_gone.size() && old_gone[op.old_file]) {
+                error(std::format("{} is already the new version but {} still reads the old one, the old tree "
+                                  "has to be restored first", diff.headData.oldFiles[op.old_file].name,
+                                  new_files[i].name));
+            }
+        }
+    }
+    for(size_t i = 0; i < same_files.size(); i++) {
+        if(!same_up_to_date[i] && same_files[i].oldName != same_files[i].newName &&
+           replaced.contains(same_files[i].oldName)) {
+            error(std::format("{} is already the new version but {} still reads the old one, the old tree "
+                              "has to be restored first", same_files[i].oldName, same_files[i].newName));
+        }
     }
-    std::unreachable();
 }
 
-void Patcher::patch(bool inplace) {
-    cur_in_file.file = &diff.headData.oldFiles[0];
-    cur_in_file.ptr = fopen((source / cur_in_file.file->name).c_str(), "r");
-    if(!cur_in_file.ptr) {
-        error(std::format("Failed to open file: {} ({})", 
-                          (source / cur_in_file.file->name).string(), 
-                          strerror(errno)));
+void Patcher::check_same_size() {
+    const auto& same_files = diff.headData.sameFiles;
+    // Some old files may be gone already: moved by the run that was interrupted, or by
+    // the one that made the up to date files
+    if(same_files.empty() || (journal && journal->resumed))
+        return;
+    if(std::find(same_up_to_date.begin(), same_up_to_date.end(), true) != same_up_to_date.end())
+        return;
+
+    u64 size = 0;
+    for(const auto& pair : same_files) {
+        std::error_code ec;
+        size += std::filesystem::file_size(source / pair.oldName, ec);
+        if(ec)
+            error(std::format("{} is the old file of a same file pair but it can't be read: {}", pair.oldName,
+                              ec.message()));
     }
-
-    std::filesystem::path destionation_dir = dest;
-    if(inplace) {
-        destionation_dir = get_tmp_dir(source);
-        dwhbll::console::info("Patching inplace to {} (temporary dir)", destionation_dir.string());
-        std::filesystem::create_directory(destionation_dir.string());
+    if(size != diff.sameFileSize.value) {
+        error(std::format("The old files of the {} same file pairs are {} bytes, the diff expects {}. {} isn't "
+                          "the version the diff is for", same_files.size(), size, diff.sameFileSize.value,
+                          source.string()));
     }
+}
 
-    for(const auto &dir : diff.headData.newDirs) {
-        std::filesystem::create_directories(destionation_dir / dir.name);
+void Patcher::link_unchanged() {
+    std::unordered_set<std::string> skip = { Journal::NAME };
+    for(const auto& file : diff.headData.oldFiles)
+        skip.insert(file.name);
+    for(const auto& file : diff.headData.newFiles)
+        skip.insert(file.name);
+    // Old files the diff has no data from, deleted or replaced as a whole
+    for(const auto& name : diff.headData.otherOldFiles)
+        skip.insert(name);
+    for(const auto& pair : diff.headData.sameFiles) {
+        skip.insert(pair.oldName);
+        skip.insert(pair.newName);
+    }
+    for(const auto& name : diff.headData.emptyFiles)
+        skip.insert(name);
+    // Dirs the new version doesn't have anymore, with everything in them
+    std::unordered_set<std::string_view> new_dirs;
+    for(const auto& dir : diff.headData.newDirs)
+        new_dirs.insert(dir.name);
+    for(const auto& dir : diff.headData.oldDirs) {
+        if(!new_dirs.contains(dir.name) && !dir.name.empty())
+            skip.insert(dir.name.substr(0, dir.name.size() - 1));
     }
 
-    auto& covers = diff.mainDiff.coverBuf.covers;
+    dwhbll::console::info("Linking the unchanged files of {} into {}", source.string(), dest.string());
+    try {
+        LinkFarm farm(source, dest, skip, options.link_unchanged);
+        farm.run(std::clamp(std::thread::hardware_concurrency(), 1u, 8u));
+        dwhbll::console::info("{} unchanged files ({}) in {} dirs: {} hardlinked, {} reflinked, {} copied",
+                              farm.files.load(), format_size(farm.bytes), farm.dirs.load(), farm.hardlinked.load(),
+                              farm.reflinked.load(), farm.copied.load());
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+}
 
-    u64 cover_idx = 0;
-    i64 old_pos = 0;
-    u64 read_from_new_data = covers[0].newPos;
+void Patcher::stage_same_files(const std::filesystem::path& staging, bool inplace) {
+    const HeadData& head = diff.headData;
+    if(head.sameFiles.empty() && head.emptyFiles.empty())
+        return;
+    // Moved in place already by the run that was interrupted
+    if(inplace && journal && journal->resumed && journal->resume.file == head.newFiles.size())
+        return;
+
+    // --no-tmp writes new files into the old inode, a hardlink to it would change with it
+    std::unordered_set<std::string_view> written_over;
+    if(inplace && options.no_tmp) {
+        for(const auto& file : head.newFiles)
+            written_over.insert(file.name);
+    }
 
-    for(size_t i = 0; i < diff.headData.newFiles.size(); i++) {
-        u64 written = 0;
+    u64 linked = 0, copied = 0, skipped = 0;
+    try {
+        for(size_t i = 0; i < head.sameFiles.size(); i++) {
+            const SameFilePair& pair = head.sameFiles[i];
+            std::filesystem::path to = staging / pair.newName;
+            // Up to date, already where it belongs, or staged by the run that was interrupted
+            // and the old file may be gone since
+            if(same_up_to_date[i] || (inplace && (pair.oldName == pair.newName || std::filesystem::exists(to)))) {
+                skipped++;
+                continue;
+            }
+            std::filesystem::create_directories(to.parent_path());
+            LinkResult result = link_file(AT_FDCWD, (source / pair.oldName).c_str(), AT_FDCWD, to.c_str(),
+                                          (inplace && !written_over.contains(pair.oldName)) ||
+                                          options.link_unchanged == LinkMode::Hardlink, pair.newName);
+            (result == LinkResult::Copied ? copied : linked)++;
+        }
+        if(!inplace) {
+            for(const std::string& name : head.emptyFiles) {
+                std::filesystem::create_directories((dest / name).parent_path());
+                std::ofstream(dest / name, std::ios::binary | std::ios::trunc);
+            }
+        }
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+    dwhbll::console::info("{} files are the same as an old one: {} linked, {} copied, {} left as they are",
+                          linked + copied, linked, copied, skipped);
+}
 
-        cur_out_file = &diff.headData.newFiles[i];
-        std::filesystem::path destionation_file = destionation_dir / cur_out_file->name;
-        if(inplace) {
-            dwhbll::console::info("[{}/{}] Patching {} inplace", i + 1, diff.headData.newFiles.size(),
-                                  (destionation_file).string());
+void Patcher::place_same_files(const std::filesystem::path& staging) {
+    const HeadData& head = diff.headData;
+    if(head.sameFiles.empty() && head.emptyFiles.empty())
+        return;
+
+    std::unordered_set<std::string_view> new_names;
+    for(const auto& file : head.newFiles)
+        new_names.insert(file.name);
+    for(const auto& pair : head.sameFiles)
+        new_names.insert(pair.newName);
+    for(const auto& name : head.emptyFiles)
+        new_names.insert(name);
+
+    u64 moved = 0, deleted = 0;
+    try {
+        for(size_t i = 0; i < head.sameFiles.size(); i++) {
+            const SameFilePair& pair = head.sameFiles[i];
+            if(same_up_to_date[i] || pair.oldName == pair.newName)
+                continue;
+            std::filesystem::path to = source / pair.newName;
+            std::filesystem::create_directories(to.parent_path());
+            std::error_code ec;
+            std::filesystem::rename(staging / pair.newName, to, ec);
+            // Moved by the run that was interrupted
+            if(ec && !(ec == std::errc::no_such_file_or_directory && journal && journal->resumed))
+                throw std::filesystem::filesystem_error("Failed to move", staging / pair.newName, to, ec);
+            if(!ec)
+                moved++;
         }
-        else {
-            dwhbll::console::info("[{}/{}] Patching {}", i + 1, diff.headData.newFiles.size(),
-                                  (destionation_file).string());
+        for(const std::string& name : head.emptyFiles) {
+            std::filesystem::create_directories((source / name).parent_path());
+            std::ofstream(source / name, std::ios::binary | std::ios::trunc);
         }
+        if(options.delete_removed) {
+            for(const SameFilePair& pair : head.sameFiles) {
+                if(!new_names.contains(pair.oldName) && std::filesystem::remove(source / pair.oldName))
+                    deleted++;
+            }
+        }
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+    dwhbll::console::info("{} same files moved and {} empty files made in place, {} old names deleted", moved,
+                          head.emptyFiles.size(), deleted);
+}
 
-        FILE* cur = fopen(destionation_file.c_str(), "w");
-        if(!cur)
-            error(std::format("Error opening file: {} ({})", destionation_file.string(),
-                              strerror(errno)));
+void Patcher::write_undo_log(OldFiles& old) {
+    // Written by the run that was interrupted
+    if(journal && journal->resumed && std::filesystem::exists(options.undo_log)) {
+        dwhbll::console::info("Keeping the undo log {}", options.undo_log.string());
+        return;
+    }
+    if(journal && journal->resumed)
+        error("An interrupted patch can't get an undo log anymore, some old files may already be gone");
 
-        while(written < cur_out_file->fileSize) {
-            u64 remaining = cur_out_file->fileSize - written;
+    std::unordered_set<std::string_view> new_names;
+    for(size_t i = 0; i < diff.headData.newFiles.size(); i++) {
+        if(up_to_date[i])
+            new_names.insert(diff.headData.newFiles[i].name);
+    }
+    for(size_t i = 0; i < diff.headData.sameFiles.size(); i++) {
+        const SameFilePair& pair = diff.headData.sameFiles[i];
+        if(same_up_to_date[i] && pair.oldName != pair.newName)
+            new_names.insert(pair.newName);
+    }
+    for(const auto& file : diff.headData.oldFiles) {
+        if(new_names.contains(file.name))
+            error(std::format("The old version of {} is already gone, it can't go in the undo log", file.name));
+    }
+    for(const auto& name : diff.headData.otherOldFiles) {
+        if(new_names.contains(name))
+            error(std::format("The old version of {} is already gone, it can't go in the undo log", name));
+    }
 
-            if(read_from_new_data == 0 && cover_idx < covers.size()) {
-                // Reading a cover
-                CoverBuf::Cover& cov = covers[cover_idx];
-                old_pos += cov.oldPos;
+    dwhbll::console::info("Writing the undo log to {}", options.undo_log.string());
+    try {
+        UndoLog log = UndoLog::write(options.undo_log, plan, diff, old, source, options.delete_removed);
+        dwhbll::console::info("Undo log: {} old files, {} found in the new files, {} stored in {}", log.files,
+                              format_size(log.referenced), format_size(log.stored), format_size(log.compressed));
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+}
 
-                u64 to_write = std::min(cov.length, remaining);
+void Patcher::check_space(const std::filesystem::path& destination_dir, u64 extra) {
+    struct Device {
+        std::filesystem::path example;
+        u64 block;
+        u64 available;
+        u64 needed = 0;
+    };
+    std::map<dev_t, Device> devices;
+
+    auto device = [&](const std::filesystem::path& dir) -> Device& {
+        struct stat st;
+        struct statvfs vfs;
+        if(stat(dir.c_str(), &st) != 0 || statvfs(dir.c_str(), &vfs) != 0)
+            error(std::format("Failed to check free space for {} ({})", dir.string(), strerror(errno)));
+
+        auto [it, inserted] = devices.try_emplace(st.st_dev);
+        if(inserted)
+            it->second = { dir, vfs.f_frsize, static_cast<u64>(vfs.f_bavail) * vfs.f_frsize };
+        return it->second;
+    };
 
-                update_file(old_pos);
-                if(copy_file_range(fileno(cur_in_file.ptr), nullptr, fileno(cur), 
-                                   nullptr, to_write, 0) != to_write) {
-                    error(std::format("Failed to copy data from {} to {} ({})",
-                                      (source / cur_in_file.file->name).string(),
-                                      destionation_file.string(), strerror(errno)));
-                }
-                if(fflush(cur) != 0) {
-                    error(std::format("Failed to flush file stream: {} ({})", 
-                                      destionation_file.string(), strerror(errno)));
-                }
+    for(size_t i = 0; i < diff.headData.newFiles.size(); i++) {
+        const DiffFile& file = diff.headData.newFiles[i];
+        if(up_to_date[i])
+            continue;
+        std::filesystem::path path = destination_dir / file.name;
+        Device& dev = device(path.parent_path());
+
+        u64 needed = (file.fileSize + dev.block - 1) / dev.block * dev.block;
+        // Whatever is already there gets truncated first
+        struct stat st;
+        if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            needed -= std::min<u64>(needed, static_cast<u64>(st.st_blocks) * 512);
+        dev.needed += needed;
+    }
+    if(extra > 0)
+        device(destination_dir).needed += extra;
+
+    for(const auto& [id, dev] : devices) {
+        dwhbll::console::debug("{} needs {}, {} available", dev.example.string(),
+                               format_size(dev.needed), format_size(dev.available));
+        if(dev.needed > dev.available) {
+            error(std::format("Not enough space on the filesystem of {}: the new files need {}, only {} is available",
+                              dev.example.string(), format_size(dev.needed), format_size(dev.available)));
+        }
+    }
+}
 
-                written += to_write;
-                old_pos += to_write;
-
-                // I would assume that a cover will never go over file boundaries
-                // but knowing how cursed this software is, that's not impossible
-                if(remaining == to_write && remaining != cov.length) {
-                    // We have written until the file end, but a part of the cover is still left
-                    read_from_new_data = 0;
-                    cov.length -= to_write;
-                    cov.oldPos = 0;
-                    cov.newPos = 0;
-                }
-                else {
-                    // We have read the whole cover
-                    if(cover_idx + 1 < covers.size())
-                        read_from_new_data = covers[cover_idx + 1].newPos;
-                    cover_idx++;
+void Patcher::run_disk_order(OldFiles& old, const std::filesystem::path& destination_dir, bool inplace) {
+    std::vector<std::filesystem::path> outputs;
+    for(const auto& file : diff.headData.newFiles)
+        outputs.push_back(destination_dir / file.name);
+
+    DiskScheduler scheduler(old, plan, outputs, options);
+
+    for(size_t i = 0; i < diff.headData.newFiles.size(); i++) {
+        cur_out_file = &diff.headData.newFiles[i];
+        try {
+            if(up_to_date[i]) {
+                dwhbll::console::info("[{}/{}] {} is already up to date", i + 1, diff.headData.newFiles.size(),
+                                      outputs[i].string());
+                u64 length = 0;
+                for(const PlanOp& op : plan.file(i)) {
+                    if(op.kind == PlanOp::NEW_DATA)
+                        length += op.length;
                 }
+                newData->skip(length);
             }
             else {
-                u64 to_write = remaining;
-                if(cover_idx < covers.size()) {
-                    to_write = std::min(remaining, read_from_new_data);
-                }
-                std::vector<u8> v(to_write);
-                read(v.data(), to_write);
-                if(fwrite(reinterpret_cast<char*>(v.data()), 1, to_write, cur) != to_write) {
-                    error(std::format("Failed to write to file: {} ({})", 
-                                      destionation_file.string(), strerror(errno)));
-                }
-                if(fflush(cur) != 0) {
-                    error(std::format("Failed to flush file stream: {} ({})", 
-                                      destionation_file.string(), strerror(errno)));
-                }
-                read_from_new_data -= to_write;
-                written += to_write;
+                dwhbll::console::info("[{}/{}] Writing new data of {}{}", i + 1, diff.headData.newFiles.size(),
+                                      outputs[i].string(), inplace ? " inplace" : "");
+                scheduler.write_new_data(i, cur_out_file->fileSize, *newData);
             }
+        } catch(const std::exception& e) {
+            error(e.what());
+        }
+    }
+
+    cur_out_file = nullptr;
+    dwhbll::console::info("Copying covers in old file order");
+    try {
+        scheduler.copy_covers();
+        // Every old file is read until the last cover, nothing could be published earlier
+        for(size_t i = 0; publish && i < diff.headData.newFiles.size(); i++)
+            publish->done(old, i, up_to_date[i]);
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+    if(progress)
+        progress(diff.headData.newFiles.size(), diff.headData.newFiles.size());
+
+    u64 saved = scheduler.stream_seek > scheduler.sorted_seek
+                ? scheduler.stream_seek - scheduler.sorted_seek : 0;
+    dwhbll::console::info("Old data seek distance: {} in diff order, {} in disk order ({} saved)",
+                          format_size(scheduler.stream_seek), format_size(scheduler.sorted_seek),
+                          format_size(saved));
+    dwhbll::console::debug("Prefetched {} of old data, evicted {}", format_size(scheduler.prefetched),
+                           format_size(scheduler.evicted));
+}
+
+void Patcher::patch(bool inplace) {
+    dwhbll::console::debug("Plan: {}", plan.summary());
+
+    bool no_tmp = inplace && options.no_tmp;
+    if(diff_id.empty()) {
+        try {
+            diff_id = Journal::identify(diff_file);
+        } catch(const std::exception& e) {
+            error(e.what());
+        }
+    }
+    std::filesystem::path journal_path = (inplace ? source : dest) / Journal::NAME;
+    std::optional<Journal> run_journal;
+    // The disk schedule only finishes files at the very end and --no-tmp can't go back
+    if(options.journal && !no_tmp && options.schedule == Schedule::Stream) {
+        try {
+            run_journal.emplace(journal_path, diff_id, options.checkpoint);
+        } catch(const std::exception& e) {
+            error(e.what());
+        }
+        journal = &*run_journal;
+        plan.split(journal->interval);
+    }
+    else if(std::filesystem::exists(journal_path)) {
+        error(std::format("{} is the journal of an interrupted patch, run it again the same way to resume "
+                          "or delete the journal", journal_path.string()));
+    }
+
+    std::filesystem::path destionation_dir = dest;
+    if(no_tmp) {
+        destionation_dir = source;
+        dwhbll::console::info("Patching inplace, writing over the old files");
+    }
+    else if(inplace) {
+        destionation_dir = journal && journal->resumed ? source / journal->tmp_dir : get_tmp_dir(source);
+        dwhbll::console::info("Patching inplace to {} (temporary dir)", destionation_dir.string());
+    }
+
+    if(journal && journal->resumed) {
+        dwhbll::console::info("Resuming an interrupted patch from {}, {} files done", journal_path.string(),
+                              journal->resume.file);
+    }
+    else if(journal) {
+        // Before the temporary dir exists, so a rerun knows about it whenever it was interrupted
+        try {
+            std::filesystem::create_directories(journal_path.parent_path());
+            journal->start(diff_id, inplace ? destionation_dir.filename().string() : "");
+        } catch(const std::exception& e) {
+            error(e.what());
         }
+    }
 
-        dwhbll::console::info("[{}/{}] Patched {}", i + 1, 
-                              diff.headData.newFiles.size(), 
-                              (dest / cur_out_file->name).string());
+    std::filesystem::create_directories(destionation_dir);
+    for(const auto &dir : diff.headData.newDirs) {
+        std::filesystem::create_directories(destionation_dir / dir.name);
     }
+    if(journal)
+        catch_signals();
 
-    if(inplace) {
-        dwhbll::console::info("Merging temporary directory {} with {}", 
-                              destionation_dir.string(), source.string());
-        merge_dirs(source, destionation_dir);
+    // With -i the final place of a new file is its old path
+    find_up_to_date(inplace ? source : dest, inplace, journal ? journal->resume.file : 0);
+    check_same_size();
+
+    OldFiles old(source, diff.headData.oldFiles, old_fds);
+    if(add_old_files) {
+        try {
+            add_old_files(old, destionation_dir);
+        } catch(const std::exception& e) {
+            error(e.what());
+        }
+    }
+    // Before --no-tmp moves covers to the spill file
+    if(inplace && !options.undo_log.empty())
+        write_undo_log(old);
+
+    InplaceSpill spill;
+    std::optional<EarlyPublish> early_publish;
+    if(no_tmp) {
+        // Covers have to be read in stream order and the writes have to stay behind them,
+        // which only the buffered engine guarantees. Copy is the default, anything else was asked for
+        if(options.schedule == Schedule::Disk)
+            dwhbll::console::warn("--no-tmp can't use --schedule disk, using the stream schedule");
+        if(options.engine != EngineKind::Copy && options.engine != EngineKind::Buffered)
+            dwhbll::console::warn("--no-tmp only works with the buffered engine, ignoring -e");
+        options.schedule = Schedule::Stream;
+        options.engine = EngineKind::Buffered;
+        options.overwrite = true;
+
+        spill = InplaceSpill::build(plan, diff, old.count());
+        dwhbll::console::info("{} already in place and left alone, {} covers read data that is overwritten "
+                              "before they run, {} spilled to {}", format_size(spill.kept), spill.covers,
+                              format_size(spill.size), spill.in_memory(options.spill_memory) ? "memory" : "disk");
+    }
+
+    if(options.check_space)
+        check_space(destionation_dir, spill.in_memory(options.spill_memory) ? 0 : spill.size);
+
+    // Before EarlyPublish can delete an old file a pair still needs. --no-tmp has no
+    // temporary dir to stage them in, they get one of their own
+    std::filesystem::path staging = inplace ? destionation_dir : dest;
+    if(no_tmp && !diff.headData.sameFiles.empty())
+        staging = get_tmp_dir(source);
+    stage_same_files(staging, inplace);
+
+    try {
+        if(spill.size > 0)
+            old.add("(spill)", spill.create(old, source, options.spill_memory), spill.size);
+        if(inplace) {
+            early_publish.emplace(plan, diff, source, destionation_dir, options.delete_removed, journal != nullptr);
+            publish = &*early_publish;
+            publish->start(old);
+        }
+    } catch(const std::exception& e) {
+        error(e.what());
+    }
+
+    if(options.schedule == Schedule::Disk) {
+        run_disk_order(old, destionation_dir, inplace);
+    }
+    else {
+        switch(options.engine) {
+            case EngineKind::Copy:
+                run<CopyEngine>(old, destionation_dir, inplace);
+                break;
+            case EngineKind::Mmap:
+                run<MmapEngine>(old, destionation_dir, inplace);
+                break;
+            case EngineKind::Uring: {
+#ifdef DPATCHZ_HAVE_IO_URING
+                std::string reason = UringEngine::unsupported_reason(options);
+                if(reason.empty()) {
+                    run<UringEngine>(old, destionation_dir, inplace);
+                    break;
+                }
+#else
+                std::string reason = "not built with io_uring support";
+#endif
+                dwhbll::console::warn("io_uring engine unavailable ({}), using the copy engine", reason);
+                run<CopyEngine>(old, destionation_dir, inplace);
+                break;
+            }
+            case EngineKind::Buffered:
+                run<BufferedEngine>(old, destionation_dir, inplace);
+                break;
+            case EngineKind::Adaptive:
+                run<AdaptiveEngine>(old, destionation_dir, inplace);
+                break;
+            case EngineKind::Direct:
+                // Prefetching would only fill the page cache the reads skip
+                options.prefetch = 0;
+                run<DirectEngine>(old, destionation_dir, inplace);
+                break;
+        }
+    }
+
+    if(inplace)
+        place_same_files(staging);
+    if(!inplace && options.link_unchanged != LinkMode::None)
+        link_unchanged();
+    if(publish && (publish->published > 0 || publish->deleted > 0)) {
+        dwhbll::console::info("{} new files moved in place, {} removed old files deleted",
+                              publish->published, publish->deleted);
+    }
+    // Every file has been moved out of it already, only the directories are left
+    if(inplace && !no_tmp)
+        std::filesystem::remove_all(destionation_dir);
+    else if(inplace && staging != destionation_dir)
+        std::filesystem::remove_all(staging);
+    // Still under the journal, a run interrupted before it's sealed seals it when resumed
+    if(inplace && !options.undo_log.empty()) {
+        try {
+            UndoLog::seal(options.undo_log, source);
+        } catch(const std::exception& e) {
+            error(e.what());
+        }
     }
+    if(journal)
+        journal->remove();
 
     dwhbll::console::info("Everything patched with success (hopefully)");
 }
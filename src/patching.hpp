@@ -1,60 +1,341 @@
 #pragma once
 
+#include "journal.hpp"
 #include "parsing.hpp"
+#include "plan.hpp"
 
+#include <concepts>
 #include <format>
+#include <functional>
+
+class EarlyPublish;
 
 static size_t CHUNK_SIZE = ZSTD_DStreamInSize();
 
-struct File {
-    FILE* ptr;
-    DiffFile* file;
+enum class EngineKind {
+    // copy_file_range between old and new files, new data through a small buffer
+    Copy,
+    // Old files mapped read-only, new files mapped read-write
+    Mmap,
+    // Batched asynchronous requests through io_uring, falls back to Copy when unavailable
+    Uring,
+    // pread/pwrite through a large write buffer
+    Buffered,
+    // Chooses between inlining, buffering and copy_file_range for every cover
+    Adaptive,
+    // O_DIRECT reads and writes through aligned buffers, bypasses the page cache
+    Direct,
 };
 
-class Patcher {
+enum class Schedule {
+    // Every new file written front to back, in the order of the diff
+    Stream,
+    // New data first, then every cover sorted by old file and offset
+    Disk,
+};
+
+enum class LinkMode {
+    // Only the files of the diff end up in new_path
+    None,
+    // Unchanged files are reflinked into new_path, copied where that's not supported
+    Reflink,
+    // Unchanged files are hardlinked, reflinked or copied across filesystems
+    Hardlink,
+};
+
+struct PatchOptions {
+    EngineKind engine = EngineKind::Copy;
+    Schedule schedule = Schedule::Stream;
+    // Buffers in flight for the io_uring engine
+    u32 queue_depth = 32;
+    // Adaptive engine: covers up to this size are always read into the write buffer
+    u64 inline_threshold = 16 << 10;
+    // Adaptive engine: covers from this size up always use copy_file_range when aligned
+    u64 zero_copy_threshold = 4 << 20;
+    // Write buffer size for the copy, buffered and adaptive engines
+    u64 write_buffer = 8 << 20;
+    // How far ahead of the current cover old data is prefetched, 0 disables
+    u64 prefetch = 32 << 20;
+    // Drop old data from the page cache once no later cover needs it
+    bool evict_old = false;
+    // Dirty bytes of an output after which they are written back and dropped from the
+    // page cache, 0 leaves it to the kernel. Not used by the io_uring engine
+    u64 writeback_window = 0;
+    // Runs of zeros in the new data at least this long become holes in the output, 0 writes
+    // them. The mmap, direct and io_uring engines always write them
+    u64 hole_threshold = 64 << 10;
+    // Memory for old data referenced by several covers, 0 disables
+    u64 hot_cache = 64 << 20;
+    // Check there is room for every new file before writing anything
+    bool check_space = true;
+    // -i: write the new files straight over the old ones instead of through a temporary dir
+    bool no_tmp = false;
+    // Old data that would be overwritten before it's read is kept in memory up to this size,
+    // in a file next to the old ones beyond it
+    u64 spill_memory = 256 << 20;
+    // -i: delete old files that have no new version once nothing reads them anymore
+    bool delete_removed = false;
+    // Record progress so an interrupted patch can be resumed
+    bool journal = true;
+    // Bytes of output between journal commits
+    u64 checkpoint = 256 << 20;
+    // md5 manifest of the new files, the ones already matching it are not written again.
+    // Empty disables
+    std::filesystem::path skip_existing;
+    // Out of place: how the files the diff doesn't touch get into new_path
+    LinkMode link_unchanged = LinkMode::None;
+    // -i: where to write an undo log before patching, empty for none
+    std::filesystem::path undo_log;
+    // Outputs are opened without truncating and cut to size when closed, because the old
+    // file at the same path may still be read. Only the buffered engine supports it
+    bool overwrite = false;
+};
+
+// Read-only descriptors of old files shared by the patches of one process, e.g. the jobs of a
+// batch on the same old tree, so each file is opened once. Thread safe
+class OldFdTable {
 private:
-    std::filesystem::path source;
-    std::filesystem::path dest;
+    struct Entry {
+        int fd;
+        u32 users = 0;
+        u64 last_use = 0;
+    };
 
-    DirDiff diff;
-    std::ifstream mem;
+    // Descriptors nothing uses kept open past this are closed, the least recently used first
+    static constexpr size_t MAX_IDLE = 256;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    size_t idle = 0;
+    u64 uses = 0;
+
+public:
+    // Opens and reuses, for the stats
+    u64 opened = 0, reused = 0;
+
+    OldFdTable() = default;
+    ~OldFdTable();
+
+    OldFdTable(const OldFdTable&) = delete;
+    OldFdTable& operator=(const OldFdTable&) = delete;
+
+    // The descriptor of `path`, opened if nobody has it yet. Throws if it can't be opened
+    int acquire(const std::filesystem::path& path);
+    void release(const std::filesystem::path& path);
+    // Closes what is open under `dir`, before and after a patch writes there. Nothing may
+    // be using those descriptors
+    void forget(const std::filesystem::path& dir);
+};
+
+// Lazily opened read-only descriptors for the files of the old tree
+class OldFiles {
+private:
+    static constexpr int RELEASED = -2;
+
+    std::vector<std::filesystem::path> paths;
+    std::vector<u64> sizes;
+    std::vector<int> fds;
+    // Files of the diff get their descriptor from here if set, the ones added later don't
+    OldFdTable* shared;
+    size_t shared_count = 0;
+
+public:
+    OldFiles(std::filesystem::path root_, const std::vector<DiffFile>& files_, OldFdTable* shared_ = nullptr);
+    ~OldFiles();
+
+    OldFiles(const OldFiles&) = delete;
+    OldFiles& operator=(const OldFiles&) = delete;
+
+    int fd(size_t index);
+    // Closes the descriptor of a file nothing is going to read anymore
+    void release(size_t index);
+    // Adds a file that is already open, it is closed with the others. Returns its index
+    size_t add(std::filesystem::path path, int fd, u64 size);
+    size_t count() const { return paths.size(); }
+    const std::filesystem::path& path(size_t index) const { return paths[index]; }
+    u64 size(size_t index) const { return sizes[index]; }
+};
+
+// Where engines get the bytes of new_data from
+class ByteSource {
+public:
+    virtual ~ByteSource() = default;
+
+    // Fills `buf` with the next `size` bytes, throws if there aren't that many
+    virtual u64 read(u8* buf, size_t size) = 0;
+};
+
+// Bytes that are already in memory
+class MemorySource : public ByteSource {
+private:
+    const u8* data;
+    u64 size;
+    u64 pos = 0;
+
+public:
+    MemorySource(const u8* data_, u64 size_) : data(data_), size(size_) {}
+
+    u64 read(u8* buf, size_t n) override {
+        if(n > size - pos)
+            throw std::runtime_error("Read past the end of a memory source");
+        std::memcpy(buf, data + pos, n);
+        pos += n;
+        return n;
+    }
+};
+
+// The new data of a diff, read front to back
+class NewData : public ByteSource {
+public:
+    // Bytes read or skipped so far
     u64 current_index = 0;
-    File cur_in_file;
-    DiffFile* cur_out_file;
 
+    // Goes past the next `size` bytes without keeping them
+    virtual void skip(u64 size);
+};
+
+// The zstd compressed newData section of the diff. Its decompression contexts are kept for
+// the next stream of the process, with the window they allocated
+class NewDataStream : public NewData {
+private:
+    std::ifstream mem;
     ZSTD_DStream* dstream = nullptr;
     std::vector<u8> inBuf;
     ZSTD_inBuffer input = { nullptr, 0, 0 };
 
-    u64 read(u8* buf, size_t size);
+public:
+    NewDataStream(const std::filesystem::path& diff_file, u64 offset);
+    ~NewDataStream();
+
+    NewDataStream(const NewDataStream&) = delete;
+    NewDataStream& operator=(const NewDataStream&) = delete;
 
-    [[noreturn]] void error(const std::string& message) const;
-    void merge_dirs(const std::filesystem::path& a, const std::filesystem::path& b);
+    u64 read(u8* buf, size_t size) override;
+};
 
-    void update_file(u64 offset);
+// What Patcher::run needs from an I/O engine
+template <typename E>
+concept IoEngine = std::constructible_from<E, OldFiles&, const PatchOptions&> &&
+    requires(E e, const std::filesystem::path& path, ByteSource& source, size_t index, u64 n) {
+        // Creates the output file, `n` is its final size
+        e.open(path, n);
+        // Copies `n` bytes of an old file: (old file, old offset, output offset, length)
+        e.cover(index, n, n, n);
+        // Writes the next `n` bytes of a source (the new data, or cached old data) at an
+        // output offset
+        e.new_data(source, n, n);
+        // Everything passed so far is in the output file when it returns, for checkpoints
+        e.flush();
+        // Finishes the output file, everything must be written when it returns
+        e.close();
+    };
 
+// Why Patcher::patch() stopped. `file` is the new file it was writing, if any. An interrupted
+// patch throws one too, with status 130, once its journal is saved
+class PatchError : public std::runtime_error {
 public:
-    explicit Patcher(DirDiff diff, std::filesystem::path diff_file, 
-                     std::filesystem::path source_, std::filesystem::path dest_)
-        : diff(diff), mem(diff_file), inBuf(CHUNK_SIZE), source(source_), dest(dest_) {
-        if (!mem)
-            error(std::format("Failed to open diff file {}", diff_file.string()));
-
-        mem.seekg(diff.mainDiff.newDataOffset, std::ios::beg);
+    std::string file;
+    int status;
 
-        dstream = ZSTD_createDStream();
-        if (!dstream)
-            error("Failed to create ZSTD_DStream");
+    PatchError(const std::string& message, std::string file_ = "", int status_ = 1)
+        : std::runtime_error(message), file(std::move(file_)), status(status_) {}
 
-        size_t const initResult = ZSTD_initDStream(dstream);
-        if (ZSTD_isError(initResult))
-            error("ZSTD_initDStream error");
+    bool interrupted() const { return status == 130; }
+    // What the command line prints
+    std::string describe() const {
+        if(interrupted())
+            return what();
+        if(file.empty())
+            return std::format("Error while patching: {}", what());
+        return std::format("Error while patching {}: {}", file, what());
     }
+};
 
-    ~Patcher() {
-        if (dstream)
-            ZSTD_freeDStream(dstream);
-    }
+// path/tmp, or path/N.tmp for the first N that doesn't exist yet
+std::filesystem::path get_tmp_dir(std::filesystem::path path);
+
+class Patcher {
+private:
+    std::filesystem::path source;
+    std::filesystem::path dest;
+
+    DirDiff diff;
+    Plan plan;
+    PatchOptions options;
+    std::unique_ptr<NewData> newData;
+    DiffFile* cur_out_file = nullptr;
+    std::filesystem::path diff_file;
+    // Set by patch() with -i
+    EarlyPublish* publish = nullptr;
+    // Set by patch() unless --no-journal
+    Journal* journal = nullptr;
+    // What the journal knows the diff by, Journal::identify() of diff_file unless set
+    std::string diff_id;
+    // dpatchz chain: adds the old files the plan reads past the ones of the diff
+    std::function<void(OldFiles&, const std::filesystem::path&)> add_old_files;
+    // New files already in their final form, nothing is written for them
+    std::vector<bool> up_to_date;
+    // The same for the same file pairs of the diff
+    std::vector<bool> same_up_to_date;
+
+    // Throws a PatchError for the current file
+    [[noreturn]] void error(const std::string& message) const;
+    // Exits if some filesystem under destination_dir can't fit the new files written to it,
+    // plus `extra` bytes written to destination_dir itself
+    void check_space(const std::filesystem::path& destination_dir, u64 extra = 0);
+    // Checks the new files from `from` on against the --skip-existing manifest, in target_dir,
+    // and turns the covers of the ones that match into KEEP
+    void find_up_to_date(const std::filesystem::path& target_dir, bool inplace, size_t from);
+    // The old files of the same file pairs have to add up to the size the diff says, otherwise
+    // the pair list doesn't match old_path and the wrong files would get linked
+    void check_same_size();
+    // --link-unchanged, new_path gets the rest of old_path
+    void link_unchanged();
+    // The same file pairs and empty files of the diff. Out of place they're made in new_path
+    // directly, with -i the old files are hardlinked into `staging` before anything changes
+    // and place_same_files() moves them to their new paths at the end
+    void stage_same_files(const std::filesystem::path& staging, bool inplace);
+    void place_same_files(const std::filesystem::path& staging);
+    // -i --undo-log, before anything is changed
+    void write_undo_log(OldFiles& old);
+    // Journal commit, publishes the files it recorded
+    void commit(OldFiles& old, const Journal::Position* at);
+
+    template <IoEngine Engine>
+    void run(OldFiles& old, const std::filesystem::path& destination_dir, bool inplace);
+    void run_disk_order(OldFiles& old, const std::filesystem::path& destination_dir, bool inplace);
+
+public:
+    explicit Patcher(DirDiff diff_, std::filesystem::path diff_file_,
+                     std::filesystem::path source_, std::filesystem::path dest_,
+                     PatchOptions options_ = {})
+        : source(source_), dest(dest_), diff(diff_), plan(Plan::build(diff)), options(options_),
+          newData(std::make_unique<NewDataStream>(diff_file_, diff_.mainDiff.newDataOffset)),
+          diff_file(diff_file_) {}
+
+    // A diff parsed and planned elsewhere, for dpatchz chain and multi: `diff_id_` is what the
+    // journal knows it by, the new data comes from `new_data_`. `add_old_files_` adds the old
+    // files the plan reads past the ones of `diff_`, given the dir temporary files can go in
+    explicit Patcher(DirDiff diff_, Plan plan_, std::string diff_id_, std::unique_ptr<NewData> new_data_,
+                     std::filesystem::path source_, std::filesystem::path dest_, PatchOptions options_ = {},
+                     std::function<void(OldFiles&, const std::filesystem::path&)> add_old_files_ = {})
+        : source(source_), dest(dest_), diff(diff_), plan(std::move(plan_)), options(options_),
+          newData(std::move(new_data_)), diff_id(diff_id_), add_old_files(std::move(add_old_files_)) {}
+
+    // Called with the new files done so far and their total, for the progress of dpatchz daemon
+    std::function<void(size_t, size_t)> progress;
+    // Where old files are opened, shared with the other patches of dpatchz batch and daemon
+    OldFdTable* old_fds = nullptr;
 
     void patch(bool inplace);
+
+    // SIGINT and SIGTERM make the running patches stop at their next checkpoint, patch() sets
+    // it up itself when it keeps a journal. The signal is never forgotten
+    static void catch_signals();
+    static bool signalled();
+
+    // Throws if the files of a patch can't be used: the diff and old_path have to exist, new_path
+    // (empty with -i) has to be empty unless it's being resumed or checked with --skip-existing
+    static void check_paths(const std::filesystem::path& diff_file, const std::filesystem::path& source,
+                            const std::filesystem::path& dest, const PatchOptions& options);
 };
@@ -0,0 +1,153 @@
+#include "plan.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+Plan Plan::build(const DirDiff& diff) {
+    Plan plan;
+    const auto& old_files = diff.headData.oldFiles;
+    const auto& new_files = diff.headData.newFiles;
+
+    // Absolute offset of every old file in the concatenated old data
+    std::vector<u64> old_starts;
+    u64 old_total = 0;
+    for(const auto& file : old_files) {
+        old_starts.push_back(old_total);
+        old_total += file.fileSize;
+    }
+    u64 new_total = 0;
+    for(const auto& file : new_files)
+        new_total += file.fileSize;
+
+    // oldPos is relative to the end of the previous cover and newPos is the new data
+    // before the cover, turn both into absolute positions
+    struct Range {
+        u64 old_pos;
+        u64 new_pos;
+        u64 length;
+    };
+    std::vector<Range> covers;
+    i64 old_end = 0;
+    u64 new_end = 0;
+
+    for(const auto& cov : diff.mainDiff.coverBuf.covers) {
+        plan.covers_in++;
+        i64 old_pos = old_end + cov.oldPos;
+        u64 new_pos = new_end + cov.newPos;
+
+        if(old_pos < 0 || cov.length > old_total ||
+           static_cast<u64>(old_pos) > old_total - cov.length) {
+            throw std::runtime_error(std::format("Cover {} reads old data [{}, {}) but there are only {} bytes",
+                                                 plan.covers_in - 1, old_pos, old_pos + cov.length, old_total));
+        }
+        if(new_pos < new_end || cov.length > new_total || new_pos > new_total - cov.length) {
+            throw std::runtime_error(std::format("Cover {} writes new data [{}, {}) but there are only {} bytes",
+                                                 plan.covers_in - 1, new_pos, new_pos + cov.length, new_total));
+        }
+
+        old_end = old_pos + cov.length;
+        new_end = new_pos + cov.length;
+
+        if(cov.length == 0) {
+            plan.covers_dropped++;
+            continue;
+        }
+        if(!covers.empty()) {
+            Range& last = covers.back();
+            if(last.old_pos + last.length == static_cast<u64>(old_pos) &&
+               last.new_pos + last.length == new_pos) {
+                last.length += cov.length;
+                plan.covers_merged++;
+                continue;
+            }
+        }
+        covers.push_back({ static_cast<u64>(old_pos), new_pos, cov.length });
+    }
+
+    size_t file = 0;
+    u64 file_start = 0;
+    plan.file_ops.push_back(0);
+
+    auto emit = [&](PlanOp::Kind kind, u64 old_pos, u64 new_pos, u64 length) {
+        bool first = true;
+        while(length > 0) {
+            while(new_pos >= file_start + new_files[file].fileSize) {
+                file_start += new_files[file].fileSize;
+                file++;
+                plan.file_ops.push_back(plan.ops.size());
+            }
+
+            u64 n = std::min(length, file_start + new_files[file].fileSize - new_pos);
+            PlanOp op = { kind, 0, 0, new_pos - file_start, 0 };
+            if(kind == PlanOp::COVER) {
+                // Empty files share their start with the next one, upper_bound skips them
+                size_t index = std::upper_bound(old_starts.begin(), old_starts.end(), old_pos) -
+                               old_starts.begin() - 1;
+                n = std::min(n, old_starts[index] + old_files[index].fileSize - old_pos);
+                op.old_file = index;
+                op.old_offset = old_pos - old_starts[index];
+            }
+            op.length = n;
+            plan.ops.push_back(op);
+
+            if(!first)
+                plan.splits++;
+            first = false;
+            old_pos += n;
+            new_pos += n;
+            length -= n;
+        }
+    };
+
+    u64 pos = 0;
+    for(const Range& cov : covers) {
+        if(cov.new_pos > pos)
+            emit(PlanOp::NEW_DATA, 0, pos, cov.new_pos - pos);
+        emit(PlanOp::COVER, cov.old_pos, cov.new_pos, cov.length);
+        pos = cov.new_pos + cov.length;
+    }
+    if(pos < new_total)
+        emit(PlanOp::NEW_DATA, 0, pos, new_total - pos);
+
+    while(plan.file_ops.size() < new_files.size() + 1)
+        plan.file_ops.push_back(plan.ops.size());
+
+    return plan;
+}
+
+void Plan::split(u64 max_length) {
+    std::vector<PlanOp> result;
+    std::vector<size_t> result_file_ops = { 0 };
+    for(size_t index = 0; index + 1 < file_ops.size(); index++) {
+        for(PlanOp op : file(index)) {
+            while(op.length > 0) {
+                PlanOp piece = op;
+                piece.length = std::min(op.length, (op.out_offset / max_length + 1) * max_length - op.out_offset);
+                result.push_back(piece);
+                if(piece.length < op.length)
+                    splits++;
+
+                op.length -= piece.length;
+                op.out_offset += piece.length;
+                if(op.kind != PlanOp::NEW_DATA)
+                    op.old_offset += piece.length;
+            }
+        }
+        result_file_ops.push_back(result.size());
+    }
+    ops = std::move(result);
+    file_ops = std::move(result_file_ops);
+}
+
+void Plan::keep(size_t index) {
+    for(size_t i = file_ops[index]; i < file_ops[index + 1]; i++) {
+        if(ops[i].kind == PlanOp::COVER)
+            ops[i].kind = PlanOp::KEEP;
+    }
+}
+
+std::string Plan::summary() const {
+    return std::format("{} ops for {} files ({} covers in the diff, {} empty dropped, {} merged, "
+                       "{} extra ops from file boundaries)", ops.size(), file_ops.size() - 1,
+                       covers_in, covers_dropped, covers_merged, splits);
+}
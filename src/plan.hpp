@@ -0,0 +1,56 @@
+#pragma once
+
+#include "parsing.hpp"
+
+#include <span>
+#include <string>
+#include <vector>
+
+/*
+ * The cover list of a diff resolved into what actually has to be written: absolute old
+ * positions, merged where possible and split at old and new file boundaries, so engines
+ * only ever see ranges inside one old file and one new file
+ */
+struct PlanOp {
+    enum Kind : u8 {
+        // Copy `length` bytes from old file `old_file` at `old_offset`
+        COVER,
+        // Take the next `length` bytes of the new data stream
+        NEW_DATA,
+        // The output is the old file itself and already has these bytes, nothing to write
+        KEEP,
+    };
+
+    Kind kind;
+    u32 old_file;
+    u64 old_offset;
+    // Offset inside the new file
+    u64 out_offset;
+    u64 length;
+};
+
+struct Plan {
+    // Ops of every new file one after the other, in the order of the new data stream
+    std::vector<PlanOp> ops;
+    // ops of new file i are [file_ops[i], file_ops[i + 1])
+    std::vector<size_t> file_ops;
+
+    // What the optimization did, for -v
+    u64 covers_in = 0;
+    u64 covers_dropped = 0;
+    u64 covers_merged = 0;
+    u64 splits = 0;
+
+    std::span<const PlanOp> file(size_t index) const {
+        return { ops.data() + file_ops[index], ops.data() + file_ops[index + 1] };
+    }
+
+    // Throws std::runtime_error when the covers don't fit in the old or new data
+    static Plan build(const DirDiff& diff);
+    // Cuts every op longer than `max_length` into pieces, at multiples of it in the output
+    void split(u64 max_length);
+    // Every cover of new file `index` becomes KEEP, for an output that already has its final
+    // content. Its new data still has to be skipped in the stream
+    void keep(size_t index);
+    std::string summary() const;
+};
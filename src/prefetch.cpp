@@ -0,0 +1,105 @@
+#include "prefetch.hpp"
+
+#include <map>
+
+#include <fcntl.h>
+
+static constexpr u64 PAGE = 4096;
+// Reads closer than this to each other are advised with one call
+static constexpr u64 MERGE_GAP = 64 << 10;
+
+Prefetcher::Prefetcher(OldFiles& old_, std::vector<Range> reads_, const PatchOptions& options)
+    : old(old_), reads(std::move(reads_)), window(options.prefetch), evict(options.evict_old) {
+    if(!evict)
+        return;
+
+    // Walking backwards, the part of a read that no read after it touches is dead once
+    // it's done. `seen` has the ranges of every later read, merged, per old file
+    std::vector<std::map<u64, u64>> seen(old.count());
+    std::vector<std::vector<Range>> found(reads.size());
+
+    for(size_t i = reads.size(); i-- > 0;) {
+        const Range& r = reads[i];
+        auto& set = seen[r.old_file];
+        u64 start = r.offset;
+        u64 end = r.offset + r.length;
+
+        auto it = set.upper_bound(start);
+        if(it != set.begin() && std::prev(it)->second >= start)
+            it = std::prev(it);
+
+        u64 pos = start;
+        u64 merged_start = start;
+        u64 merged_end = end;
+        while(it != set.end() && it->first <= end) {
+            if(it->first > pos)
+                found[i].push_back({ r.old_file, pos, it->first - pos });
+            pos = std::max(pos, it->second);
+            merged_start = std::min(merged_start, it->first);
+            merged_end = std::max(merged_end, it->second);
+            it = set.erase(it);
+        }
+        if(pos < end)
+            found[i].push_back({ r.old_file, pos, end - pos });
+        set[merged_start] = merged_end;
+    }
+
+    for(auto& ranges : found) {
+        dead_start.push_back(dead.size());
+        dead.insert(dead.end(), ranges.begin(), ranges.end());
+    }
+    dead_start.push_back(dead.size());
+}
+
+void Prefetcher::advise(size_t old_file, u64 start, u64 end, int advice) {
+    // Hints only, failing is fine
+    posix_fadvise(old.fd(old_file), start, end - start, advice);
+}
+
+void Prefetcher::before(size_t i) {
+    if(window == 0)
+        return;
+
+    size_t file = SIZE_MAX;
+    u64 start = 0;
+    u64 end = 0;
+    while(next < reads.size() && (next <= i || ahead < window)) {
+        const Range& r = reads[next++];
+        ahead += r.length;
+        prefetched += r.length;
+
+        if(r.old_file == file && r.offset + MERGE_GAP >= start && r.offset <= end + MERGE_GAP) {
+            start = std::min(start, r.offset);
+            end = std::max(end, r.offset + r.length);
+            continue;
+        }
+        if(file != SIZE_MAX)
+            advise(file, start, end, POSIX_FADV_WILLNEED);
+        file = r.old_file;
+        start = r.offset;
+        end = r.offset + r.length;
+    }
+    if(file != SIZE_MAX)
+        advise(file, start, end, POSIX_FADV_WILLNEED);
+}
+
+void Prefetcher::after(size_t i) {
+    if(window > 0)
+        ahead -= std::min(ahead, reads[i].length);
+    if(!evict)
+        return;
+
+    for(size_t d = dead_start[i]; d < dead_start[i + 1]; d++) {
+        const Range& r = dead[d];
+        // Only whole pages, the ones on the edges may still be needed by a neighbour.
+        // The last page of the file is ours entirely though
+        u64 start = (r.offset + PAGE - 1) & ~(PAGE - 1);
+        u64 end = r.offset + r.length;
+        if(end != old.size(r.old_file))
+            end &= ~(PAGE - 1);
+        if(end <= start)
+            continue;
+        advise(r.old_file, start, end, POSIX_FADV_DONTNEED);
+        evicted += end - start;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "patching.hpp"
+
+/*
+ * Tells the kernel about the old data we're going to read, from the list of cover reads
+ * in the order they will happen. Ranges up to `window` bytes ahead get WILLNEED, and with
+ * `evict` set whatever no later read touches gets DONTNEED once it has been read, so a
+ * big patch doesn't push everything else out of the page cache
+ */
+class Prefetcher {
+public:
+    struct Range {
+        size_t old_file;
+        u64 offset;
+        u64 length;
+    };
+
+private:
+    OldFiles& old;
+    std::vector<Range> reads;
+    u64 window;
+    bool evict;
+
+    // First read not advised yet, and how many advised bytes haven't been read
+    size_t next = 0;
+    u64 ahead = 0;
+
+    // Ranges read for the last time by reads[i]: dead[dead_start[i]] .. dead[dead_start[i + 1]]
+    std::vector<Range> dead;
+    std::vector<size_t> dead_start;
+
+    void advise(size_t old_file, u64 start, u64 end, int advice);
+
+public:
+    u64 prefetched = 0;
+    u64 evicted = 0;
+
+    Prefetcher(OldFiles& old_, std::vector<Range> reads_, const PatchOptions& options);
+
+    // Call around reads[i]
+    void before(size_t i);
+    void after(size_t i);
+    // Reads before i were done by an earlier run, call before the first before()
+    void skip_to(size_t i) { next = i; }
+};
@@ -0,0 +1,122 @@
+#include "schedule.hpp"
+#include "prefetch.hpp"
+
+#include <algorithm>
+
+DiskScheduler::DiskScheduler(OldFiles& old_, const Plan& plan_,
+                             const std::vector<std::filesystem::path>& outputs_,
+                             const PatchOptions& options_)
+    : old(old_), plan(plan_), outputs(outputs_), options(options_), window(old_),
+      new_data_buffer(options_.write_buffer), buffer(options_.write_buffer) {
+    for(Slot& slot : slots)
+        slot.out.writeback.window = options.writeback_window;
+}
+
+OutputFile& DiskScheduler::output(size_t file) {
+    uses++;
+    Slot* victim = &slots[0];
+    for(Slot& slot : slots) {
+        if(slot.file == file) {
+            slot.last_use = uses;
+            return slot.out;
+        }
+        if(slot.last_use < victim->last_use)
+            victim = &slot;
+    }
+
+    if(victim->file != SIZE_MAX)
+        victim->out.close();
+    victim->file = SIZE_MAX;
+    victim->out.open(outputs[file], false);
+    victim->file = file;
+    victim->last_use = uses;
+    return victim->out;
+}
+
+void DiskScheduler::write_new_data(size_t file, u64 size, ByteSource& stream) {
+    OutputFile out;
+    out.writeback.window = options.writeback_window;
+    out.open(outputs[file]);
+    out.preallocate(size);
+
+    for(const PlanOp& op : plan.file(file)) {
+        if(op.kind == PlanOp::NEW_DATA)
+            buffer_new_data(new_data_buffer, out, stream, op.out_offset, op.length,
+                            options.hole_threshold);
+    }
+
+    new_data_buffer.flush(out);
+    out.close();
+}
+
+void DiskScheduler::copy_covers() {
+    std::vector<u64> old_starts;
+    u64 total = 0;
+    for(size_t i = 0; i < old.count(); i++) {
+        old_starts.push_back(total);
+        total += old.size(i);
+    }
+
+    struct Ref {
+        size_t file;
+        const PlanOp* op;
+    };
+    std::vector<Ref> covers;
+    for(size_t file = 0; file + 1 < plan.file_ops.size(); file++) {
+        for(const PlanOp& op : plan.file(file)) {
+            if(op.kind == PlanOp::COVER)
+                covers.push_back({ file, &op });
+        }
+    }
+
+    auto seek_distance = [&]() {
+        u64 distance = 0;
+        u64 pos = 0;
+        for(const Ref& ref : covers) {
+            u64 start = old_starts[ref.op->old_file] + ref.op->old_offset;
+            distance += start > pos ? start - pos : pos - start;
+            pos = start + ref.op->length;
+        }
+        return distance;
+    };
+
+    stream_seek = seek_distance();
+    std::stable_sort(covers.begin(), covers.end(), [](const Ref& a, const Ref& b) {
+        if(a.op->old_file != b.op->old_file)
+            return a.op->old_file < b.op->old_file;
+        return a.op->old_offset < b.op->old_offset;
+    });
+    sorted_seek = seek_distance();
+
+    std::vector<Prefetcher::Range> reads;
+    for(const Ref& ref : covers)
+        reads.push_back({ ref.op->old_file, ref.op->old_offset, ref.op->length });
+    Prefetcher prefetcher(old, std::move(reads), options);
+
+    for(size_t i = 0; i < covers.size(); i++) {
+        const Ref& ref = covers[i];
+        prefetcher.before(i);
+        OutputFile& out = output(ref.file);
+        u64 old_offset = ref.op->old_offset;
+        u64 out_offset = ref.op->out_offset;
+        u64 length = ref.op->length;
+        while(length > 0) {
+            u64 n = std::min<u64>(length, buffer.size());
+            window.read(ref.op->old_file, old_offset, buffer.data(), n);
+            out.write(buffer.data(), n, out_offset);
+            old_offset += n;
+            out_offset += n;
+            length -= n;
+        }
+        prefetcher.after(i);
+    }
+    prefetched = prefetcher.prefetched;
+    evicted = prefetcher.evicted;
+
+    for(Slot& slot : slots) {
+        if(slot.file != SIZE_MAX) {
+            slot.file = SIZE_MAX;
+            slot.out.close();
+        }
+    }
+}
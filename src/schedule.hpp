@@ -0,0 +1,50 @@
+#pragma once
+
+#include "engines.hpp"
+
+/*
+ * Runs a plan in two passes for disks where seeking is what costs: first every output is
+ * created at its final size and the new data is written in stream order, then all covers
+ * are copied sorted by old file and offset, with positional writes into the outputs.
+ * The old tree is read front to back once instead of in whatever order the new files want
+ */
+class DiskScheduler {
+private:
+    static constexpr size_t MAX_OPEN = 64;
+
+    struct Slot {
+        size_t file = SIZE_MAX;
+        u64 last_use = 0;
+        OutputFile out;
+    };
+
+    OldFiles& old;
+    const Plan& plan;
+    const std::vector<std::filesystem::path>& outputs;
+    const PatchOptions& options;
+    OldWindow window;
+    WriteBuffer new_data_buffer;
+    std::vector<u8> buffer;
+
+    // Outputs open during the cover pass, least recently used gets closed first
+    Slot slots[MAX_OPEN];
+    u64 uses = 0;
+
+    OutputFile& output(size_t file);
+
+public:
+    // Distance travelled in the concatenated old data by the cover reads, in the order
+    // of the diff and in the order they are actually done
+    u64 stream_seek = 0;
+    u64 sorted_seek = 0;
+    u64 prefetched = 0;
+    u64 evicted = 0;
+
+    DiskScheduler(OldFiles& old_, const Plan& plan_,
+                  const std::vector<std::filesystem::path>& outputs_, const PatchOptions& options_);
+
+    // Pass 1 for new file `file`: creates it at its final size and writes its new data
+    void write_new_data(size_t file, u64 size, ByteSource& stream);
+    // Pass 2: every cover of the plan, in disk order
+    void copy_covers();
+};
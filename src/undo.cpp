@@ -0,0 +1,522 @@
+#include "undo.hpp"
+#include "engines.hpp"
+#include "journal.hpp"
+#include "manifest.hpp"
+#include "dwhbll-logging.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <unistd.h>
+
+// Written before the patch, then sealed with the md5 of every new file it reads once the
+// patch is done
+static constexpr char UNSEALED[8] = { 'D', 'P', 'Z', 'U', 'N', 'D', 'O', '1' };
+static constexpr char MAGIC[8] = { 'D', 'P', 'Z', 'U', 'N', 'D', 'O', '2' };
+static constexpr size_t NONE = SIZE_MAX;
+
+enum Entry : u8 {
+    // An old file to write back, from pieces
+    RESTORE,
+    // A file the patch added
+    REMOVE,
+    // A dir the patch added, only removed if it's empty
+    REMOVE_DIR,
+};
+
+namespace {
+
+// Bytes of the old file `length` long, from new file `source` at `offset`, or stored in the
+// log right after the piece when `source` is NONE
+struct Piece {
+    size_t source;
+    u64 offset;
+    u64 length;
+};
+
+// zstd compresses everything put in it into an output file
+class LogWriter {
+private:
+    OutputFile out;
+    ZSTD_CCtx* cctx = nullptr;
+    std::vector<u8> buffer;
+
+    void compress(const void* data, size_t size, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer input = { data, size, 0 };
+        bool done = false;
+        while(!done) {
+            ZSTD_outBuffer output = { buffer.data(), buffer.size(), 0 };
+            size_t left = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if(ZSTD_isError(left))
+                throw std::runtime_error(std::format("Failed to compress the undo log: {}",
+                                                     ZSTD_getErrorName(left)));
+            out.write(buffer.data(), output.pos, written);
+            written += output.pos;
+            done = mode == ZSTD_e_end ? left == 0 : input.pos == input.size;
+        }
+    }
+
+public:
+    u64 written = 0;
+
+    explicit LogWriter(const std::filesystem::path& path) : buffer(ZSTD_CStreamOutSize()) {
+        out.open(path);
+        cctx = ZSTD_createCCtx();
+        if(!cctx)
+            throw std::runtime_error("Failed to create ZSTD_CCtx");
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    }
+
+    ~LogWriter() {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    void put(const void* data, size_t size) {
+        compress(data, size, ZSTD_e_continue);
+    }
+
+    template <typename T>
+    void put(T value) {
+        put(&value, sizeof(value));
+    }
+
+    void put(const std::string& s) {
+        put(s.size());
+        put(s.data(), s.size());
+    }
+
+    void finish() {
+        compress(nullptr, 0, ZSTD_e_end);
+        if(fdatasync(out.fd) != 0)
+            throw std::runtime_error(std::format("Failed to sync {} ({})", out.path.string(), strerror(errno)));
+        out.close();
+    }
+};
+
+class LogReader {
+private:
+    NewDataStream stream;
+
+public:
+    explicit LogReader(const std::filesystem::path& path) : stream(path, 0) {}
+
+    void get(void* data, size_t size) {
+        stream.read(static_cast<u8*>(data), size);
+    }
+
+    template <typename T>
+    T get() {
+        T value;
+        get(&value, sizeof(value));
+        return value;
+    }
+
+    std::string get_string() {
+        std::string s(get<u64>(), '\0');
+        get(s.data(), s.size());
+        return s;
+    }
+};
+
+// Covers that put bytes of one old file somewhere in the new tree
+struct Source {
+    u64 old_offset;
+    u64 length;
+    size_t new_file;
+    u64 out_offset;
+};
+
+// Walks the old file front to back and takes each byte from the source reaching furthest
+// from there, the gaps are stored
+std::vector<Piece> pieces_of(std::vector<Source>& sources, u64 size) {
+    std::sort(sources.begin(), sources.end(), [](const Source& a, const Source& b) {
+        return a.old_offset < b.old_offset;
+    });
+
+    std::vector<Piece> pieces;
+    auto add = [&](Piece piece) {
+        if(!pieces.empty()) {
+            Piece& last = pieces.back();
+            if(last.source == piece.source && (piece.source == NONE || last.offset + last.length == piece.offset)) {
+                last.length += piece.length;
+                return;
+            }
+        }
+        pieces.push_back(piece);
+    };
+
+    const Source* best = nullptr;
+    size_t next = 0;
+    u64 pos = 0;
+    while(pos < size) {
+        for(; next < sources.size() && sources[next].old_offset <= pos; next++) {
+            const Source& s = sources[next];
+            if(!best || s.old_offset + s.length > best->old_offset + best->length)
+                best = &s;
+        }
+
+        u64 best_end = best ? std::min(best->old_offset + best->length, size) : 0;
+        if(best_end > pos) {
+            add({ best->new_file, best->out_offset + (pos - best->old_offset), best_end - pos });
+            pos = best_end;
+        }
+        else {
+            u64 gap_end = next < sources.size() ? std::min(sources[next].old_offset, size) : size;
+            add({ NONE, 0, gap_end - pos });
+            pos = gap_end;
+        }
+    }
+    return pieces;
+}
+
+// Copies the entries that follow the new files from one log to the other
+void copy_entries(LogReader& reader, LogWriter& writer) {
+    std::vector<u8> buffer(1 << 20);
+    auto copy = [&](u64 length) {
+        for(u64 done = 0; done < length;) {
+            u64 n = std::min<u64>(length - done, buffer.size());
+            reader.get(buffer.data(), n);
+            writer.put(buffer.data(), n);
+            done += n;
+        }
+    };
+
+    u64 entries = reader.get<u64>();
+    writer.put(entries);
+    for(u64 e = 0; e < entries; e++) {
+        u8 kind = reader.get<u8>();
+        writer.put(kind);
+        writer.put(reader.get_string());
+        if(kind != RESTORE)
+            continue;
+        writer.put(reader.get<u64>());
+        u64 count = reader.get<u64>();
+        writer.put(count);
+        for(u64 p = 0; p < count; p++) {
+            size_t source = reader.get<size_t>();
+            u64 offset = reader.get<u64>();
+            u64 length = reader.get<u64>();
+            writer.put(source);
+            writer.put(offset);
+            writer.put(length);
+            if(source == NONE)
+                copy(length);
+        }
+    }
+}
+
+}
+
+UndoLog UndoLog::write(const std::filesystem::path& path, const Plan& plan, const DirDiff& diff, OldFiles& old,
+                       const std::filesystem::path& root, bool delete_removed) {
+    const auto& old_files = diff.headData.oldFiles;
+    const auto& new_files = diff.headData.newFiles;
+    const auto& same_files = diff.headData.sameFiles;
+
+    // Every file there is after the patch, and before it
+    std::unordered_set<std::string_view> new_names;
+    for(const auto& file : new_files)
+        new_names.insert(file.name);
+    for(const auto& pair : same_files)
+        new_names.insert(pair.newName);
+    for(const auto& name : diff.headData.emptyFiles)
+        new_names.insert(name);
+    std::unordered_set<std::string_view> old_names;
+    for(const auto& file : old_files)
+        old_names.insert(file.name);
+    for(const auto& name : diff.headData.otherOldFiles)
+        old_names.insert(name);
+    // Same file pairs that move or copy an old file, a whole copy of it is in the new tree
+    std::unordered_set<std::string_view> unchanged;
+    std::unordered_map<std::string_view, std::string_view> copied_to;
+    for(const auto& pair : same_files) {
+        if(pair.oldName == pair.newName)
+            unchanged.insert(pair.oldName);
+        else
+            copied_to.emplace(pair.oldName, pair.newName);
+    }
+
+    std::vector<std::vector<Source>> sources(old_files.size());
+    for(size_t file = 0; file + 1 < plan.file_ops.size(); file++) {
+        for(const PlanOp& op : plan.file(file)) {
+            // KEEP ops left the bytes where they were in the new file
+            if(op.kind != PlanOp::NEW_DATA && op.old_file < old_files.size())
+                sources[op.old_file].push_back({ op.old_offset, op.length, file, op.out_offset });
+        }
+    }
+
+    UndoLog log;
+    std::vector<size_t> restored;
+    std::vector<std::vector<Piece>> pieces;
+    // New files the pieces come from, in the order they go in the log
+    std::vector<std::pair<std::string_view, u64>> used;
+    std::vector<size_t> source_of(new_files.size(), NONE);
+    for(size_t i = 0; i < old_files.size(); i++) {
+        if(!new_names.contains(old_files[i].name) && !delete_removed)
+            continue;
+        restored.push_back(i);
+        pieces.push_back(pieces_of(sources[i], old_files[i].fileSize));
+        for(Piece& piece : pieces.back()) {
+            if(piece.source == NONE) {
+                log.stored += piece.length;
+                continue;
+            }
+            log.referenced += piece.length;
+            if(source_of[piece.source] == NONE) {
+                source_of[piece.source] = used.size();
+                used.emplace_back(new_files[piece.source].name, new_files[piece.source].fileSize);
+            }
+            piece.source = source_of[piece.source];
+        }
+    }
+
+    // Old files that aren't references but still get replaced, or deleted after they were
+    // moved. They're whole in the new tree when a pair copied them, stored otherwise
+    struct Copy {
+        std::string_view name;
+        u64 size;
+        size_t source;
+    };
+    std::vector<Copy> copies;
+    for(const std::string& name : diff.headData.otherOldFiles) {
+        auto it = copied_to.find(name);
+        bool replaced = new_names.contains(name) && !unchanged.contains(name);
+        bool deleted = delete_removed && it != copied_to.end() && !new_names.contains(name);
+        if(!replaced && !deleted)
+            continue;
+
+        u64 size = std::filesystem::file_size(root / name);
+        if(it != copied_to.end()) {
+            copies.push_back({ name, size, used.size() });
+            used.emplace_back(it->second, size);
+            log.referenced += size;
+        }
+        else {
+            copies.push_back({ name, size, NONE });
+            log.stored += size;
+        }
+    }
+    log.files = restored.size() + copies.size();
+
+    // Only complete logs ever have the final name
+    std::filesystem::path partial = path;
+    partial += ".partial";
+    LogWriter writer(partial);
+    writer.put(UNSEALED, sizeof(UNSEALED));
+    writer.put(used.size());
+    for(auto [name, size] : used) {
+        writer.put(std::string(name));
+        writer.put(size);
+    }
+
+    std::vector<std::string> removed_files;
+    for(std::string_view name : new_names) {
+        if(!old_names.contains(name))
+            removed_files.emplace_back(name);
+    }
+    std::sort(removed_files.begin(), removed_files.end());
+    std::vector<std::string> removed_dirs;
+    std::unordered_set<std::string_view> old_dirs;
+    for(const auto& dir : diff.headData.oldDirs)
+        old_dirs.insert(dir.name);
+    for(const auto& dir : diff.headData.newDirs) {
+        if(!old_dirs.contains(dir.name))
+            removed_dirs.push_back(dir.name);
+    }
+    // Children before their parents
+    std::sort(removed_dirs.begin(), removed_dirs.end(), std::greater<>());
+    writer.put(restored.size() + copies.size() + removed_files.size() + removed_dirs.size());
+
+    std::vector<u8> buffer(1 << 20);
+    for(size_t r = 0; r < restored.size(); r++) {
+        size_t file = restored[r];
+        writer.put(static_cast<u8>(RESTORE));
+        writer.put(old_files[file].name);
+        writer.put(old_files[file].fileSize);
+        writer.put(pieces[r].size());
+
+        u64 pos = 0;
+        for(const Piece& piece : pieces[r]) {
+            writer.put(piece.source);
+            writer.put(piece.offset);
+            writer.put(piece.length);
+            for(u64 done = 0; piece.source == NONE && done < piece.length;) {
+                u64 n = std::min<u64>(piece.length - done, buffer.size());
+                read_old(old, file, pos + done, buffer.data(), n);
+                writer.put(buffer.data(), n);
+                done += n;
+            }
+            pos += piece.length;
+        }
+    }
+    for(const Copy& copy : copies) {
+        writer.put(static_cast<u8>(RESTORE));
+        writer.put(std::string(copy.name));
+        writer.put(copy.size);
+        writer.put(size_t(1));
+        writer.put(copy.source);
+        writer.put(u64(0));
+        writer.put(copy.size);
+        if(copy.source == NONE) {
+            std::ifstream in(root / copy.name, std::ios::binary);
+            for(u64 done = 0; done < copy.size;) {
+                u64 n = std::min<u64>(copy.size - done, buffer.size());
+                if(!in.read(reinterpret_cast<char*>(buffer.data()), n))
+                    throw std::runtime_error(std::format("Failed to read {}", (root / copy.name).string()));
+                writer.put(buffer.data(), n);
+                done += n;
+            }
+        }
+    }
+    for(const std::string& name : removed_files) {
+        writer.put(static_cast<u8>(REMOVE));
+        writer.put(name);
+    }
+    for(const std::string& name : removed_dirs) {
+        writer.put(static_cast<u8>(REMOVE_DIR));
+        writer.put(name);
+    }
+    writer.finish();
+    log.compressed = writer.written;
+
+    std::filesystem::rename(partial, path);
+    return log;
+}
+
+void UndoLog::seal(const std::filesystem::path& path, const std::filesystem::path& root) {
+    LogReader reader(path);
+    char magic[sizeof(MAGIC)];
+    reader.get(magic, sizeof(magic));
+    // By a run that was interrupted right after
+    if(std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0)
+        return;
+    if(std::memcmp(magic, UNSEALED, sizeof(UNSEALED)) != 0)
+        throw std::runtime_error(std::format("{} is not a dpatchz undo log", path.string()));
+
+    std::filesystem::path partial = path;
+    partial += ".partial";
+    LogWriter writer(partial);
+    writer.put(MAGIC, sizeof(MAGIC));
+    u64 count = reader.get<u64>();
+    writer.put(count);
+    for(u64 i = 0; i < count; i++) {
+        std::string name = reader.get_string();
+        writer.put(name);
+        writer.put(reader.get<u64>());
+        writer.put(Manifest::md5(root / name));
+    }
+    copy_entries(reader, writer);
+    writer.finish();
+
+    std::filesystem::rename(partial, path);
+}
+
+void UndoLog::rollback(const std::filesystem::path& path, const std::filesystem::path& root) {
+    if(std::filesystem::exists(root / Journal::NAME)) {
+        throw std::runtime_error(std::format("{} was interrupted in the middle of a patch, finish it before "
+                                             "rolling back", root.string()));
+    }
+
+    LogReader reader(path);
+    char magic[sizeof(MAGIC)];
+    reader.get(magic, sizeof(magic));
+    if(std::memcmp(magic, UNSEALED, sizeof(UNSEALED)) == 0) {
+        throw std::runtime_error(std::format("The patch that wrote {} never finished, there is nothing to roll "
+                                             "back yet", path.string()));
+    }
+    if(std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error(std::format("{} is not a dpatchz undo log", path.string()));
+
+    // Nothing is touched before every new file the old ones are rebuilt from is there, as
+    // the patch left it
+    std::vector<DiffFile> sources(reader.get<u64>());
+    for(DiffFile& source : sources) {
+        source.name = reader.get_string();
+        source.fileSize = reader.get<u64>();
+        std::string md5 = reader.get_string();
+
+        std::error_code ec;
+        u64 size = std::filesystem::file_size(root / source.name, ec);
+        if(ec || size != source.fileSize || Manifest::md5(root / source.name) != md5) {
+            throw std::runtime_error(std::format("{} is missing or changed since it was patched, the old files "
+                                                 "can't be rebuilt from it", (root / source.name).string()));
+        }
+    }
+    OldFiles current(root, sources);
+
+    std::filesystem::path tmp_dir = get_tmp_dir(root);
+    dwhbll::console::info("Rebuilding the old files in {}", tmp_dir.string());
+    std::filesystem::create_directories(tmp_dir);
+
+    std::vector<std::string> restored;
+    std::vector<std::string> removed_files;
+    std::vector<std::string> removed_dirs;
+    std::vector<u8> buffer(1 << 20);
+    u64 entries = reader.get<u64>();
+    for(u64 e = 0; e < entries; e++) {
+        u8 kind = reader.get<u8>();
+        std::string name = reader.get_string();
+        if(kind == REMOVE) {
+            removed_files.push_back(name);
+            continue;
+        }
+        if(kind == REMOVE_DIR) {
+            removed_dirs.push_back(name);
+            continue;
+        }
+        if(kind != RESTORE)
+            throw std::runtime_error(std::format("{} is broken, unknown entry {}", path.string(), kind));
+
+        dwhbll::console::debug("Rebuilding {}", name);
+        std::filesystem::path out_path = tmp_dir / name;
+        std::filesystem::create_directories(out_path.parent_path());
+        OutputFile out;
+        out.open(out_path);
+        out.preallocate(reader.get<u64>());
+
+        u64 pos = 0;
+        u64 count = reader.get<u64>();
+        for(u64 p = 0; p < count; p++) {
+            Piece piece;
+            reader.get(&piece.source, sizeof(piece.source));
+            piece.offset = reader.get<u64>();
+            piece.length = reader.get<u64>();
+            if(piece.source != NONE) {
+                if(piece.source >= sources.size()) {
+                    throw std::runtime_error(std::format("{} is broken, unknown source {}", path.string(),
+                                                         piece.source));
+                }
+                out.copy_from(current, piece.source, piece.offset, pos, piece.length);
+            }
+            for(u64 done = 0; piece.source == NONE && done < piece.length;) {
+                u64 n = std::min<u64>(piece.length - done, buffer.size());
+                reader.get(buffer.data(), n);
+                out.write(buffer.data(), n, pos + done);
+                done += n;
+            }
+            pos += piece.length;
+        }
+        // On disk before the renames below replace anything with it
+        if(fdatasync(out.fd) != 0)
+            throw std::runtime_error(std::format("Failed to sync {} ({})", out_path.string(), strerror(errno)));
+        out.close();
+        restored.push_back(name);
+    }
+
+    for(const std::string& name : restored) {
+        std::filesystem::create_directories((root / name).parent_path());
+        std::filesystem::rename(tmp_dir / name, root / name);
+    }
+    for(const std::string& name : removed_files)
+        std::filesystem::remove(root / name);
+    for(const std::string& name : removed_dirs) {
+        // Whatever was put there since stays
+        std::error_code ec;
+        std::filesystem::remove(root / name, ec);
+    }
+    std::filesystem::remove_all(tmp_dir);
+
+    dwhbll::console::info("{} old files restored, {} new files deleted", restored.size(), removed_files.size());
+}
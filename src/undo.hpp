@@ -0,0 +1,31 @@
+#pragma once
+
+#include "patching.hpp"
+
+/*
+ * -i --undo-log: what it takes to put the old tree back after an in place patch. Every old
+ * file the patch replaces or deletes is described as pieces of the new files, wherever a
+ * cover copied its bytes there, and only the bytes that end up in no new file are stored,
+ * zstd compressed. The log is complete and synced before the patch changes anything, and
+ * gets the md5 of the new files it reads once they are all written
+ */
+class UndoLog {
+public:
+    // Old files the log restores, and what's in them taken from new files or stored
+    u64 files = 0;
+    u64 referenced = 0;
+    u64 stored = 0;
+    // Size of the log on disk
+    u64 compressed = 0;
+
+    // Writes the log to `path` for patching the old tree at `root` in place with `plan`.
+    // Old files without a new version are only restored when `delete_removed` is set
+    static UndoLog write(const std::filesystem::path& path, const Plan& plan, const DirDiff& diff, OldFiles& old,
+                         const std::filesystem::path& root, bool delete_removed);
+    // Adds the md5 of the new files the log reads, now at `root`. Only a sealed log can be
+    // rolled back
+    static void seal(const std::filesystem::path& path, const std::filesystem::path& root);
+    // dpatchz rollback: rebuilds the old files in a temporary dir of `root` from the new ones
+    // and the log, then moves them in place and deletes the files and dirs the patch added
+    static void rollback(const std::filesystem::path& path, const std::filesystem::path& root);
+};
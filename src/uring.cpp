@@ -0,0 +1,201 @@
+#include "uring.hpp"
+
+#ifdef DPATCHZ_HAVE_IO_URING
+
+#include <format>
+#include <optional>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static u32 load_acquire(const u32* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(u32* p, u32 v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+Uring::Uring(u32 entries, u32 cq_entries) {
+    io_uring_params p = {};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(fd < 0)
+        throw std::runtime_error(std::format("io_uring_setup failed ({})", strerror(errno)));
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap)
+        sq_size = cq_size = std::max(sq_size, cq_size);
+
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+    if(sq_ptr == MAP_FAILED) {
+        sq_ptr = nullptr;
+        close(fd);
+        throw std::runtime_error(std::format("Failed to map io_uring ({})", strerror(errno)));
+    }
+
+    if(single_mmap) {
+        cq_ptr = sq_ptr;
+    }
+    else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_CQ_RING);
+        if(cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            munmap(sq_ptr, sq_size);
+            close(fd);
+            throw std::runtime_error(std::format("Failed to map io_uring ({})", strerror(errno)));
+        }
+    }
+
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if(s == MAP_FAILED) {
+        if(cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        munmap(sq_ptr, sq_size);
+        close(fd);
+        throw std::runtime_error(std::format("Failed to map io_uring ({})", strerror(errno)));
+    }
+    sqes = static_cast<io_uring_sqe*>(s);
+
+    u8* sq = static_cast<u8*>(sq_ptr);
+    sq_head = reinterpret_cast<u32*>(sq + p.sq_off.head);
+    sq_tail = reinterpret_cast<u32*>(sq + p.sq_off.tail);
+    sq_mask = *reinterpret_cast<u32*>(sq + p.sq_off.ring_mask);
+    sq_entries = *reinterpret_cast<u32*>(sq + p.sq_off.ring_entries);
+
+    // SQE slots are used in order, so the indirection array is the identity
+    u32* array = reinterpret_cast<u32*>(sq + p.sq_off.array);
+    for(u32 i = 0; i < sq_entries; i++)
+        array[i] = i;
+
+    u8* cq = static_cast<u8*>(cq_ptr);
+    cq_head = reinterpret_cast<u32*>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<u32*>(cq + p.cq_off.tail);
+    cq_mask = *reinterpret_cast<u32*>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    local_tail = *sq_tail;
+}
+
+Uring::~Uring() {
+    if(sqes)
+        munmap(sqes, sqes_size);
+    if(cq_ptr && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if(sq_ptr)
+        munmap(sq_ptr, sq_size);
+    if(fd >= 0)
+        close(fd);
+}
+
+std::string Uring::unsupported_reason() {
+    std::optional<Uring> ring;
+    try {
+        ring.emplace(2, 4);
+    } catch(const std::exception& e) {
+        return e.what();
+    }
+
+    // Opcodes used by UringEngine
+    const u8 needed[] = { IORING_OP_OPENAT, IORING_OP_FALLOCATE, IORING_OP_CLOSE,
+                          IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<u8> buf(probe_size);
+    auto* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    try {
+        ring->register_op(IORING_REGISTER_PROBE, probe, 256);
+    } catch(const std::exception& e) {
+        return e.what();
+    }
+
+    for(u8 op : needed) {
+        if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return std::format("io_uring opcode {} not supported", op);
+    }
+
+    // Opening into direct descriptors needs a sparse file table
+    try {
+        ring->register_sparse_files(1);
+    } catch(const std::exception& e) {
+        return e.what();
+    }
+
+    return "";
+}
+
+int Uring::enter(u32 to_submit, u32 min_complete) {
+    u32 flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while(true) {
+        int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+        if(r >= 0)
+            return r;
+        if(errno != EINTR)
+            throw std::runtime_error(std::format("io_uring_enter failed ({})", strerror(errno)));
+    }
+}
+
+void Uring::register_op(unsigned op, void* arg, unsigned nr) {
+    if(syscall(__NR_io_uring_register, fd, op, arg, nr) < 0) {
+        throw std::runtime_error(std::format("io_uring_register({}) failed ({})", op,
+                                             strerror(errno)));
+    }
+}
+
+u32 Uring::free_sqes() const {
+    return sq_entries - (local_tail - load_acquire(sq_head));
+}
+
+io_uring_sqe* Uring::get_sqe() {
+    if(free_sqes() == 0)
+        return nullptr;
+
+    io_uring_sqe* sqe = &sqes[local_tail & sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    local_tail++;
+    pending++;
+    return sqe;
+}
+
+void Uring::submit(u32 wait) {
+    store_release(sq_tail, local_tail);
+    u32 to_submit = pending;
+    pending = 0;
+
+    // The kernel may take fewer SQEs than asked (e.g. -EAGAIN on memory pressure),
+    // what's left stays in the ring and goes with the next call
+    u32 submitted = enter(to_submit, wait);
+    if(submitted < to_submit)
+        pending = to_submit - submitted;
+}
+
+bool Uring::pop(io_uring_cqe& cqe) {
+    u32 head = *cq_head;
+    if(head == load_acquire(cq_tail))
+        return false;
+
+    cqe = cqes[head & cq_mask];
+    store_release(cq_head, head + 1);
+    return true;
+}
+
+void Uring::register_buffers(std::span<const iovec> buffers) {
+    register_op(IORING_REGISTER_BUFFERS, const_cast<iovec*>(buffers.data()), buffers.size());
+}
+
+void Uring::register_sparse_files(u32 count) {
+    std::vector<int> files(count, -1);
+    register_op(IORING_REGISTER_FILES, files.data(), count);
+}
+
+#endif
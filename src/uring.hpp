@@ -0,0 +1,75 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+// Direct descriptors and sparse file tables only exist in recent headers
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RSRC_REGISTER_SPARSE)
+#define DPATCHZ_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef DPATCHZ_HAVE_IO_URING
+
+// Bare bones io_uring ring, talks to the kernel through the raw syscalls so that
+// we don't need liburing to build
+class Uring {
+private:
+    int fd = -1;
+
+    void* sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    u32* sq_head;
+    u32* sq_tail;
+    u32 sq_mask;
+    u32 sq_entries;
+    u32* cq_head;
+    u32* cq_tail;
+    u32 cq_mask;
+    io_uring_cqe* cqes;
+
+    // SQEs handed out by get_sqe but not yet passed to the kernel
+    u32 local_tail = 0;
+    u32 pending = 0;
+
+    int enter(u32 to_submit, u32 min_complete);
+    void register_op(unsigned op, void* arg, unsigned nr);
+
+public:
+    // Throws std::runtime_error when the kernel refuses to set up the ring
+    Uring(u32 entries, u32 cq_entries);
+    ~Uring();
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    // Empty string if the running kernel can do what UringEngine needs, otherwise why not
+    static std::string unsupported_reason();
+
+    u32 free_sqes() const;
+    // Zeroed SQE, or nullptr when the submission queue is full
+    io_uring_sqe* get_sqe();
+
+    // Passes queued SQEs to the kernel and waits for at least `wait` completions
+    void submit(u32 wait = 0);
+
+    // Copies the next completion into `cqe`, returns false if there is none
+    bool pop(io_uring_cqe& cqe);
+
+    void register_buffers(std::span<const iovec> buffers);
+    void register_sparse_files(u32 count);
+};
+
+#endif
@@ -4,9 +4,15 @@
 #include <sstream>
 #include <cstring>
 #include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <format>
+#include <optional>
+#include <string>
 #include <zstd.h>
 
 typedef uint8_t u8;
+typedef uint32_t u32;
 typedef uint64_t u64;
 typedef int64_t i64;
 
@@ -24,3 +30,66 @@ std::string format_bytes(const T* data, size_t n) {
     }
     return oss.str();
 }
+
+// Parses sizes like "4096", "64K", "256M" or "20G"
+inline std::optional<u64> parse_size(const std::string& s) {
+    // stoull would take "-1" and leading spaces
+    if(s.empty() || !std::isdigit(static_cast<unsigned char>(s[0])))
+        return std::nullopt;
+
+    size_t idx = 0;
+    u64 value;
+    try {
+        value = std::stoull(s, &idx);
+    } catch(const std::exception&) {
+        return std::nullopt;
+    }
+
+    std::string suffix = s.substr(idx);
+    int shift;
+    if(suffix.empty() || suffix == "B")
+        shift = 0;
+    else if(suffix == "K" || suffix == "k" || suffix == "KiB")
+        shift = 10;
+    else if(suffix == "M" || suffix == "MiB")
+        shift = 20;
+    else if(suffix == "G" || suffix == "GiB")
+        shift = 30;
+    else
+        return std::nullopt;
+    if(value > UINT64_MAX >> shift)
+        return std::nullopt;
+    return value << shift;
+}
+
+// 1536 -> "1.5KiB"
+inline std::string format_size(u64 size) {
+    const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = size;
+    int unit = 0;
+    while(value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    if(unit == 0)
+        return std::format("{}B", size);
+    return std::format("{:.1f}{}", value, units[unit]);
+}
+
+// True if the `size` bytes at `data` are all 0. Goes 64 bytes at a time so the compiler
+// turns it into vector ORs
+inline bool all_zero(const u8* data, size_t size) {
+    size_t i = 0;
+    for(; i + 64 <= size; i += 64) {
+        u64 w[8];
+        std::memcpy(w, data + i, 64);
+        if((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+            return false;
+    }
+    for(; i < size; i++) {
+        if(data[i] != 0)
+            return false;
+    }
+    return true;
+}
+